@@ -0,0 +1,703 @@
+/*
+ * keystore-log.c
+ * --------------
+ * Log-structured layer with wear leveling between libhal and the keystore flash.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * libhal's flash keystore updates a block by erasing a subsector it has
+ * finished with and writing the new block into it, so every update waits
+ * for a subsector erase (a quarter of a second, typically), and the
+ * blocks it keeps rewriting (the PIN block, hot keys) wear out well ahead
+ * of the rest of the chip.
+ *
+ * This layer sits between libhal and the keystore_* primitives, and keeps
+ * a map from the subsectors libhal asks for ("blocks") to the physical
+ * subsectors they currently live in:
+ *
+ * - Erasing a block just drops its mapping. The physical subsector becomes
+ *   dirty, and is erased later, in the background (keystore_log_gc_*).
+ *
+ * - The first write to an unmapped block maps it to an erased subsector,
+ *   taken round-robin from the free ones, so new data goes to the
+ *   subsector that has been free the longest, and erases are spread over
+ *   the whole chip. After that, writes go to the mapped subsector, since
+ *   libhal relies on being able to program bits to zero in place.
+ *
+ * - Reads of an unmapped block return all ones, like an erased subsector.
+ *
+ * So an update costs page programs instead of an erase plus page programs,
+ * as long as the background erases keep up.
+ *
+ * The map lives in RAM, and is made persistent by a journal in the top two
+ * sectors of the chip, one sector per half. A half starts with a
+ * checkpoint (header, map, and a bitmap of erased subsectors), followed by
+ * records of changes since: block mapped, block unmapped, subsector
+ * erased. When a half fills up, a checkpoint goes into the other half,
+ * header last, and the old half is left alone until the next checkpoint.
+ * At start-up, the valid checkpoint with the highest generation is loaded,
+ * and its records are replayed up to the first one that's blank or
+ * doesn't check out (a torn write).
+ *
+ * A block is mapped (and its record written) before it is written. The
+ * write-back cache in stm-keystore.c never reorders programs: it only
+ * merges a write into the most recently dirtied page, and writing to an
+ * older pending page first writes that page out, together with everything
+ * dirtied before it. So the record reaches the chip before any page of
+ * the block does, and if power fails in between, the block comes back
+ * mapped to an erased subsector, i.e. as if the write never happened.
+ * A subsector whose erase wasn't recorded is just erased again.
+ *
+ * With no valid checkpoint (a new chip, or one used without this layer),
+ * blocks are mapped straight through to the same subsectors, so existing
+ * data in the low KEYSTORE_LOG_NUM_BLOCKS subsectors is kept; anything
+ * above that is lost.
+ *
+ * Like the rest of the keystore API, this relies on the caller to
+ * serialize access (in the HSM, the keystore mutex).
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "stm-keystore.h"
+#include "keystore-log.h"
+
+#ifndef DO_KEYSTORE_LOG
+#error keystore-log.c needs DO_KEYSTORE_LOG, for the keystore geometry it presents
+#endif
+
+/* The primitives underneath us; see the --wrap options in the HSM Makefile. */
+extern HAL_StatusTypeDef __real_keystore_read_data(uint32_t offset, uint8_t *buf, const uint32_t len);
+extern HAL_StatusTypeDef __real_keystore_read_data_nocache(uint32_t offset, uint8_t *buf, const uint32_t len);
+extern HAL_StatusTypeDef __real_keystore_write_data(uint32_t offset, const uint8_t *buf, const uint32_t len);
+extern HAL_StatusTypeDef __real_keystore_erase_subsector(uint32_t subsector_offset);
+extern HAL_StatusTypeDef __real_keystore_erase_sector(uint32_t sector_offset);
+extern HAL_StatusTypeDef __real_keystore_erase_bulk(void);
+extern HAL_StatusTypeDef __real_keystore_erase_used(keystore_erase_progress_t progress);
+extern HAL_StatusTypeDef __real_keystore_erase_subsector_start(uint32_t subsector_offset);
+extern HAL_StatusTypeDef __real_keystore_erase_poll(void);
+extern HAL_StatusTypeDef __real_keystore_erase_wait(uint32_t timeout);
+extern HAL_StatusTypeDef __real_keystore_check_blank(uint32_t subsector_offset, int *is_blank);
+
+#define LOG_BLOCKS              KEYSTORE_LOG_NUM_BLOCKS
+#define LOG_SUBSECTORS          KEYSTORE_LOG_DATA_SUBSECTORS
+#define LOG_SUBSECTORS_PER_SECTOR (KEYSTORE_SECTOR_SIZE / KEYSTORE_SUBSECTOR_SIZE)
+
+#if LOG_BLOCKS >= LOG_SUBSECTORS
+#error The log-structured keystore needs spare subsectors
+#endif
+
+#define LOG_MAGIC               0x4b534c47      /* "KSLG" */
+#define LOG_UNMAPPED            0xFFFF          /* map entry, record subsector */
+#define LOG_RECORD_ERASED       0xFFFE          /* record block: subsector was erased */
+#define LOG_RECORD_END          0xFFFF          /* record block: blank slot */
+
+/* Layout of a journal half, in pages: header, map, erased bitmap, records. */
+#define LOG_MAP_PAGES           ((LOG_BLOCKS * sizeof(uint16_t) + KEYSTORE_PAGE_SIZE - 1) / KEYSTORE_PAGE_SIZE)
+#define LOG_BITMAP_PAGES        ((LOG_SUBSECTORS / 8 + KEYSTORE_PAGE_SIZE - 1) / KEYSTORE_PAGE_SIZE)
+#define LOG_RECORD_PAGE         (1 + LOG_MAP_PAGES + LOG_BITMAP_PAGES)
+#define LOG_RECORDS_PER_PAGE    (KEYSTORE_PAGE_SIZE / sizeof(struct log_record))
+#define LOG_JOURNAL_RECORDS     ((LOG_SUBSECTORS_PER_SECTOR * (KEYSTORE_SUBSECTOR_SIZE / KEYSTORE_PAGE_SIZE) - \
+                                  LOG_RECORD_PAGE) * LOG_RECORDS_PER_PAGE)
+
+struct log_header {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t blocks;
+    uint32_t subsectors;
+    uint32_t alloc_next;
+    uint32_t check;             /* over the above, the map and the bitmap */
+};
+
+struct log_record {
+    uint16_t block;             /* or LOG_RECORD_ERASED */
+    uint16_t subsector;         /* or LOG_UNMAPPED */
+    uint32_t check;
+};
+
+/* Written to flash straight from these, so they're padded to whole pages. */
+static uint16_t map[LOG_MAP_PAGES * KEYSTORE_PAGE_SIZE / sizeof(uint16_t)];
+static uint32_t erased[LOG_BITMAP_PAGES * KEYSTORE_PAGE_SIZE / sizeof(uint32_t)];
+
+/* Subsectors that have a block mapped to them. The rest are either erased,
+ * or dirty (waiting to be erased).
+ */
+static uint32_t used[(LOG_SUBSECTORS + 31) / 32];
+
+static int mounted;
+static unsigned half;           /* journal half in use */
+static uint32_t generation;
+static uint32_t journal_used;
+static uint32_t n_mapped, n_erased;
+static uint32_t alloc_next, gc_next;
+
+/* A background erase in progress */
+static int gc_busy;
+static uint32_t gc_subsector;
+
+static uint8_t page[KEYSTORE_PAGE_SIZE];
+
+static struct keystore_log_stats stats;
+
+static inline int bit_get(const uint32_t *bits, uint32_t i)
+{
+    return (bits[i / 32] >> (i % 32)) & 1;
+}
+
+static inline void bit_set(uint32_t *bits, uint32_t i, int value)
+{
+    if (value)
+        bits[i / 32] |= 1UL << (i % 32);
+    else
+        bits[i / 32] &= ~(1UL << (i % 32));
+}
+
+static inline int is_dirty(uint32_t subsector)
+{
+    return !bit_get(used, subsector) && !bit_get(erased, subsector);
+}
+
+static inline uint32_t half_offset(unsigned h)
+{
+    return (LOG_SUBSECTORS + h * LOG_SUBSECTORS_PER_SECTOR) * KEYSTORE_SUBSECTOR_SIZE;
+}
+
+/* FNV-1a */
+static uint32_t log_checksum(uint32_t hash, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len--)
+        hash = (hash ^ *p++) * 16777619;
+    return hash;
+}
+
+static uint32_t header_check(const struct log_header *hdr)
+{
+    uint32_t hash = log_checksum(2166136261, hdr, offsetof(struct log_header, check));
+    hash = log_checksum(hash, map, sizeof(map));
+    return log_checksum(hash, erased, sizeof(erased));
+}
+
+static uint32_t record_check(uint16_t block, uint16_t subsector)
+{
+    return ~(((uint32_t)block << 16) | subsector) ^ generation;
+}
+
+/* Point a block at a subsector (or at nothing), in RAM. */
+static void log_map(uint32_t block, uint32_t subsector)
+{
+    if (map[block] != LOG_UNMAPPED) {
+        bit_set(used, map[block], 0);
+        --n_mapped;
+    }
+
+    map[block] = subsector;
+
+    if (subsector != LOG_UNMAPPED) {
+        if (bit_get(erased, subsector)) {
+            bit_set(erased, subsector, 0);
+            --n_erased;
+        }
+        bit_set(used, subsector, 1);
+        ++n_mapped;
+        alloc_next = (subsector + 1) % LOG_SUBSECTORS;
+    }
+}
+
+static void log_erased(uint32_t subsector)
+{
+    if (is_dirty(subsector)) {
+        bit_set(erased, subsector, 1);
+        ++n_erased;
+    }
+}
+
+/* Write the state in RAM to the other journal half, and switch to it. */
+static HAL_StatusTypeDef log_checkpoint(void)
+{
+    const unsigned next = half ^ 1;
+    const uint32_t base = half_offset(next);
+    struct log_header hdr = {
+        .magic = LOG_MAGIC,
+        .generation = generation + 1,
+        .blocks = LOG_BLOCKS,
+        .subsectors = LOG_SUBSECTORS,
+        .alloc_next = alloc_next,
+    };
+    hdr.check = header_check(&hdr);
+
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, &hdr, sizeof(hdr));
+
+    if (__real_keystore_erase_sector(base / KEYSTORE_SECTOR_SIZE) != HAL_OK ||
+        __real_keystore_write_data(base + KEYSTORE_PAGE_SIZE,
+                                   (const uint8_t *)map, sizeof(map)) != HAL_OK ||
+        __real_keystore_write_data(base + (1 + LOG_MAP_PAGES) * KEYSTORE_PAGE_SIZE,
+                                   (const uint8_t *)erased, sizeof(erased)) != HAL_OK ||
+        __real_keystore_write_data(base, page, sizeof(page)) != HAL_OK)
+        return HAL_ERROR;
+
+    half = next;
+    generation = hdr.generation;
+    journal_used = 0;
+    ++stats.checkpoints;
+    return HAL_OK;
+}
+
+/* Append a record of a change already made in RAM. */
+static HAL_StatusTypeDef log_record(uint16_t block, uint16_t subsector)
+{
+    if (journal_used == LOG_JOURNAL_RECORDS)
+        return log_checkpoint();
+
+    const struct log_record r = { block, subsector, record_check(block, subsector) };
+    const uint32_t offset = half_offset(half) +
+        (LOG_RECORD_PAGE + journal_used / LOG_RECORDS_PER_PAGE) * KEYSTORE_PAGE_SIZE;
+
+    memset(page, 0xff, sizeof(page));
+    memcpy(page + (journal_used % LOG_RECORDS_PER_PAGE) * sizeof(r), &r, sizeof(r));
+    ++journal_used;
+
+    /* A half-written record would stop replay there, hiding the ones
+     * after it, so start a new half rather than carry on past it.
+     */
+    if (__real_keystore_write_data(offset, page, sizeof(page)) != HAL_OK)
+        return log_checkpoint();
+
+    return HAL_OK;
+}
+
+/* Load a journal half's checkpoint, if it's intact. */
+static int log_load(unsigned h, const struct log_header *hdr)
+{
+    const uint32_t base = half_offset(h);
+
+    if (hdr->magic != LOG_MAGIC || hdr->blocks != LOG_BLOCKS ||
+        hdr->subsectors != LOG_SUBSECTORS || hdr->alloc_next >= LOG_SUBSECTORS)
+        return 0;
+
+    if (__real_keystore_read_data_nocache(base + KEYSTORE_PAGE_SIZE,
+                                          (uint8_t *)map, sizeof(map)) != HAL_OK ||
+        __real_keystore_read_data_nocache(base + (1 + LOG_MAP_PAGES) * KEYSTORE_PAGE_SIZE,
+                                          (uint8_t *)erased, sizeof(erased)) != HAL_OK ||
+        header_check(hdr) != hdr->check)
+        return 0;
+
+    memset(used, 0, sizeof(used));
+    n_mapped = n_erased = 0;
+    for (uint32_t b = 0; b < LOG_BLOCKS; ++b) {
+        if (map[b] == LOG_UNMAPPED)
+            continue;
+        if (map[b] >= LOG_SUBSECTORS || bit_get(used, map[b]))
+            return 0;
+        bit_set(used, map[b], 1);
+        ++n_mapped;
+    }
+    for (uint32_t s = 0; s < LOG_SUBSECTORS; ++s) {
+        if (bit_get(used, s))
+            bit_set(erased, s, 0);
+        else if (bit_get(erased, s))
+            ++n_erased;
+    }
+
+    half = h;
+    generation = hdr->generation;
+    alloc_next = hdr->alloc_next;
+    return 1;
+}
+
+/* Apply the records after the checkpoint. */
+static HAL_StatusTypeDef log_replay(void)
+{
+    struct log_record r;
+
+    for (journal_used = 0; journal_used < LOG_JOURNAL_RECORDS; ++journal_used) {
+        const uint32_t slot = journal_used % LOG_RECORDS_PER_PAGE;
+
+        if (slot == 0 &&
+            __real_keystore_read_data_nocache(half_offset(half) +
+                                              (LOG_RECORD_PAGE + journal_used / LOG_RECORDS_PER_PAGE) * KEYSTORE_PAGE_SIZE,
+                                              page, sizeof(page)) != HAL_OK)
+            return HAL_ERROR;
+
+        memcpy(&r, page + slot * sizeof(r), sizeof(r));
+
+        if (r.block == LOG_RECORD_END || r.check != record_check(r.block, r.subsector))
+            break;
+        if (r.block < LOG_BLOCKS && (r.subsector < LOG_SUBSECTORS || r.subsector == LOG_UNMAPPED)) {
+            if (r.subsector != LOG_UNMAPPED && bit_get(used, r.subsector))
+                break;
+            log_map(r.block, r.subsector);
+        }
+        else if (r.block == LOG_RECORD_ERASED && r.subsector < LOG_SUBSECTORS)
+            log_erased(r.subsector);
+        else
+            break;
+    }
+
+    /* A record that doesn't check out was cut short by a power failure.
+     * Start a new half, rather than append after it where replay would
+     * never look.
+     */
+    if (journal_used < LOG_JOURNAL_RECORDS)
+        for (size_t i = 0; i < sizeof(r); ++i)
+            if (page[(journal_used % LOG_RECORDS_PER_PAGE) * sizeof(r) + i] != 0xff)
+                return log_checkpoint();
+
+    return HAL_OK;
+}
+
+static HAL_StatusTypeDef log_mount(void)
+{
+    struct log_header hdr[2];
+
+    if (mounted)
+        return HAL_OK;
+
+    for (unsigned h = 0; h < 2; ++h)
+        if (__real_keystore_read_data_nocache(half_offset(h), (uint8_t *)&hdr[h], sizeof(hdr[h])) != HAL_OK)
+            return HAL_ERROR;
+
+    /* Newest intact checkpoint first */
+    const unsigned first = (hdr[1].magic == LOG_MAGIC &&
+                            (hdr[0].magic != LOG_MAGIC ||
+                             (int32_t)(hdr[1].generation - hdr[0].generation) > 0)) ? 1 : 0;
+
+    if (log_load(first, &hdr[first]) || log_load(first ^ 1, &hdr[first ^ 1])) {
+        if (log_replay() != HAL_OK)
+            return HAL_ERROR;
+    }
+    else {
+        /* Nothing to load: map every block to its own subsector. */
+        memset(map, 0xff, sizeof(map));
+        memset(erased, 0, sizeof(erased));
+        memset(used, 0, sizeof(used));
+        n_mapped = n_erased = 0;
+        for (uint32_t b = 0; b < LOG_BLOCKS; ++b)
+            log_map(b, b);
+        half = 1;
+        generation = 0;
+        if (log_checkpoint() != HAL_OK)
+            return HAL_ERROR;
+    }
+
+    gc_next = alloc_next;
+    mounted = 1;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef keystore_log_init(void)
+{
+    return log_mount();
+}
+
+/* Pick the next dirty subsector to erase, round-robin. */
+static int gc_pick(uint32_t *subsector)
+{
+    for (uint32_t i = 0; i < LOG_SUBSECTORS; ++i) {
+        const uint32_t s = (gc_next + i) % LOG_SUBSECTORS;
+        if (is_dirty(s) && !(gc_busy && s == gc_subsector)) {
+            gc_next = (s + 1) % LOG_SUBSECTORS;
+            *subsector = s;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* A subsector has been erased; it's free for use. */
+static HAL_StatusTypeDef gc_done(uint32_t subsector)
+{
+    log_erased(subsector);
+    return log_record(LOG_RECORD_ERASED, subsector);
+}
+
+/* Start erasing a dirty subsector in the background. Returns 1 if it
+ * started something, in which case call keystore_log_gc_poll() until it
+ * stops returning HAL_BUSY.
+ */
+int keystore_log_gc_start(void)
+{
+    uint32_t s;
+
+    if (log_mount() != HAL_OK || gc_busy || !gc_pick(&s))
+        return 0;
+
+    if (__real_keystore_erase_subsector_start(s) != HAL_OK)
+        return 0;
+
+    gc_busy = 1;
+    gc_subsector = s;
+    return 1;
+}
+
+HAL_StatusTypeDef keystore_log_gc_poll(void)
+{
+    int is_blank;
+
+    if (!gc_busy)
+        return HAL_OK;
+
+    HAL_StatusTypeDef status = __real_keystore_erase_poll();
+    if (status == HAL_BUSY)
+        return status;
+
+    /* Somebody else may have waited for the erase to finish (and eaten its
+     * status), so make sure it worked.
+     */
+    gc_busy = 0;
+    if (status == HAL_OK &&
+        (status = __real_keystore_check_blank(gc_subsector, &is_blank)) == HAL_OK) {
+        if (!is_blank)
+            return HAL_ERROR;
+        ++stats.gc_erases;
+        status = gc_done(gc_subsector);
+    }
+    return status;
+}
+
+/* Get an erased subsector to write a block into, erasing one now if
+ * the background erases haven't kept up.
+ */
+static HAL_StatusTypeDef log_alloc(uint32_t *subsector)
+{
+    uint32_t s;
+
+    if (n_erased == 0 && gc_busy) {
+        __real_keystore_erase_wait(N25Q128_ERASE_SUBSECTOR_TIMEOUT);
+        keystore_log_gc_poll();
+    }
+
+    if (n_erased == 0) {
+        if (!gc_pick(&s) || __real_keystore_erase_subsector(s) != HAL_OK)
+            return HAL_ERROR;
+        ++stats.sync_erases;
+        if (gc_done(s) != HAL_OK)
+            return HAL_ERROR;
+    }
+
+    for (uint32_t i = 0; i < LOG_SUBSECTORS; ++i) {
+        s = (alloc_next + i) % LOG_SUBSECTORS;
+        if (bit_get(erased, s)) {
+            *subsector = s;
+            return HAL_OK;
+        }
+    }
+
+    return HAL_ERROR;
+}
+
+static HAL_StatusTypeDef log_unmap(uint32_t first, uint32_t num)
+{
+    HAL_StatusTypeDef status = log_mount();
+
+    for (uint32_t b = first; status == HAL_OK && b < first + num; ++b) {
+        if (map[b] == LOG_UNMAPPED)
+            continue;
+        log_map(b, LOG_UNMAPPED);
+        ++stats.remaps;
+        status = log_record(b, LOG_UNMAPPED);
+    }
+
+    return status;
+}
+
+static HAL_StatusTypeDef log_read(uint32_t offset, uint8_t *buf, uint32_t len, int use_cache)
+{
+    if (log_mount() != HAL_OK ||
+        offset > LOG_BLOCKS * KEYSTORE_SUBSECTOR_SIZE ||
+        len > LOG_BLOCKS * KEYSTORE_SUBSECTOR_SIZE - offset)
+        return HAL_ERROR;
+
+    while (len > 0) {
+        const uint32_t block = offset / KEYSTORE_SUBSECTOR_SIZE;
+        const uint32_t off = offset % KEYSTORE_SUBSECTOR_SIZE;
+        uint32_t n = KEYSTORE_SUBSECTOR_SIZE - off;
+        if (n > len)
+            n = len;
+
+        if (map[block] == LOG_UNMAPPED)
+            memset(buf, 0xff, n);
+        else if ((use_cache ? __real_keystore_read_data : __real_keystore_read_data_nocache)
+                 (map[block] * KEYSTORE_SUBSECTOR_SIZE + off, buf, n) != HAL_OK)
+            return HAL_ERROR;
+
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+
+    return HAL_OK;
+}
+
+/* The keystore API, as libhal sees it */
+
+HAL_StatusTypeDef __wrap_keystore_read_data(uint32_t offset, uint8_t *buf, const uint32_t len)
+{
+    return log_read(offset, buf, len, 1);
+}
+
+HAL_StatusTypeDef __wrap_keystore_read_data_nocache(uint32_t offset, uint8_t *buf, const uint32_t len)
+{
+    return log_read(offset, buf, len, 0);
+}
+
+HAL_StatusTypeDef __wrap_keystore_write_data(uint32_t offset, const uint8_t *buf, uint32_t len)
+{
+    if (offset % KEYSTORE_PAGE_SIZE != 0 || len % KEYSTORE_PAGE_SIZE != 0 ||
+        (offset + len) / KEYSTORE_PAGE_SIZE > KEYSTORE_NUM_PAGES ||
+        log_mount() != HAL_OK)
+        return HAL_ERROR;
+
+    while (len > 0) {
+        const uint32_t block = offset / KEYSTORE_SUBSECTOR_SIZE;
+        const uint32_t off = offset % KEYSTORE_SUBSECTOR_SIZE;
+        uint32_t n = KEYSTORE_SUBSECTOR_SIZE - off;
+        uint32_t s;
+        if (n > len)
+            n = len;
+
+        if (map[block] == LOG_UNMAPPED) {
+            if (log_alloc(&s) != HAL_OK)
+                return HAL_ERROR;
+            log_map(block, s);
+            if (log_record(block, s) != HAL_OK)
+                return HAL_ERROR;
+        }
+
+        if (__real_keystore_write_data(map[block] * KEYSTORE_SUBSECTOR_SIZE + off, buf, n) != HAL_OK)
+            return HAL_ERROR;
+
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef __wrap_keystore_erase_subsector(uint32_t subsector_offset)
+{
+    if (subsector_offset >= KEYSTORE_NUM_SUBSECTORS)
+        return HAL_ERROR;
+    return log_unmap(subsector_offset, 1);
+}
+
+HAL_StatusTypeDef __wrap_keystore_erase_sector(uint32_t sector_offset)
+{
+    if (sector_offset >= KEYSTORE_NUM_SECTORS)
+        return HAL_ERROR;
+    return log_unmap(sector_offset * LOG_SUBSECTORS_PER_SECTOR, LOG_SUBSECTORS_PER_SECTOR);
+}
+
+/* Erases only drop mappings, so they're done as soon as they've started. */
+
+HAL_StatusTypeDef __wrap_keystore_erase_subsector_start(uint32_t subsector_offset)
+{
+    return __wrap_keystore_erase_subsector(subsector_offset);
+}
+
+HAL_StatusTypeDef __wrap_keystore_erase_sector_start(uint32_t sector_offset)
+{
+    return __wrap_keystore_erase_sector(sector_offset);
+}
+
+HAL_StatusTypeDef __wrap_keystore_erase_poll(void)
+{
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef __wrap_keystore_erase_wait(uint32_t timeout)
+{
+    (void)timeout;
+    return HAL_OK;
+}
+
+/* The whole chip has been erased, journal and all (or not, if status says
+ * otherwise): start over with nothing mapped and everything erased.
+ */
+static HAL_StatusTypeDef log_format(HAL_StatusTypeDef status)
+{
+    gc_busy = 0;
+    mounted = 0;
+    if (status != HAL_OK)
+        return status;
+
+    memset(map, 0xff, sizeof(map));
+    memset(used, 0, sizeof(used));
+    memset(erased, 0, sizeof(erased));
+    for (uint32_t s = 0; s < LOG_SUBSECTORS; ++s)
+        bit_set(erased, s, 1);
+    n_mapped = 0;
+    n_erased = LOG_SUBSECTORS;
+
+    /* Both halves are blank; start at the first. */
+    half = 1;
+    if ((status = log_checkpoint()) == HAL_OK)
+        mounted = 1;
+    return status;
+}
+
+HAL_StatusTypeDef __wrap_keystore_erase_bulk(void)
+{
+    return log_format(__real_keystore_erase_bulk());
+}
+
+HAL_StatusTypeDef __wrap_keystore_erase_used(keystore_erase_progress_t progress)
+{
+    return log_format(__real_keystore_erase_used(progress));
+}
+
+HAL_StatusTypeDef __wrap_keystore_check_blank(uint32_t subsector_offset, int *is_blank)
+{
+    if (subsector_offset >= KEYSTORE_NUM_SUBSECTORS || log_mount() != HAL_OK)
+        return HAL_ERROR;
+
+    if (map[subsector_offset] == LOG_UNMAPPED) {
+        *is_blank = 1;
+        return HAL_OK;
+    }
+
+    return __real_keystore_check_blank(map[subsector_offset], is_blank);
+}
+
+void keystore_log_get_stats(struct keystore_log_stats *s)
+{
+    *s = stats;
+    s->blocks = LOG_BLOCKS;
+    s->mapped = n_mapped;
+    s->free = n_erased;
+    s->dirty = LOG_SUBSECTORS - n_mapped - n_erased;
+    s->generation = generation;
+    s->journal_used = journal_used;
+    s->journal_size = LOG_JOURNAL_RECORDS;
+}
@@ -0,0 +1,72 @@
+/*
+ * keystore-log.h
+ * --------------
+ * Log-structured layer with wear leveling between libhal and the keystore flash.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __STM32_KEYSTORE_LOG_H
+#define __STM32_KEYSTORE_LOG_H
+
+#include "stm-keystore.h"
+
+/*
+ * Built with DO_KEYSTORE_LOG, the HSM links keystore-log.c in front of the
+ * keystore_* functions that libhal calls (with -Wl,--wrap, see the HSM
+ * Makefile), so libhal sees KEYSTORE_LOG_NUM_BLOCKS logical subsectors,
+ * each of which lives in whatever physical subsector the layer put it in.
+ * The rest of the chip is the layer's journal, and spare room for it to
+ * write into while freed subsectors are waiting to be erased.
+ */
+
+/* Journal: two halves of one sector each, at the top of the chip. */
+#define KEYSTORE_LOG_JOURNAL_SUBSECTORS (2 * N25Q128_SECTOR_SIZE / N25Q128_SUBSECTOR_SIZE)
+#define KEYSTORE_LOG_DATA_SUBSECTORS    (N25Q128_NUM_SUBSECTORS - KEYSTORE_LOG_JOURNAL_SUBSECTORS)
+
+struct keystore_log_stats {
+    uint32_t blocks;            /* logical subsectors */
+    uint32_t mapped;            /* ...that have a physical subsector */
+    uint32_t free;              /* physical subsectors erased and ready */
+    uint32_t dirty;             /* ...waiting to be erased */
+    uint32_t generation;        /* of the current journal checkpoint */
+    uint32_t journal_used;      /* records since that checkpoint */
+    uint32_t journal_size;      /* records that fit before the next one */
+    uint32_t remaps;            /* erases that just dropped a mapping */
+    uint32_t gc_erases;         /* subsectors erased in the background */
+    uint32_t sync_erases;       /* ...or on the write path, for lack of free ones */
+    uint32_t checkpoints;
+};
+
+extern HAL_StatusTypeDef keystore_log_init(void);
+extern int keystore_log_gc_start(void);
+extern HAL_StatusTypeDef keystore_log_gc_poll(void);
+extern void keystore_log_get_stats(struct keystore_log_stats *stats);
+
+#endif /* __STM32_KEYSTORE_LOG_H */
@@ -303,6 +303,10 @@ void HAL_I2C_MspDeInit(I2C_HandleTypeDef* hi2c)
 void HAL_SPI_MspInit(SPI_HandleTypeDef* hspi)
 {
     GPIO_InitTypeDef GPIO_InitStruct;
+    DMA_Stream_TypeDef *hdma_rx_instance, *hdma_tx_instance;
+    IRQn_Type rx_IRQn, tx_IRQn;
+    uint32_t dma_channel;
+
     if (hspi->Instance == SPI1) {
 	/* SPI1 is the keystore memory.
 	 *
@@ -321,6 +325,16 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* hspi)
 
 	/* Peripheral clock enable */
 	__SPI1_CLK_ENABLE();
+
+	/* Peripheral DMA init (SPI1 RX is also available on DMA2 Stream2,
+	 * but that's taken by USART1 RX)
+	 */
+	__HAL_RCC_DMA2_CLK_ENABLE();
+	hdma_rx_instance = DMA2_Stream0;
+	hdma_tx_instance = DMA2_Stream3;
+	rx_IRQn = DMA2_Stream0_IRQn;
+	tx_IRQn = DMA2_Stream3_IRQn;
+	dma_channel = DMA_CHANNEL_3;
     } else if (hspi->Instance == SPI2) {
 	/* SPI2 is the FPGA config memory.
 	 *
@@ -339,6 +353,49 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* hspi)
 
 	/* Peripheral clock enable */
 	__SPI2_CLK_ENABLE();
+
+	/* Peripheral DMA init */
+	__HAL_RCC_DMA1_CLK_ENABLE();
+	hdma_rx_instance = DMA1_Stream3;
+	hdma_tx_instance = DMA1_Stream4;
+	rx_IRQn = DMA1_Stream3_IRQn;
+	tx_IRQn = DMA1_Stream4_IRQn;
+	dma_channel = DMA_CHANNEL_0;
+    } else {
+	return;
+    }
+
+    /* Peripheral DMA init, if the driver has linked DMA handles to this
+     * SPI. The DMA IRQ handlers live with the handles, in stm-keystore.c
+     * and stm-fpgacfg.c, because not every project links both.
+     */
+    DMA_HandleTypeDef *hdma_rx = hspi->hdmarx, *hdma_tx = hspi->hdmatx;
+    if (hdma_rx != NULL && hdma_tx != NULL) {
+	hdma_rx->Instance = hdma_rx_instance;
+	hdma_rx->Init.Channel = dma_channel;
+	hdma_rx->Init.Direction = DMA_PERIPH_TO_MEMORY;
+	hdma_rx->Init.PeriphInc = DMA_PINC_DISABLE;
+	hdma_rx->Init.MemInc = DMA_MINC_ENABLE;
+	hdma_rx->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	hdma_rx->Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	hdma_rx->Init.Mode = DMA_NORMAL;
+	hdma_rx->Init.Priority = DMA_PRIORITY_HIGH;
+	hdma_rx->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+	hdma_tx->Instance = hdma_tx_instance;
+	hdma_tx->Init = hdma_rx->Init;
+	hdma_tx->Init.Direction = DMA_MEMORY_TO_PERIPH;
+	hdma_tx->Init.Priority = DMA_PRIORITY_MEDIUM;
+
+	if (HAL_DMA_Init(hdma_rx) != HAL_OK || HAL_DMA_Init(hdma_tx) != HAL_OK) {
+	    extern void mbed_die(void);
+	    mbed_die();
+	}
+
+	HAL_NVIC_SetPriority(rx_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(rx_IRQn);
+	HAL_NVIC_SetPriority(tx_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(tx_IRQn);
     }
 }
 
@@ -39,6 +39,7 @@
 
 #include "stm-init.h"
 #include "stm-uart.h"
+#include "stm-dma.h"
 
 /******************************************************************************/
 /*            Cortex-M4 Processor Exceptions Handlers                         */
@@ -98,6 +99,14 @@ void DMA2_Stream2_IRQHandler(void)
     HAL_DMA_IRQHandler(&hdma_usart_mgmt_rx);
 }
 
+/**
+* @brief This function handles DMA2 stream1 global interrupt.
+*/
+void DMA2_Stream1_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_memcpy);
+}
+
 /**
  * @brief  This function handles UART interrupt request.
  * @param  None
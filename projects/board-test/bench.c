@@ -0,0 +1,119 @@
+/*
+ * Per-operation timing for the board-test perf programs. See bench.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm-init.h"
+#include "stm-uart.h"
+#include "bench.h"
+
+static const char *bench_program;
+static char bench_operation[32];
+
+static uint32_t samples[BENCH_MAX_SAMPLES];
+static uint32_t n_samples, min_cycles, max_cycles;
+
+/* What bench_time() costs with nothing in it, taken off every sample. */
+static uint32_t overhead;
+
+void bench_init(const char *program)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    overhead = 0;
+    bench_reset("");
+    for (int i = 0; i < 16; ++i)
+        bench_time((void)0);
+    overhead = min_cycles;
+
+    if (bench_program == NULL)
+        uart_send_string("csv,program,operation,count,min_us,median_us,p99_us,max_us\r\n");
+    bench_program = program;
+}
+
+/* Start a new series. The name may be padded for the human-readable
+ * output; the padding is dropped for the CSV.
+ */
+void bench_reset(const char *operation)
+{
+    size_t n = strlen(operation);
+
+    while (n > 0 && operation[n - 1] == ' ')
+        --n;
+    if (n >= sizeof(bench_operation))
+        n = sizeof(bench_operation) - 1;
+    memcpy(bench_operation, operation, n);
+    bench_operation[n] = '\0';
+
+    n_samples = 0;
+    min_cycles = 0xFFFFFFFF;
+    max_cycles = 0;
+}
+
+void bench_record(uint32_t cycles)
+{
+    cycles = (cycles > overhead) ? cycles - overhead : 0;
+    if (n_samples < BENCH_MAX_SAMPLES)
+        samples[n_samples] = cycles;
+    ++n_samples;
+    if (cycles < min_cycles)
+        min_cycles = cycles;
+    if (cycles > max_cycles)
+        max_cycles = cycles;
+}
+
+static int compare_cycles(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Microseconds, to the nanosecond. */
+static void send_us(uint32_t cycles)
+{
+    const uint64_t ns = (uint64_t)cycles * 1000 / (SystemCoreClock / 1000000);
+    uart_send_integer((uint32_t)(ns / 1000), 1);
+    uart_send_char('.');
+    uart_send_integer((uint32_t)(ns % 1000), 3);
+}
+
+void bench_report(void)
+{
+    if (n_samples == 0)
+        return;
+
+    const uint32_t n = (n_samples < BENCH_MAX_SAMPLES) ? n_samples : BENCH_MAX_SAMPLES;
+    qsort(samples, n, sizeof(*samples), compare_cycles);
+    const uint32_t median = samples[(n - 1) / 2];
+    const uint32_t p99 = samples[(n * 99 + 99) / 100 - 1];
+
+    uart_send_string("    min ");
+    send_us(min_cycles);
+    uart_send_string(", median ");
+    send_us(median);
+    uart_send_string(", p99 ");
+    send_us(p99);
+    uart_send_string(", max ");
+    send_us(max_cycles);
+    uart_send_string(" us\r\n");
+
+    uart_send_string("csv,");
+    uart_send_string(bench_program);
+    uart_send_char(',');
+    uart_send_string(bench_operation);
+    uart_send_char(',');
+    uart_send_integer(n_samples, 1);
+    uart_send_char(',');
+    send_us(min_cycles);
+    uart_send_char(',');
+    send_us(median);
+    uart_send_char(',');
+    send_us(p99);
+    uart_send_char(',');
+    send_us(max_cycles);
+    uart_send_string("\r\n");
+}
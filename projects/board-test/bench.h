@@ -0,0 +1,51 @@
+/*
+ * Per-operation timing for the board-test perf programs.
+ *
+ * Each operation is timed with the DWT cycle counter, and a series of them
+ * is summarized as min/median/p99/max, both for humans and as a CSV line
+ * that can be grepped out of a log and compared across firmware versions:
+ *
+ *   csv,<program>,<operation>,<count>,<min_us>,<median_us>,<p99_us>,<max_us>
+ *
+ * Usage:
+ *
+ *   bench_init("spiflash-perf");
+ *   bench_reset("read page");
+ *   for (...)
+ *       bench_time(err = n25q128_read_page(...));
+ *   bench_report();
+ *
+ * The cycle counter wraps after 23 seconds at 180 MHz, so anything slower
+ * than that (a bulk erase) should still be timed with HAL_GetTick().
+ */
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include "stm-init.h"
+
+/* Percentiles are taken over the first this-many samples of a series;
+ * count, min and max are over all of them.
+ */
+#ifndef BENCH_MAX_SAMPLES
+#define BENCH_MAX_SAMPLES	4096
+#endif
+
+extern void bench_init(const char *program);
+extern void bench_reset(const char *operation);
+extern void bench_record(uint32_t cycles);
+extern void bench_report(void);
+
+static inline uint32_t bench_now(void)
+{
+    return DWT->CYCCNT;
+}
+
+#define bench_time(_expr_)				\
+    do {						\
+	uint32_t _b = bench_now();			\
+	(_expr_);					\
+	bench_record(bench_now() - _b);			\
+    } while (0)
+
+#endif /* __BENCH_H */
@@ -0,0 +1,113 @@
+/*
+ * Compare CPU memcpy against dma_memcpy for bulk copies between the two
+ * SDRAM chips, and measure how much CPU time is left over for other work
+ * while the DMA copy runs.
+ */
+#include <string.h>
+
+#include "stm-init.h"
+#include "stm-uart.h"
+#include "stm-sdram.h"
+#include "stm-dma.h"
+
+#define TEST_NUM_ROUNDS		10
+
+static const size_t sizes[] = { 512, 4096, 65536, 1024 * 1024 };
+
+/* A unit of "other work", running out of SRAM, so the only contention
+ * with the DMA is on the bus matrix.
+ */
+static uint32_t work_buf[256];
+
+static void do_work(void)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < sizeof(work_buf)/sizeof(*work_buf); ++i)
+        sum += work_buf[i] ^ (sum << 1);
+    work_buf[0] = sum;
+}
+
+static void cycle_counter_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static void send_cycles(const char *label, uint32_t cycles)
+{
+    uart_send_string(label);
+    uart_send_integer(cycles, 1);
+    uart_send_string(" cycles (");
+    uart_send_integer(cycles / (SystemCoreClock / 1000000), 1);
+    uart_send_string(" us)");
+}
+
+static void test_copy(size_t n)
+{
+    uint8_t *src = (uint8_t *)SDRAM_BASEADDR_CHIP1;
+    uint8_t *dst = (uint8_t *)SDRAM_BASEADDR_CHIP2;
+    uint32_t t0, t_cpu, t_dma, t_work, n_work = 0;
+
+    for (size_t i = 0; i < n; ++i)
+        src[i] = i & 0xFF;
+
+    /* How long does a unit of work take on an idle bus? */
+    t0 = DWT->CYCCNT;
+    for (int i = 0; i < 100; ++i)
+        do_work();
+    t_work = (DWT->CYCCNT - t0) / 100;
+
+    memset(dst, 0, n);
+    t0 = DWT->CYCCNT;
+    for (int i = 0; i < TEST_NUM_ROUNDS; ++i)
+        memcpy(dst, src, n);
+    t_cpu = (DWT->CYCCNT - t0) / TEST_NUM_ROUNDS;
+
+    memset(dst, 0, n);
+    t0 = DWT->CYCCNT;
+    for (int i = 0; i < TEST_NUM_ROUNDS; ++i) {
+        if (dma_memcpy_start(dst, src, n) != HAL_OK) {
+            uart_send_string("ERROR: dma_memcpy_start failed\r\n");
+            return;
+        }
+        while (dma_memcpy_busy()) {
+            do_work();
+            ++n_work;
+        }
+        if (dma_memcpy_wait() != HAL_OK) {
+            uart_send_string("ERROR: dma_memcpy_wait failed\r\n");
+            return;
+        }
+    }
+    t_dma = (DWT->CYCCNT - t0) / TEST_NUM_ROUNDS;
+    n_work /= TEST_NUM_ROUNDS;
+
+    uart_send_string("size ");
+    uart_send_integer(n, 1);
+    uart_send_string(":\r\n");
+    send_cycles("  cpu memcpy ", t_cpu);
+    uart_send_string("\r\n");
+    send_cycles("  dma memcpy ", t_dma);
+    uart_send_string("\r\n");
+    uart_send_string("  cpu available during dma copy: ");
+    uart_send_integer((t_dma == 0) ? 0 : (100 * n_work * t_work) / t_dma, 1);
+    uart_send_string("%\r\n");
+
+    if (memcmp(dst, src, n) != 0)
+        uart_send_string("  ERROR: verify failed\r\n");
+}
+
+int main(void)
+{
+    stm_init();
+    cycle_counter_init();
+
+    uart_send_string("Starting...\r\n");
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); ++i)
+        test_copy(sizes[i]);
+
+    uart_send_string("Done.\r\n\r\n");
+    return 0;
+}
@@ -5,8 +5,9 @@
 #include "stm-led.h"
 #include "stm-fmc.h"
 #include "stm-uart.h"
+#include "bench.h"
 
-#define TEST_NUM_ROUNDS		2000000
+#include <string.h>
 
 RNG_HandleTypeDef rng_inst;
 
@@ -45,42 +46,166 @@ static void sanity(void)
     }
 }
 
-static void _time_check(char *label, const uint32_t t0)
+/* The rest of the tests run at each of these FMC timings, and report the
+ * average number of HCLK cycles per 32-bit access. Settings that don't
+ * pass check_mode() with this bitstream are reported as failing.
+ */
+static const struct {
+    uint32_t clk_division, data_latency;
+} modes[] = {
+    { 4, FMC_DATA_LATENCY_SAFE },       /* 45 MHz */
+    { 3, 2 }, { 3, 3 }, { 3, 4 }, { 3, 5 }, { 3, 6 },      /* 60 MHz */
+    { 2, 2 }, { 2, 3 }, { 2, 4 }, { 2, 5 }, { 2, 6 },      /* 90 MHz */
+};
+
+/* Words transferred in each direction for each table entry. */
+#define TEST_NUM_WORDS		65536
+
+/* Short blocks are copied by the CPU, long ones by DMA. */
+#define BLOCK_WORDS_CPU		(FMC_DMA_THRESHOLD / 2)
+#define BLOCK_WORDS_DMA		1024
+
+static uint32_t block_buf[BLOCK_WORDS_DMA];
+
+enum access_mix { MIX_READ, MIX_WRITE, MIX_BOTH };
+
+static const struct {
+    const char *label;
+    enum access_mix mix;
+    size_t nwords;              /* 1 for single-word accesses */
+} columns[] = {
+    { "rd 1",    MIX_READ,  1 },
+    { "wr 1",    MIX_WRITE, 1 },
+    { "mix 1",   MIX_BOTH,  1 },
+    { "rd 64",   MIX_READ,  BLOCK_WORDS_CPU },
+    { "wr 64",   MIX_WRITE, BLOCK_WORDS_CPU },
+    { "mix 64",  MIX_BOTH,  BLOCK_WORDS_CPU },
+    { "rd 1k",   MIX_READ,  BLOCK_WORDS_DMA },
+    { "wr 1k",   MIX_WRITE, BLOCK_WORDS_DMA },
+    { "mix 1k",  MIX_BOTH,  BLOCK_WORDS_DMA },
+};
+
+#define COLUMN_WIDTH		8
+
+/* Does the current FMC timing work? The test bitstream echoes back what's
+ * written to address 0.
+ */
+static int check_mode(void)
 {
-    uint32_t t = HAL_GetTick() - t0;
-
-    uart_send_string(label);
-    uart_send_integer(t / 1000, 1);
-    uart_send_char('.');
-    uart_send_integer(t % 1000, 3);
-    uart_send_string(" seconds, ");
-    uart_send_integer(((1000 * TEST_NUM_ROUNDS) / t), 1);
-    uart_send_string("/sec\r\n");
+    uint32_t i, rnd, data;
+
+    for (i = 0; i < 1000; ++i) {
+        rnd = random();
+        fmc_write_32(0, rnd);
+        fmc_read_32(0, &data);
+        if (data != rnd)
+            return 0;
+    }
+    return 1;
 }
 
-#define time_check(_label_, _expr_)		\
-    do {					\
-	uint32_t _t = HAL_GetTick();		\
-	(_expr_);				\
-	_time_check(_label_, _t);		\
-    } while (0)
+/* Average HCLK cycles per 32-bit access, in hundredths. A mixed run writes
+ * then reads each word (or block), so it does twice as many accesses.
+ */
+static uint32_t measure(enum access_mix mix, size_t nwords)
+{
+    uint32_t i, data, t0, cycles;
+
+    t0 = bench_now();
+    for (i = 0; i < TEST_NUM_WORDS / nwords; ++i) {
+        if (mix != MIX_READ) {
+            if (nwords == 1)
+                fmc_write_32(0, i);
+            else
+                fmc_write_block(0, block_buf, nwords);
+        }
+        if (mix != MIX_WRITE) {
+            if (nwords == 1)
+                fmc_read_32(0, &data);
+            else
+                fmc_read_block(0, block_buf, nwords);
+        }
+    }
+    cycles = bench_now() - t0;
+
+    return (uint32_t)((uint64_t)cycles * 100 / (TEST_NUM_WORDS * (mix == MIX_BOTH ? 2 : 1)));
+}
 
-static void test_read(void)
+static void send_padded(const char *s, size_t width)
 {
-    uint32_t i, data;
-    
-    for (i = 0; i < TEST_NUM_ROUNDS; ++i) {
-        fmc_read_32(0, &data);
+    for (size_t n = strlen(s); n < width; ++n)
+        uart_send_char(' ');
+    uart_send_string(s);
+}
+
+static void send_integer_padded(uint32_t num, size_t width)
+{
+    size_t digits = 1;
+    for (uint32_t n = num; n >= 10; n /= 10)
+        ++digits;
+    for (; digits < width; ++digits)
+        uart_send_char(' ');
+    uart_send_integer(num, 1);
+}
+
+static void test_modes(void)
+{
+    size_t i, j;
+
+    for (i = 0; i < BLOCK_WORDS_DMA; ++i)
+        block_buf[i] = random();
+
+    uart_send_string("HCLK cycles per 32-bit access, by FMC clock, data latency, access mix\r\n"
+                     "and block size in words (1k = DMA)\r\n");
+    uart_send_string("MHz lat");
+    for (j = 0; j < sizeof(columns) / sizeof(*columns); ++j)
+        send_padded(columns[j].label, COLUMN_WIDTH);
+    uart_send_string("\r\n");
+
+    for (i = 0; i < sizeof(modes) / sizeof(*modes); ++i) {
+        fmc_set_mode(modes[i].clk_division, modes[i].data_latency);
+
+        send_integer_padded(SystemCoreClock / 1000000 / modes[i].clk_division, 3);
+        send_integer_padded(modes[i].data_latency, 4);
+
+        if (!check_mode()) {
+            uart_send_string("   fails\r\n");
+            continue;
+        }
+
+        for (j = 0; j < sizeof(columns) / sizeof(*columns); ++j) {
+            uint32_t c = measure(columns[j].mix, columns[j].nwords);
+            send_integer_padded(c / 100, COLUMN_WIDTH - 3);
+            uart_send_char('.');
+            uart_send_integer(c % 100, 2);
+        }
+        uart_send_string("\r\n");
     }
+
+    fmc_set_mode(FMC_CLK_DIVISION_SAFE, FMC_DATA_LATENCY_SAFE);
+}
+
+/* One access at a time, for the spread as well as the average. */
+static void test_read_one(void)
+{
+    uint32_t i, data;
+
+    bench_reset("read one");
+    for (i = 0; i < BENCH_MAX_SAMPLES; ++i)
+        bench_time(fmc_read_32(0, &data));
+    uart_send_string("read one\r\n");
+    bench_report();
 }
 
-static void test_write(void)
+static void test_write_one(void)
 {
     uint32_t i;
-    
-    for (i = 0; i < TEST_NUM_ROUNDS; ++i) {
-	fmc_write_32(0, i);
-    }
+
+    bench_reset("write one");
+    for (i = 0; i < BENCH_MAX_SAMPLES; ++i)
+        bench_time(fmc_write_32(0, i));
+    uart_send_string("write one\r\n");
+    bench_report();
 }
 
 int main(void)
@@ -91,8 +216,12 @@ int main(void)
 
     sanity();
 
-    time_check("read  ", test_read());
-    time_check("write ", test_write());
+    bench_init("fmc-perf");
+
+    test_read_one();
+    test_write_one();
+
+    test_modes();
 
     uart_send_string("Done.\r\n\r\n");
     return 0;
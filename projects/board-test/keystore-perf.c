@@ -8,6 +8,24 @@
 #include "stm-led.h"
 #include "stm-uart.h"
 #include "stm-keystore.h"
+#include "bench.h"
+
+/*
+ * The keystore skips erasing subsectors it knows are blank, and doesn't
+ * read them either, so make it forget before timing erases and reads of
+ * erased subsectors; we want to know what the chip does.
+ */
+static int _forget_blank(void)
+{
+    HAL_StatusTypeDef err = keystore_forget_blank();
+    if (err != HAL_OK) {
+        uart_send_string("ERROR: keystore_forget_blank returned ");
+        uart_send_integer(err, 1);
+        uart_send_string("\r\n");
+        return 0;
+    }
+    return 1;
+}
 
 /*
  * 1. Read the entire flash by subsectors, ignoring data.
@@ -19,7 +37,7 @@ static void test_read_data(void)
     HAL_StatusTypeDef err;
 
     for (i = 0; i < KEYSTORE_NUM_SUBSECTORS; ++i) {
-        err = keystore_read_data(i * KEYSTORE_SUBSECTOR_SIZE, read_buf, KEYSTORE_SUBSECTOR_SIZE);
+        bench_time(err = keystore_read_data(i * KEYSTORE_SUBSECTOR_SIZE, read_buf, KEYSTORE_SUBSECTOR_SIZE));
         if (err != HAL_OK) {
             uart_send_string("ERROR: keystore_read_data returned ");
             uart_send_integer(err, 1);
@@ -39,7 +57,7 @@ static void _read_verify(uint8_t *vrfy_buf)
     HAL_StatusTypeDef err;
 
     for (i = 0; i < KEYSTORE_NUM_SUBSECTORS; ++i) {
-        err = keystore_read_data(i * KEYSTORE_SUBSECTOR_SIZE, read_buf, KEYSTORE_SUBSECTOR_SIZE);
+        bench_time(err = keystore_read_data(i * KEYSTORE_SUBSECTOR_SIZE, read_buf, KEYSTORE_SUBSECTOR_SIZE));
         if (err != HAL_OK) {
             uart_send_string("ERROR: keystore_read_data returned ");
             uart_send_integer(err, 1);
@@ -63,8 +81,11 @@ static void test_erase_sector(void)
     uint32_t i;
     HAL_StatusTypeDef err;
 
+    if (!_forget_blank())
+        return;
+
     for (i = 0; i < KEYSTORE_NUM_SECTORS; ++i) {
-        err = keystore_erase_sector(i);
+        bench_time(err = keystore_erase_sector(i));
         if (err != HAL_OK) {
             uart_send_string("ERROR: keystore_erase_sector returned ");
             uart_send_integer(err, 1);
@@ -82,8 +103,11 @@ static void test_erase_subsector(void)
     uint32_t i;
     HAL_StatusTypeDef err;
 
+    if (!_forget_blank())
+        return;
+
     for (i = 0; i < KEYSTORE_NUM_SUBSECTORS; ++i) {
-        err = keystore_erase_subsector(i);
+        bench_time(err = keystore_erase_subsector(i));
         if (err != HAL_OK) {
             uart_send_string("ERROR: keystore_erase_subsector returned ");
             uart_send_integer(err, 1);
@@ -101,6 +125,9 @@ static void test_verify_erase(void)
     uint8_t vrfy_buf[KEYSTORE_SUBSECTOR_SIZE];
     uint32_t i;
 
+    if (!_forget_blank())
+        return;
+
     for (i = 0; i < sizeof(vrfy_buf); ++i)
         vrfy_buf[i] = 0xFF;
 
@@ -120,7 +147,7 @@ static void test_write_data(void)
         write_buf[i] = i & 0xFF;
 
     for (i = 0; i < KEYSTORE_NUM_SUBSECTORS; ++i) {
-        err = keystore_write_data(i * KEYSTORE_SUBSECTOR_SIZE, write_buf, KEYSTORE_SUBSECTOR_SIZE);
+        bench_time(err = keystore_write_data(i * KEYSTORE_SUBSECTOR_SIZE, write_buf, KEYSTORE_SUBSECTOR_SIZE));
         if (err != HAL_OK) {
             uart_send_string("ERROR: keystore_write_data returned ");
             uart_send_integer(err, 1);
@@ -146,6 +173,21 @@ static void test_verify_write(void)
     _read_verify(vrfy_buf);
 }
 
+/*
+ * 4. Erase whatever isn't blank: first a full keystore, then an empty one.
+ */
+static void test_erase_used(void)
+{
+    HAL_StatusTypeDef err;
+
+    err = keystore_erase_used(NULL);
+    if (err != HAL_OK) {
+        uart_send_string("ERROR: keystore_erase_used returned ");
+        uart_send_integer(err, 1);
+        uart_send_string("\r\n");
+    }
+}
+
 static void _time_check(char *label, const uint32_t t0, uint32_t n_rounds)
 {
     uint32_t t = HAL_GetTick() - t0;
@@ -169,9 +211,11 @@ static void _time_check(char *label, const uint32_t t0, uint32_t n_rounds)
 
 #define time_check(_label_, _expr_, _n_)	\
     do {					\
+	bench_reset(_label_);			\
 	uint32_t _t = HAL_GetTick();		\
 	(_expr_);				\
 	_time_check(_label_, _t, _n_);		\
+	bench_report();				\
     } while (0)
 
 int main(void)
@@ -185,12 +229,23 @@ int main(void)
 
     uart_send_string("Starting...\r\n");
 
-    time_check("read data       ", test_read_data(),       KEYSTORE_NUM_SUBSECTORS);
-    time_check("erase subsector ", test_erase_subsector(), KEYSTORE_NUM_SUBSECTORS);
-    time_check("erase sector    ", test_erase_sector(),    KEYSTORE_NUM_SECTORS);
-    time_check("verify erase    ", test_verify_erase(),    KEYSTORE_NUM_SUBSECTORS);
-    time_check("write data      ", test_write_data(),      KEYSTORE_NUM_SUBSECTORS);
-    time_check("verify write    ", test_verify_write(),    KEYSTORE_NUM_SUBSECTORS);
+    /* Run everything with polled SPI, then with DMA, for comparison. */
+    for (int use_dma = 0; use_dma <= 1; ++use_dma) {
+        keystore_ctx.use_dma = use_dma;
+        bench_init(use_dma ? "keystore-perf-dma" : "keystore-perf-polled");
+        uart_send_string(use_dma ? "DMA SPI transfers:\r\n" : "Polled SPI transfers:\r\n");
+
+        time_check("read data       ", test_read_data(),       KEYSTORE_NUM_SUBSECTORS);
+        time_check("erase subsector ", test_erase_subsector(), KEYSTORE_NUM_SUBSECTORS);
+        time_check("erase sector    ", test_erase_sector(),    KEYSTORE_NUM_SECTORS);
+        time_check("verify erase    ", test_verify_erase(),    KEYSTORE_NUM_SUBSECTORS);
+        time_check("write data      ", test_write_data(),      KEYSTORE_NUM_SUBSECTORS);
+        time_check("verify write    ", test_verify_write(),    KEYSTORE_NUM_SUBSECTORS);
+    }
+
+    time_check("erase used 1    ", test_erase_used(),   1);
+    time_check("erase used 2    ", test_erase_used(),   1);
+    time_check("verify erase    ", test_verify_erase(), KEYSTORE_NUM_SUBSECTORS);
 
     uart_send_string("Done.\r\n\r\n");
     return 0;
@@ -0,0 +1,142 @@
+/*
+ * Compare the performance of stm_memcpy/stm_memset/stm_memmove against
+ * newlib's memcpy/memset/memmove, across sizes and alignments.
+ *
+ * board-test doesn't link with MEMFUNC_LDFLAGS, so memcpy et al here are
+ * the newlib versions.
+ */
+#include <string.h>
+
+#include "stm-init.h"
+#include "stm-uart.h"
+#include "stm-memfunc.h"
+
+#define TEST_NUM_ROUNDS		1000
+#define TEST_MAX_SIZE		4096
+
+static uint8_t src_buf[TEST_MAX_SIZE + 8] __attribute__((aligned(4)));
+static uint8_t dst_buf[TEST_MAX_SIZE + 8] __attribute__((aligned(4)));
+static uint8_t ref_buf[TEST_MAX_SIZE + 8] __attribute__((aligned(4)));
+
+static const size_t sizes[] = { 1, 3, 4, 8, 15, 16, 31, 64, 100, 256, 1024, 4096 };
+
+/* {source offset, destination offset} */
+static const struct { size_t s, d; } offsets[] = {
+    { 0, 0 },                   /* both aligned */
+    { 1, 0 },                   /* misaligned source */
+    { 0, 3 },                   /* misaligned destination */
+    { 2, 2 },                   /* equally misaligned */
+    { 3, 1 },                   /* both misaligned, differently */
+};
+
+typedef void *(*copy_fn_t)(void *, const void *, size_t);
+
+/* Call through volatile pointers, so gcc can't inline or specialize. */
+static copy_fn_t volatile newlib_memcpy = memcpy;
+static copy_fn_t volatile newlib_memmove = memmove;
+static void *(* volatile newlib_memset)(void *, int, size_t) = memset;
+
+static void cycle_counter_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static uint32_t time_copy(copy_fn_t fn, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    uint32_t t0 = DWT->CYCCNT;
+    for (int i = 0; i < TEST_NUM_ROUNDS; ++i)
+        fn(dst, src, n);
+    return (DWT->CYCCNT - t0) / TEST_NUM_ROUNDS;
+}
+
+static uint32_t time_set(void *(*fn)(void *, int, size_t), uint8_t *dst, size_t n)
+{
+    uint32_t t0 = DWT->CYCCNT;
+    for (int i = 0; i < TEST_NUM_ROUNDS; ++i)
+        fn(dst, 0x5A, n);
+    return (DWT->CYCCNT - t0) / TEST_NUM_ROUNDS;
+}
+
+static void report(const char *label, size_t n, size_t s, size_t d,
+                   uint32_t t_newlib, uint32_t t_stm, int ok)
+{
+    uart_send_string(label);
+    uart_send_integer(n, 4);
+    uart_send_string(" src+");
+    uart_send_integer(s, 1);
+    uart_send_string(" dst+");
+    uart_send_integer(d, 1);
+    uart_send_string(": newlib ");
+    uart_send_integer(t_newlib, 5);
+    uart_send_string(", stm ");
+    uart_send_integer(t_stm, 5);
+    uart_send_string(" cycles");
+    if (!ok)
+        uart_send_string(" VERIFY FAILED");
+    uart_send_string("\r\n");
+}
+
+static void test_memcpy(size_t n, size_t s, size_t d)
+{
+    uint32_t t_newlib = time_copy(newlib_memcpy, ref_buf + d, src_buf + s, n);
+    uint32_t t_stm = time_copy(stm_memcpy, dst_buf + d, src_buf + s, n);
+    report("memcpy  ", n, s, d, t_newlib, t_stm, memcmp(ref_buf, dst_buf, sizeof(dst_buf)) == 0);
+}
+
+static void test_memset(size_t n, size_t d)
+{
+    uint32_t t_newlib = time_set(newlib_memset, ref_buf + d, n);
+    uint32_t t_stm = time_set(stm_memset, dst_buf + d, n);
+    report("memset  ", n, 0, d, t_newlib, t_stm, memcmp(ref_buf, dst_buf, sizeof(dst_buf)) == 0);
+}
+
+/* Overlapping move, destination above source, so both have to copy
+ * backwards. Each round moves the same data again, which doesn't matter
+ * for timing.
+ */
+static void test_memmove(size_t n, size_t s, size_t d)
+{
+    if (n + 4 + d > TEST_MAX_SIZE + 8)
+        return;
+    memcpy(ref_buf, src_buf, sizeof(ref_buf));
+    memcpy(dst_buf, src_buf, sizeof(dst_buf));
+    uint32_t t_newlib = time_copy(newlib_memmove, ref_buf + 4 + d, ref_buf + s, n);
+    uint32_t t_stm = time_copy(stm_memmove, dst_buf + 4 + d, dst_buf + s, n);
+    report("memmove ", n, s, 4 + d, t_newlib, t_stm, memcmp(ref_buf, dst_buf, sizeof(dst_buf)) == 0);
+}
+
+int main(void)
+{
+    stm_init();
+    cycle_counter_init();
+
+    for (size_t i = 0; i < sizeof(src_buf); ++i)
+        src_buf[i] = i & 0xFF;
+
+    uart_send_string("Starting...\r\n");
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); ++i) {
+        for (size_t j = 0; j < sizeof(offsets)/sizeof(*offsets); ++j) {
+            memset(ref_buf, 0, sizeof(ref_buf));
+            memset(dst_buf, 0, sizeof(dst_buf));
+            test_memcpy(sizes[i], offsets[j].s, offsets[j].d);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); ++i) {
+        for (size_t d = 0; d < 4; ++d) {
+            test_memset(sizes[i], d);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); ++i) {
+        for (size_t j = 0; j < sizeof(offsets)/sizeof(*offsets); ++j) {
+            test_memmove(sizes[i], offsets[j].s, offsets[j].d);
+        }
+    }
+
+    uart_send_string("Done.\r\n\r\n");
+    return 0;
+}
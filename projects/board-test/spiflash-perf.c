@@ -8,6 +8,7 @@
 #include "stm-led.h"
 #include "stm-uart.h"
 #include "stm-keystore.h"
+#include "bench.h"
 #include "spiflash_n25q128.h"
 
 /*
@@ -32,7 +33,7 @@ static void test_read_page(void)
     int err;
 
     for (i = 0; i < N25Q128_NUM_PAGES; ++i) {
-        err = n25q128_read_page(ctx, i, read_buf);
+        bench_time(err = n25q128_read_page(ctx, i, read_buf));
         if (err != HAL_OK) {
             uart_send_string("ERROR: n25q128_read_page returned ");
             uart_send_integer(err, 1);
@@ -52,7 +53,7 @@ static void test_read_subsector(void)
     int err;
 
     for (i = 0; i < N25Q128_NUM_SUBSECTORS; ++i) {
-        err = n25q128_read_subsector(ctx, i, read_buf);
+        bench_time(err = n25q128_read_subsector(ctx, i, read_buf));
         if (err != HAL_OK) {
             uart_send_string("ERROR: n25q128_read_subsector returned ");
             uart_send_integer(err, 1);
@@ -74,7 +75,7 @@ static void _read_verify(uint8_t *vrfy_buf)
     int err;
 
     for (i = 0; i < N25Q128_NUM_PAGES; ++i) {
-        err = n25q128_read_page(ctx, i, read_buf);
+        bench_time(err = n25q128_read_page(ctx, i, read_buf));
         if (err != HAL_OK) {
             uart_send_string("ERROR: n25q128_read_page returned ");
             uart_send_integer(err, 1);
@@ -99,7 +100,7 @@ static void test_erase_sector(void)
     int err;
 
     for (i = 0; i < N25Q128_NUM_SECTORS; ++i) {
-        err = n25q128_erase_sector(ctx, i);
+        bench_time(err = n25q128_erase_sector(ctx, i));
         if (err != HAL_OK) {
             uart_send_string("ERROR: n25q128_erase_sector returned ");
             uart_send_integer(err, 1);
@@ -118,7 +119,7 @@ static void test_erase_subsector(void)
     int err;
 
     for (i = 0; i < N25Q128_NUM_SUBSECTORS; ++i) {
-        err = n25q128_erase_subsector(ctx, i);
+        bench_time(err = n25q128_erase_subsector(ctx, i));
         if (err != HAL_OK) {
             uart_send_string("ERROR: n25q128_erase_subsector returned ");
             uart_send_integer(err, 1);
@@ -170,7 +171,7 @@ static void test_write_page(void)
         write_buf[i] = i & 0xFF;
 
     for (i = 0; i < N25Q128_NUM_PAGES; ++i) {
-        err = n25q128_write_page(ctx, i, write_buf);
+        bench_time(err = n25q128_write_page(ctx, i, write_buf));
         if (err != HAL_OK) {
             uart_send_string("ERROR: n25q128_write_page returned ");
             uart_send_integer(err, 1);
@@ -183,7 +184,33 @@ static void test_write_page(void)
 }
 
 /*
- * 3b. Read the entire flash, verify data.
+ * 3b. Write the entire flash with a pattern, a subsector at a time, so the
+ * driver can pipeline the page programs.
+ */
+static void test_write_data(void)
+{
+    uint8_t write_buf[N25Q128_SUBSECTOR_SIZE];
+    uint32_t i;
+    int err;
+
+    for (i = 0; i < sizeof(write_buf); ++i)
+        write_buf[i] = i & 0xFF;
+
+    for (i = 0; i < N25Q128_NUM_SUBSECTORS; ++i) {
+        bench_time(err = n25q128_write_data(ctx, i * N25Q128_SUBSECTOR_SIZE, write_buf, sizeof(write_buf)));
+        if (err != HAL_OK) {
+            uart_send_string("ERROR: n25q128_write_data returned ");
+            uart_send_integer(err, 1);
+            uart_send_string(" for subsector ");
+            uart_send_integer(i, 1);
+            uart_send_string("\r\n");
+            break;
+        }
+    }
+}
+
+/*
+ * 3c. Read the entire flash, verify data.
  */
 static void test_verify_write(void)
 {
@@ -196,6 +223,54 @@ static void test_verify_write(void)
     _read_verify(vrfy_buf);
 }
 
+/*
+ * 4. Rewrite the pattern with compare-before-program, changing one byte in
+ * every sector's worth of subsectors (or none), so most of it is skipped.
+ */
+static void _update_data(uint8_t change)
+{
+    uint8_t write_buf[N25Q128_SUBSECTOR_SIZE];
+    struct n25q128_update_stats stats;
+    uint32_t i;
+    int err;
+
+    memset(&stats, 0, sizeof(stats));
+
+    for (i = 0; i < sizeof(write_buf); ++i)
+        write_buf[i] = i & 0xFF;
+
+    for (i = 0; i < N25Q128_NUM_SUBSECTORS; ++i) {
+        write_buf[0] = (i % 16 == 15) ? change : 0;
+        bench_time(err = n25q128_update_data(ctx, i * N25Q128_SUBSECTOR_SIZE, write_buf, sizeof(write_buf), &stats));
+        if (err != HAL_OK) {
+            uart_send_string("ERROR: n25q128_update_data returned ");
+            uart_send_integer(err, 1);
+            uart_send_string(" for subsector ");
+            uart_send_integer(i, 1);
+            uart_send_string("\r\n");
+            break;
+        }
+    }
+
+    uart_send_string("    ");
+    uart_send_integer(stats.pages_skipped, 1);
+    uart_send_string(" pages unchanged, ");
+    uart_send_integer(stats.pages_programmed, 1);
+    uart_send_string(" programmed, ");
+    uart_send_integer(stats.subsectors_erased, 1);
+    uart_send_string(" subsectors erased\r\n");
+}
+
+static void test_update_same(void)
+{
+    _update_data(0);
+}
+
+static void test_update_changed(void)
+{
+    _update_data(0x5a);
+}
+
 static void _time_check(char *label, const uint32_t t0, uint32_t n_rounds)
 {
     uint32_t t = HAL_GetTick() - t0;
@@ -219,14 +294,17 @@ static void _time_check(char *label, const uint32_t t0, uint32_t n_rounds)
 
 #define time_check(_label_, _expr_, _n_)	\
     do {					\
+	bench_reset(_label_);			\
 	uint32_t _t = HAL_GetTick();		\
 	(_expr_);				\
 	_time_check(_label_, _t, _n_);		\
+	bench_report();				\
     } while (0)
 
 int main(void)
 {
     stm_init();
+    bench_init("spiflash-perf");
 
     if (n25q128_check_id(ctx) != HAL_OK) {
         uart_send_string("ERROR: n25q128_check_id failed\r\n");
@@ -243,6 +321,13 @@ int main(void)
     time_check("verify erase    ", test_verify_erase(),    N25Q128_NUM_PAGES);
     time_check("write page      ", test_write_page(),      N25Q128_NUM_PAGES);
     time_check("verify write    ", test_verify_write(),    N25Q128_NUM_PAGES);
+    time_check("erase bulk      ", test_erase_bulk(),      1);
+    time_check("write data      ", test_write_data(),      N25Q128_NUM_PAGES);
+    time_check("verify write    ", test_verify_write(),    N25Q128_NUM_PAGES);
+    time_check("update same     ", test_update_same(),     N25Q128_NUM_SUBSECTORS);
+    time_check("update changed  ", test_update_changed(),  N25Q128_NUM_SUBSECTORS);
+    time_check("update back     ", test_update_same(),     N25Q128_NUM_SUBSECTORS);
+    time_check("verify write    ", test_verify_write(),    N25Q128_NUM_PAGES);
 
     uart_send_string("Done.\r\n\r\n");
     return 0;
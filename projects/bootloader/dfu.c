@@ -38,6 +38,7 @@
 #include "stm-led.h"
 #include "stm-uart.h"
 #include "stm-flash.h"
+#include "stm-crc.h"
 #undef HAL_OK
 
 #define HAL_OK LIBHAL_OK
@@ -110,7 +111,7 @@ static int do_login(void)
 int dfu_receive_firmware(void)
 {
     uint32_t offset = DFU_FIRMWARE_ADDR, n = DFU_UPLOAD_CHUNK_SIZE;
-    hal_crc32_t crc = 0, my_crc = hal_crc32_init();
+    uint32_t crc = 0, my_crc = stm_crc32_init();
     uint32_t filesize = 0, counter = 0;
     uint8_t buf[DFU_UPLOAD_CHUNK_SIZE];
 
@@ -164,7 +165,7 @@ int dfu_receive_firmware(void)
 	/* After reception of a chunk but before ACKing we have "all" the time in the world to
 	 * calculate CRC and write it to flash.
 	 */
-	my_crc = hal_crc32_update(my_crc, buf, n);
+	my_crc = stm_crc32_update(my_crc, buf, n);
 	stm_flash_write32(offset, (uint32_t *)buf, sizeof(buf)/4);
 	offset += DFU_UPLOAD_CHUNK_SIZE;
 
@@ -174,7 +175,7 @@ int dfu_receive_firmware(void)
 	led_toggle(LED_BLUE);
     }
 
-    my_crc = hal_crc32_finalize(my_crc);
+    my_crc = stm_crc32_finalize(my_crc);
 
     HAL_FLASH_Lock();
 
@@ -44,6 +44,7 @@
 
 
 static volatile uint32_t dfu_offset = 0;
+static struct n25q128_update_stats dfu_stats;
 
 
 
@@ -51,17 +52,14 @@ static HAL_StatusTypeDef _flash_write_callback(uint8_t *buf, size_t len)
 {
     HAL_StatusTypeDef res;
 
-    if ((dfu_offset % FPGACFG_SECTOR_SIZE) == 0)
-	/* first page in sector, need to erase sector */
-	if ((res = fpgacfg_erase_sector(dfu_offset / FPGACFG_SECTOR_SIZE)) != HAL_OK)
-	    return res;
-
-    /* fpgacfg_write_data (a thin wrapper around n25q128_write_data)
-     * requires the offset and length to be page-aligned. The last chunk
-     * will be short, so we pad it out to the full chunk size.
+    /* fpgacfg_update_data reads back what's already in the config memory
+     * and only erases and programs what differs, so re-uploading the same
+     * or a similar bitstream is quick. It requires the offset and length to
+     * be subsector-aligned. The last chunk will be short, so we pad it out
+     * to the full chunk size.
      */
     len = len;
-    res = fpgacfg_write_data(dfu_offset, buf, BITSTREAM_UPLOAD_CHUNK_SIZE);
+    res = fpgacfg_update_data(dfu_offset, buf, BITSTREAM_UPLOAD_CHUNK_SIZE, &dfu_stats);
     dfu_offset += BITSTREAM_UPLOAD_CHUNK_SIZE;
     return res;
 }
@@ -75,6 +73,7 @@ static int cmd_fpga_bitstream_upload(struct cli_def *cli, const char *command, c
     argc = argc;
 
     dfu_offset = 0;
+    memset(&dfu_stats, 0, sizeof(dfu_stats));
 
     fpgacfg_access_control(ALLOW_ARM);
 
@@ -89,6 +88,9 @@ static int cmd_fpga_bitstream_upload(struct cli_def *cli, const char *command, c
     fpgacfg_access_control(ALLOW_FPGA);
 
     cli_print(cli, "DFU offset now: %li (%li chunks)", dfu_offset, dfu_offset / BITSTREAM_UPLOAD_CHUNK_SIZE);
+    cli_print(cli, "%li pages unchanged, %li pages programmed, %li sectors and %li subsectors erased",
+              dfu_stats.pages_skipped, dfu_stats.pages_programmed,
+              dfu_stats.sectors_erased, dfu_stats.subsectors_erased);
     return CLI_OK;
 }
 
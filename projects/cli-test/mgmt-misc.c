@@ -35,6 +35,7 @@
 #define HAL_OK CMSIS_HAL_OK
 #include "stm-init.h"
 #include "stm-uart.h"
+#include "stm-crc.h"
 #include "mgmt-cli.h"
 #include "mgmt-misc.h"
 #undef HAL_OK
@@ -47,16 +48,16 @@
 #include <string.h>
 
 
-static volatile hal_crc32_t demo_crc;
+static volatile uint32_t demo_crc;
 
 static HAL_StatusTypeDef _count_bytes_callback(uint8_t *buf, size_t len) {
-    demo_crc = hal_crc32_update(demo_crc, buf, len);
+    demo_crc = stm_crc32_update(demo_crc, buf, len);
     return CMSIS_HAL_OK;
 }
 
 int cli_receive_data(struct cli_def *cli, uint8_t *buf, size_t len, cli_data_callback data_callback)
 {
-    hal_crc32_t crc = 0, my_crc = hal_crc32_init();
+    uint32_t crc = 0, my_crc = stm_crc32_init();
     uint32_t filesize = 0, counter = 0;
     size_t n = len;
 
@@ -87,7 +88,7 @@ int cli_receive_data(struct cli_def *cli, uint8_t *buf, size_t len, cli_data_cal
 	    goto fail;
 	}
 	filesize -= n;
-	my_crc = hal_crc32_update(my_crc, buf, n);
+	my_crc = stm_crc32_update(my_crc, buf, n);
 
 	/* After reception of a chunk but before ACKing we have "all" the time in the world to
 	 * calculate CRC and invoke the data_callback.
@@ -101,7 +102,7 @@ int cli_receive_data(struct cli_def *cli, uint8_t *buf, size_t len, cli_data_cal
 	uart_send_bytes((void *) &counter, 4);
     }
 
-    my_crc = hal_crc32_finalize(my_crc);
+    my_crc = stm_crc32_finalize(my_crc);
     cli_print(cli, "Send CRC-32");
     uart_receive_bytes((void *) &crc, sizeof(crc), 1000);
     cli_print(cli, "CRC-32 0x%x, calculated CRC 0x%x", (unsigned int) crc, (unsigned int) my_crc);
@@ -124,9 +125,9 @@ static int cmd_filetransfer(struct cli_def *cli, const char *command, char *argv
     argv = argv;
     argc = argc;
 
-    demo_crc = hal_crc32_init();
+    demo_crc = stm_crc32_init();
     cli_receive_data(cli, &buf[0], sizeof(buf), _count_bytes_callback);
-    demo_crc = hal_crc32_finalize(demo_crc);
+    demo_crc = stm_crc32_finalize(demo_crc);
     cli_print(cli, "Demo CRC is: %li/0x%x", demo_crc, (unsigned int) demo_crc);
     return CLI_OK;
 }
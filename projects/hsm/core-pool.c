@@ -0,0 +1,450 @@
+/*
+ * core-pool.c
+ * -----------
+ * Queue and account for FPGA core allocations.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * When every instance of a core is busy, libhal's hal_core_alloc() yields
+ * and tries again, so whichever task happens to run next gets the core,
+ * and nobody knows how long anybody waited. The linker sends libhal's
+ * hal_core_alloc(), hal_core_alloc2() and hal_core_free() here instead
+ * (-Wl,--wrap). A request that can't be met right away joins a queue and
+ * sleeps until a core of its type is freed, and requests are served in the
+ * order they arrived (except from tasks that already hold a core, which
+ * don't queue). Along the way we keep track of how long each core is
+ * busy and how long requests wait, for "fpga show cores".
+ *
+ * The tasker is cooperative and none of this yields except to sleep, so
+ * there's no locking.
+ */
+
+#define HAL_OK CMSIS_HAL_OK
+#include "stm-init.h"
+#undef HAL_OK
+
+#define HAL_OK LIBHAL_OK
+#include "hal.h"
+#undef HAL_OK
+
+#include "task.h"
+#include "core-pool.h"
+
+#include <string.h>
+
+#define CORE_POOL_MAX_TYPES     CORE_POOL_MAX_CORES
+#ifndef NUM_RPC_TASK
+#define NUM_RPC_TASK            1
+#endif
+
+/* The dispatch tasks, plus the CLI and one to spare. */
+#define CORE_POOL_MAX_WAITERS   (NUM_RPC_TASK + 2)
+
+static struct {
+    hal_core_t *core;
+    int type;
+    int busy;
+    tcb_t *owner;               /* task it was handed out to */
+    uint32_t start, start_tick; /* DWT->CYCCNT and HAL_GetTick() then */
+    struct core_pool_core_stats stats;
+} cores[CORE_POOL_MAX_CORES];
+static unsigned ncores;
+
+static struct core_pool_type_stats types[CORE_POOL_MAX_TYPES];
+static unsigned ntypes;
+
+/* A request for one or two cores. Either is a type (any instance), or a
+ * specific core, or nothing (-1).
+ */
+static struct {
+    tcb_t *task;
+    uint32_t seq;
+    int type[2], core[2];
+} waiters[CORE_POOL_MAX_WAITERS];
+static unsigned nwaiting;
+static uint32_t waiter_seq;
+
+static uint32_t stats_start;    /* HAL_GetTick() when the stats were reset */
+
+/* Microseconds since DWT->CYCCNT was `cycles' and HAL_GetTick() was
+ * `tick'. The cycle counter wraps every 23.8 seconds at 180 MHz, so
+ * longer than that, go by the tick.
+ */
+static uint64_t elapsed_us(uint32_t cycles, uint32_t tick)
+{
+    uint32_t ms = HAL_GetTick() - tick;
+    if (ms >= 20000)
+        return (uint64_t)ms * 1000;
+    return (DWT->CYCCNT - cycles) / (SystemCoreClock / 1000000);
+}
+
+/* Learn the cores in the bitstream. Called again if we're asked about a
+ * core we haven't seen, which happens after the FPGA has been reset.
+ */
+static void scan(void)
+{
+    if (ncores == 0) {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        stats_start = HAL_GetTick();
+    }
+
+    for (hal_core_t *core = hal_core_iterate(NULL);
+         core != NULL && ncores < CORE_POOL_MAX_CORES;
+         core = hal_core_iterate(core)) {
+
+        unsigned i, t;
+        for (i = 0; i < ncores && cores[i].core != core; ++i)
+            ;
+        if (i < ncores)
+            continue;
+
+        const hal_core_info_t *info = hal_core_info(core);
+        for (t = 0; t < ntypes && memcmp(types[t].name, info->name, sizeof(types[t].name)) != 0; ++t)
+            ;
+        if (t == ntypes) {
+            if (ntypes == CORE_POOL_MAX_TYPES)
+                continue;
+            memset(&types[t], 0, sizeof(types[t]));
+            memcpy(types[t].name, info->name, sizeof(types[t].name));
+            ++ntypes;
+        }
+        ++types[t].cores;
+
+        memset(&cores[ncores], 0, sizeof(cores[ncores]));
+        cores[ncores].core = core;
+        cores[ncores].type = t;
+        ++ncores;
+    }
+}
+
+static int core_index(const hal_core_t *core)
+{
+    for (int pass = 0; pass < 2; ++pass) {
+        for (unsigned i = 0; i < ncores; ++i)
+            if (cores[i].core == core)
+                return i;
+        scan();
+    }
+    return -1;
+}
+
+/* libhal names core types by prefix, e.g. "sha2-" would do for any of the
+ * SHA-2 cores, so a request may match several types. For queueing, we just
+ * take the first.
+ */
+static int type_index(const char *name)
+{
+    if (name == NULL)
+        return -1;
+
+    size_t n = 0;
+    while (n < sizeof(types[0].name) && name[n] != '\0')
+        ++n;
+
+    for (int pass = 0; pass < 2; ++pass) {
+        for (unsigned t = 0; t < ntypes; ++t)
+            if (memcmp(types[t].name, name, n) == 0)
+                return t;
+        scan();
+    }
+    return -1;
+}
+
+static unsigned free_cores(int type)
+{
+    unsigned n = 0;
+    for (unsigned i = 0; i < ncores; ++i)
+        if (cores[i].type == type && !cores[i].busy)
+            ++n;
+    return n;
+}
+
+/* Could waiter w have what it wants right now, if nobody ahead of it in
+ * the queue wanted the same thing?
+ */
+static int satisfiable(unsigned w)
+{
+    for (int k = 0; k < 2; ++k) {
+        if (waiters[w].core[k] >= 0 && cores[waiters[w].core[k]].busy)
+            return 0;
+        if (waiters[w].type[k] >= 0) {
+            unsigned need = (k == 0 && waiters[w].type[0] == waiters[w].type[1]) ? 2 : 1;
+            if (free_cores(waiters[w].type[k]) < need)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int wants_same(unsigned a, unsigned b)
+{
+    for (int j = 0; j < 2; ++j)
+        for (int k = 0; k < 2; ++k)
+            if ((waiters[a].type[j] >= 0 && waiters[a].type[j] == waiters[b].type[k]) ||
+                (waiters[a].core[j] >= 0 && waiters[a].core[j] == waiters[b].core[k]) ||
+                (waiters[a].core[j] >= 0 && cores[waiters[a].core[j]].type == waiters[b].type[k]) ||
+                (waiters[b].core[k] >= 0 && cores[waiters[b].core[k]].type == waiters[a].type[j]))
+                return 1;
+    return 0;
+}
+
+/* It's w's turn if it can be satisfied and nobody who got here first is
+ * waiting for the same kind of core. (Waiting our turn behind a request
+ * that can't be served yet is only safe because nobody in the queue holds
+ * a core; see enqueue().)
+ */
+static int my_turn(unsigned w)
+{
+    if (!satisfiable(w))
+        return 0;
+    for (unsigned i = 0; i < CORE_POOL_MAX_WAITERS; ++i)
+        if (i != w && waiters[i].task != NULL &&
+            (int32_t)(waiters[i].seq - waiters[w].seq) < 0 && wants_same(i, w))
+            return 0;
+    return 1;
+}
+
+/* The type a waiter is accounted under. */
+static int waiter_type(unsigned w)
+{
+    if (waiters[w].type[0] >= 0)
+        return waiters[w].type[0];
+    if (waiters[w].core[0] >= 0)
+        return cores[waiters[w].core[0]].type;
+    return -1;
+}
+
+static int holds_core(const tcb_t *task)
+{
+    for (unsigned i = 0; i < ncores; ++i)
+        if (cores[i].busy && cores[i].owner == task)
+            return 1;
+    return 0;
+}
+
+/* Queue up for one or two cores, and return when it's our turn. Returns
+ * the waiter slot to give back to dequeue(), or -1 if we're not queueing
+ * (no tasker yet, or a full queue), in which case libhal's own retry loop
+ * is all there is.
+ *
+ * A task that already holds a core doesn't queue either: somebody ahead
+ * of it might be waiting for that core, and would never get it.
+ */
+static int enqueue(int type0, int core0, int type1, int core1)
+{
+    tcb_t *self = task_get_tcb();
+    unsigned w;
+
+    if (self == NULL || holds_core(self))
+        return -1;
+    for (w = 0; w < CORE_POOL_MAX_WAITERS && waiters[w].task != NULL; ++w)
+        ;
+    if (w == CORE_POOL_MAX_WAITERS)
+        return -1;
+
+    waiters[w].task = self;
+    waiters[w].seq = waiter_seq++;
+    waiters[w].type[0] = type0;
+    waiters[w].core[0] = core0;
+    waiters[w].type[1] = type1;
+    waiters[w].core[1] = core1;
+    ++nwaiting;
+
+    const int t = waiter_type(w);
+    if (t >= 0)
+        ++types[t].requests;
+
+    task_sleep_prepare();
+    if (my_turn(w))
+        return w;
+
+    /* We have to wait. */
+    const uint32_t t0 = DWT->CYCCNT, tick0 = HAL_GetTick();
+    if (t >= 0) {
+        unsigned n = 0;
+        for (unsigned i = 0; i < CORE_POOL_MAX_WAITERS; ++i)
+            if (waiters[i].task != NULL && waiter_type(i) == t)
+                ++n;
+        ++types[t].queued;
+        if (types[t].queue_max < n)
+            types[t].queue_max = n;
+    }
+
+    do {
+        task_sleep();
+        task_sleep_prepare();
+    } while (!my_turn(w));
+
+    if (t >= 0) {
+        const uint64_t us = elapsed_us(t0, tick0);
+        types[t].wait_us += us;
+        if (types[t].wait_max_us < us)
+            types[t].wait_max_us = (us < UINT32_MAX) ? us : UINT32_MAX;
+    }
+
+    return w;
+}
+
+static void dequeue(int w)
+{
+    if (w < 0)
+        return;
+    waiters[w].task = NULL;
+    --nwaiting;
+}
+
+static void mark_busy(const hal_core_t *core)
+{
+    int i;
+    if (core == NULL || (i = core_index(core)) < 0)
+        return;
+    cores[i].busy = 1;
+    cores[i].owner = task_get_tcb();
+    cores[i].start = DWT->CYCCNT;
+    cores[i].start_tick = HAL_GetTick();
+    ++cores[i].stats.allocs;
+}
+
+/* Wake everybody in the queue; whoever's turn it is will take the core,
+ * and the rest go back to sleep.
+ */
+static void wake_waiters(void)
+{
+    for (unsigned w = 0; w < CORE_POOL_MAX_WAITERS; ++w)
+        if (waiters[w].task != NULL)
+            task_wake(waiters[w].task);
+}
+
+extern hal_error_t __real_hal_core_alloc(const char *name, hal_core_t **core, hal_core_lru_t *pomace);
+extern hal_error_t __real_hal_core_alloc2(const char *name1, hal_core_t **pcore1, hal_core_lru_t *pomace1,
+                                          const char *name2, hal_core_t **pcore2, hal_core_lru_t *pomace2);
+extern void __real_hal_core_free(hal_core_t *core);
+
+/* libhal asks for a specific core by passing it in *pcore. */
+static void request(const char *name, hal_core_t **pcore, int *type, int *core)
+{
+    *type = -1;
+    *core = -1;
+    if (pcore != NULL && *pcore != NULL)
+        *core = core_index(*pcore);
+    else
+        *type = type_index(name);
+}
+
+hal_error_t __wrap_hal_core_alloc(const char *name, hal_core_t **pcore, hal_core_lru_t *pomace)
+{
+    int type, core;
+
+    request(name, pcore, &type, &core);
+
+    int w = (type < 0 && core < 0) ? -1 : enqueue(type, core, -1, -1);
+    hal_error_t err = __real_hal_core_alloc(name, pcore, pomace);
+    dequeue(w);
+
+    if (err == LIBHAL_OK)
+        mark_busy(*pcore);
+    return err;
+}
+
+hal_error_t __wrap_hal_core_alloc2(const char *name1, hal_core_t **pcore1, hal_core_lru_t *pomace1,
+                                   const char *name2, hal_core_t **pcore2, hal_core_lru_t *pomace2)
+{
+    int type1, core1, type2, core2;
+
+    request(name1, pcore1, &type1, &core1);
+    request(name2, pcore2, &type2, &core2);
+
+    int w = (type1 < 0 && core1 < 0) ? -1 : enqueue(type1, core1, type2, core2);
+    hal_error_t err = __real_hal_core_alloc2(name1, pcore1, pomace1, name2, pcore2, pomace2);
+    dequeue(w);
+
+    if (err == LIBHAL_OK) {
+        mark_busy(*pcore1);
+        mark_busy(*pcore2);
+    }
+    return err;
+}
+
+void __wrap_hal_core_free(hal_core_t *core)
+{
+    int i;
+
+    if (core != NULL && (i = core_index(core)) >= 0 && cores[i].busy) {
+        cores[i].busy = 0;
+        cores[i].owner = NULL;
+        cores[i].stats.busy_us += elapsed_us(cores[i].start, cores[i].start_tick);
+    }
+
+    __real_hal_core_free(core);
+    wake_waiters();
+}
+
+int core_pool_get_core_stats(const hal_core_t *core, struct core_pool_core_stats *stats)
+{
+    int i = core_index(core);
+    if (i < 0)
+        return 0;
+    *stats = cores[i].stats;
+    stats->busy = cores[i].busy;
+    return 1;
+}
+
+int core_pool_get_type_stats(unsigned n, struct core_pool_type_stats *stats)
+{
+    if (ncores == 0)
+        scan();
+    if (n >= ntypes)
+        return 0;
+    *stats = types[n];
+    return 1;
+}
+
+uint32_t core_pool_elapsed_ms(void)
+{
+    return HAL_GetTick() - stats_start;
+}
+
+/* Forget the cores we know about, before the FPGA is reset. Sleeping
+ * requests hold indices into cores[], and cores in use will be freed back
+ * to us, so refuse (return 0) while there are any of either.
+ */
+int core_pool_reset(void)
+{
+    if (nwaiting > 0)
+        return 0;
+    for (unsigned i = 0; i < ncores; ++i)
+        if (cores[i].busy)
+            return 0;
+    ncores = 0;
+    ntypes = 0;
+    return 1;
+}
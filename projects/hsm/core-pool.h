@@ -0,0 +1,65 @@
+/*
+ * core-pool.h
+ * -----------
+ * Queue and account for FPGA core allocations.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CORE_POOL_H_
+#define _CORE_POOL_H_
+
+#include <stdint.h>
+
+#ifndef CORE_POOL_MAX_CORES
+#define CORE_POOL_MAX_CORES     64
+#endif
+
+struct core_pool_core_stats {
+    uint32_t allocs;            /* times the core was handed out */
+    uint32_t busy;              /* whether it's in use right now */
+    uint64_t busy_us;           /* total time in use */
+};
+
+struct core_pool_type_stats {
+    char name[8];               /* core name, not NUL-terminated */
+    uint32_t cores;             /* instances in the bitstream */
+    uint32_t requests;
+    uint32_t queued;            /* requests that had to wait for a core */
+    uint32_t queue_max;         /* most requests waiting at once */
+    uint64_t wait_us;           /* total time spent waiting */
+    uint32_t wait_max_us;
+};
+
+extern int core_pool_get_core_stats(const hal_core_t *core, struct core_pool_core_stats *stats);
+extern int core_pool_get_type_stats(unsigned n, struct core_pool_type_stats *stats);
+extern uint32_t core_pool_elapsed_ms(void);
+extern int core_pool_reset(void);
+
+#endif /* _CORE_POOL_H_ */
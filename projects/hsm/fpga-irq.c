@@ -0,0 +1,209 @@
+/*
+ * fpga-irq.c
+ * ----------
+ * Sleep through FPGA core waits until the core interrupts.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * libhal waits for an FPGA core by reading its status register over the
+ * FMC bus until the core is ready, calling hal_task_yield_maybe() between
+ * reads. That keeps the bus busy, and the waiting task only notices the
+ * core is done on its next read.
+ *
+ * With a bitstream that raises FPGA_IRQ when a core finishes, we can do
+ * better. The linker sends libhal's hal_io_wait() and hal_io_wait2() here
+ * (-Wl,--wrap), so we know which tasks are in a core wait. When one of
+ * them calls hal_task_yield_maybe(), it goes to sleep until the interrupt
+ * (or a short timeout) wakes it to read the status again.
+ */
+
+#define HAL_OK CMSIS_HAL_OK
+#include "stm-init.h"
+#include "stm-fpgacfg.h"
+#undef HAL_OK
+
+#define HAL_OK LIBHAL_OK
+#include "hal.h"
+#include "hal_internal.h"
+#undef HAL_OK
+
+#include "task.h"
+#include "fpga-irq.h"
+
+/* One for each task that can be in a core wait at the same time. */
+#define FPGA_IRQ_MAX_WAITERS    (NUM_RPC_TASK + 2)
+
+static struct {
+    tcb_t *task;
+    volatile int asleep;
+    volatile uint32_t since;    /* HAL_GetTick() when it went to sleep */
+    uint32_t irqs;              /* stats.irqs when it last read the status */
+    uint32_t cycle;             /* DWT->CYCCNT likewise */
+} waiters[FPGA_IRQ_MAX_WAITERS];
+
+static struct fpga_irq_stats stats;
+
+/* Interrupt handler callback: wake everybody, since we don't know which
+ * core finished. The ones whose core isn't done just go back to sleep.
+ */
+static void fpga_irq_callback(void)
+{
+    ++stats.irqs;
+    for (int i = 0; i < FPGA_IRQ_MAX_WAITERS; ++i)
+        if (waiters[i].asleep)
+            task_wake(waiters[i].task);
+}
+
+/* Called from SysTick: wake anybody who's slept too long. */
+void fpga_irq_tick(void)
+{
+    uint32_t now = HAL_GetTick();
+
+    for (int i = 0; i < FPGA_IRQ_MAX_WAITERS; ++i)
+        if (waiters[i].asleep && now - waiters[i].since >= FPGA_IRQ_TIMEOUT_MS) {
+            waiters[i].asleep = 0;
+            ++stats.timeouts;
+            task_wake(waiters[i].task);
+        }
+}
+
+void fpga_irq_init(void)
+{
+    /* The cycle counter measures how long a status read takes. */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    stats.poll_cycles = UINT32_MAX;
+    fpgacfg_irq_init(fpga_irq_callback);
+}
+
+static int waiter_find(tcb_t *task)
+{
+    for (int i = 0; i < FPGA_IRQ_MAX_WAITERS; ++i)
+        if (waiters[i].task == task)
+            return i;
+    return -1;
+}
+
+static int wait_begin(void)
+{
+    tcb_t *self = task_get_tcb();
+    int i;
+
+    /* Before the tasker starts, or with too many waiters, just poll. If
+     * this task is already waiting (hal_io_wait() calling hal_io_wait2(),
+     * say), the outer wait has it covered.
+     */
+    if (self == NULL || waiter_find(self) >= 0 || (i = waiter_find(NULL)) < 0)
+        return -1;
+
+    waiters[i].irqs = stats.irqs;
+    waiters[i].cycle = DWT->CYCCNT;
+    waiters[i].task = self;
+    ++stats.waits;
+    return i;
+}
+
+static void wait_end(int i)
+{
+    if (i >= 0)
+        waiters[i].task = NULL;
+}
+
+/* hal_task_yield_maybe() calls this first. If the current task is in a
+ * core wait, the core was busy when it last looked, so sleep until the
+ * FPGA says something has finished, and return 1. Otherwise return 0, and
+ * let the caller yield (or not) as usual.
+ */
+int fpga_irq_yield(void)
+{
+    int i = waiter_find(task_get_tcb());
+    if (i < 0)
+        return 0;
+
+    uint32_t now = DWT->CYCCNT;
+    uint32_t cycles = now - waiters[i].cycle;
+    if (cycles < stats.poll_cycles)
+        stats.poll_cycles = cycles;
+    ++stats.polls;
+
+    /* If the interrupt came after the status read, don't wait for another.
+     * The check and going to sleep have to be atomic with respect to the
+     * interrupt, or one landing in between would be missed; one landing
+     * after this just makes task_sleep() return right away.
+     */
+    hal_critical_section_start();
+    task_sleep_prepare();
+    if (stats.irqs != waiters[i].irqs) {
+        waiters[i].irqs = stats.irqs;
+        hal_critical_section_end();
+        waiters[i].cycle = now;
+        return 1;
+    }
+    waiters[i].since = HAL_GetTick();
+    waiters[i].asleep = 1;
+    hal_critical_section_end();
+
+    task_sleep();
+    waiters[i].asleep = 0;
+
+    waiters[i].cycle = DWT->CYCCNT;
+    waiters[i].irqs = stats.irqs;
+    ++stats.sleeps;
+    if (stats.poll_cycles > 0)
+        stats.polls_avoided += (waiters[i].cycle - now) / stats.poll_cycles;
+
+    return 1;
+}
+
+extern hal_error_t __real_hal_io_wait(const hal_core_t *core, const uint8_t status, int *count);
+extern hal_error_t __real_hal_io_wait2(const hal_core_t *core1, const hal_core_t *core2, const uint8_t status, int *count);
+
+hal_error_t __wrap_hal_io_wait(const hal_core_t *core, const uint8_t status, int *count)
+{
+    int i = wait_begin();
+    hal_error_t err = __real_hal_io_wait(core, status, count);
+    wait_end(i);
+    return err;
+}
+
+hal_error_t __wrap_hal_io_wait2(const hal_core_t *core1, const hal_core_t *core2, const uint8_t status, int *count)
+{
+    int i = wait_begin();
+    hal_error_t err = __real_hal_io_wait2(core1, core2, status, count);
+    wait_end(i);
+    return err;
+}
+
+void fpga_irq_get_stats(struct fpga_irq_stats *s)
+{
+    *s = stats;
+}
@@ -0,0 +1,63 @@
+/*
+ * fpga-irq.h
+ * ----------
+ * Sleep through FPGA core waits until the core interrupts.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FPGA_IRQ_H_
+#define _FPGA_IRQ_H_
+
+#include <stdint.h>
+
+/* A task waiting for a core that hasn't interrupted after this long polls
+ * it anyway, in case the edge was missed or the bitstream doesn't drive
+ * the line for that core.
+ */
+#ifndef FPGA_IRQ_TIMEOUT_MS
+#define FPGA_IRQ_TIMEOUT_MS     2
+#endif
+
+struct fpga_irq_stats {
+    uint32_t irqs;              /* interrupts from the FPGA */
+    uint32_t waits;             /* libhal core waits */
+    uint32_t polls;             /* status reads in those that found the core busy */
+    uint32_t sleeps;            /* times a waiting task slept instead of polling */
+    uint32_t timeouts;          /* ...and was woken by the timeout, not the FPGA */
+    uint32_t polls_avoided;     /* estimated status reads saved by sleeping */
+    uint32_t poll_cycles;       /* shortest status read seen, in CPU cycles */
+};
+
+extern void fpga_irq_init(void);
+extern void fpga_irq_tick(void);
+extern int fpga_irq_yield(void);
+extern void fpga_irq_get_stats(struct fpga_irq_stats *stats);
+
+#endif /* _FPGA_IRQ_H_ */
@@ -49,9 +49,18 @@
 #include "stm-fmc.h"
 #include "stm-uart.h"
 #include "stm-sdram.h"
+#include "stm-keystore.h"
+#ifdef DO_KEYSTORE_LOG
+#include "keystore-log.h"
+#endif
 #include "task.h"
+#ifdef DO_FPGA_IRQ
+#include "fpga-irq.h"
+#endif
 
 #include "mgmt-cli.h"
+#include "mgmt-fpga.h"
+#include "mgmt-memory.h"
 
 #undef HAL_OK
 #define HAL_OK LIBHAL_OK
@@ -89,6 +98,43 @@ static uint8_t busy_stack[BUSY_STACK_SIZE];
 #define CLI_STACK_SIZE 16*1024
 #endif
 
+/* Stack for the keystore task, which writes back cached pages, pre-erases
+ * free subsectors, and does log GC and blank map snapshots. The deepest
+ * paths are hal_log() (a 2KB buffer plus vsnprintf), and an erase that
+ * fails inside keystore_idle(), which marks the snapshot stale and ends up
+ * in n25q128_write_page() with a page or two on the stack at each level.
+ * In SDRAM, like the CLI stack.
+ */
+#ifndef KEYSTORE_STACK_SIZE
+#define KEYSTORE_STACK_SIZE 8*1024
+#endif
+
+/* Stack for the task that writes FPGA bitstream uploads to the config
+ * memory, in SDRAM.
+ */
+#ifndef FPGA_UPLOAD_STACK_SIZE
+#define FPGA_UPLOAD_STACK_SIZE 4*1024
+#endif
+
+/* Sizes of the keystore read and write-back caches, in SDRAM. 0 disables
+ * a cache. The read cache holds 4KB subsectors.
+ */
+#ifndef KEYSTORE_READ_CACHE_SIZE
+#define KEYSTORE_READ_CACHE_SIZE 256*1024
+#endif
+#ifndef KEYSTORE_WRITE_CACHE_SIZE
+#define KEYSTORE_WRITE_CACHE_SIZE 16*1024
+#endif
+
+/* Number of keystore subsectors to keep erased ahead of time, so that
+ * libhal doesn't have to wait for an erase when it writes a new block.
+ * This can be changed from the CLI.
+ */
+#ifndef KEYSTORE_PREERASE_DEPTH
+#define KEYSTORE_PREERASE_DEPTH 16
+#endif
+unsigned keystore_preerase_depth = KEYSTORE_PREERASE_DEPTH;
+
 /* RPC buffers. For each active request, there will be two - input and output.
  */
 typedef struct rpc_buffer_s {
@@ -171,19 +217,54 @@ static void dispatch_task(void);
 static void busy_task(void);
 static tcb_t *busy_tcb;
 
-/* Select an available dispatch task. For simplicity, this doesn't try to
- * allocate tasks in a round-robin fashion, so the lowest-numbered task
- * will see the most action. OTOH, this lets us gauge the level of system
- * activity in the CLI's 'task show' command.
+/* Dispatch tasks that are waiting for a request. A dispatch task can also
+ * sleep in the middle of a request (waiting for a DMA transfer, say), so
+ * TASK_WAITING alone doesn't mean it's free. A task puts itself on this
+ * list just before it sleeps waiting for work, and whoever wakes it for a
+ * request takes it off.
+ */
+static tcb_t *dispatch_idle[NUM_RPC_TASK];
+
+/* Put a dispatch task on the idle list, or take it off. */
+static void dispatch_set_idle(tcb_t *t, int idle)
+{
+    tcb_t **slot = NULL;
+
+    hal_critical_section_start();
+    for (size_t i = 0; i < NUM_RPC_TASK; ++i) {
+        if (dispatch_idle[i] == t) {
+            if (!idle)
+                dispatch_idle[i] = NULL;
+            slot = NULL;
+            break;
+        }
+        if (dispatch_idle[i] == NULL && slot == NULL)
+            slot = &dispatch_idle[i];
+    }
+    if (idle && slot != NULL)
+        *slot = t;
+    hal_critical_section_end();
+}
+
+/* Select an available dispatch task, and take it off the idle list. For
+ * simplicity, this doesn't try to allocate tasks in a round-robin fashion,
+ * so the task in the lowest idle slot will see the most action.
  */
 static tcb_t *task_next_waiting(void)
 {
-    for (tcb_t *t = task_iterate(NULL); t; t = task_iterate(t)) {
-        if (task_get_func(t) == dispatch_task &&
-            task_get_state(t) == TASK_WAITING)
-            return t;
+    tcb_t *t = NULL;
+
+    hal_critical_section_start();
+    for (size_t i = 0; i < NUM_RPC_TASK; ++i) {
+        if (dispatch_idle[i] != NULL) {
+            t = dispatch_idle[i];
+            dispatch_idle[i] = NULL;
+            break;
+        }
     }
-    return NULL;
+    hal_critical_section_end();
+
+    return t;
 }
 
 static uint8_t *sdram_malloc(size_t size);
@@ -265,6 +346,10 @@ void HAL_SYSTICK_Callback(void)
     profil_callback();
 #endif
 
+#ifdef DO_FPGA_IRQ
+    fpga_irq_tick();
+#endif
+
     size_t count = RINGBUF_COUNT(uart_ringbuf);
     if (uart_rx_max < count) uart_rx_max = count;
 
@@ -290,13 +375,20 @@ static void dispatch_task(void)
     rpc_buffer_t obuf_s, *obuf = &obuf_s;
 
     while (1) {
-        /* Wait for a complete RPC request */
-        task_sleep();
-
+        /* Take the next request, or if there isn't one, say we're free and
+         * wait for one. Requests that came in while we were busy are still
+         * on the queue, so we have to check before sleeping.
+         */
+        task_sleep_prepare();
         rpc_buffer_t *ibuf = ibuf_get(&ibuf_ready);
-        if (ibuf == NULL)
-            /* probably an error, but go back to sleep */
+        if (ibuf == NULL) {
+            dispatch_set_idle(task_get_tcb(), 1);
+            task_sleep();
             continue;
+        }
+
+        /* In case something other than a new request woke us. */
+        dispatch_set_idle(task_get_tcb(), 0);
 
         memset(obuf, 0, sizeof(*obuf));
         obuf->len = sizeof(obuf->buf);
@@ -324,6 +416,7 @@ static void busy_task(void)
         /* Wake as many tasks as we have requests.
          */
         size_t n;
+        task_sleep_prepare();
         for (n = request_queue_len(); n > 0; --n) {
             tcb_t *t;
             if ((t = task_next_waiting()) != NULL)
@@ -348,6 +441,12 @@ static void hashsig_restart_task(void)
     while (fpgacfg_check_done() != CMSIS_HAL_OK)
         task_yield();
 
+    /* Now that there's something to talk to, see if the FMC bus can run
+     * at 90 MHz. This doesn't yield, so no other task can get at the FPGA
+     * in the meantime.
+     */
+    (void) fmc_calibrate();
+
     /* reinitialize the hashsig key structures after a device restart */
     hal_hashsig_ks_init();
 
@@ -355,14 +454,183 @@ static void hashsig_restart_task(void)
     task_mod((char *)task_get_cookie(NULL), dispatch_task, NULL);
 }
 
+#include "ks.h"
+
+/* Look at the next keystore subsector, and if libhal has no use for it
+ * (it's been zeroed, or it's marked erased but isn't quite), start erasing
+ * it. Returns 1 if it erased something.
+ *
+ * The keystore mutex is only held while talking to the chip; anybody who
+ * wants the keystore while the erase is running waits in the driver, as
+ * they would have anyway.
+ */
+static int keystore_preerase_step(void)
+{
+    static uint32_t next = 0;
+    HAL_StatusTypeDef status;
+    int start = 0, is_blank;
+    uint8_t block_type;
+
+    hal_ks_lock();
+    const uint32_t subsector = next++ % KEYSTORE_NUM_SUBSECTORS;
+    if (keystore_read_data_nocache(subsector * KEYSTORE_SUBSECTOR_SIZE, &block_type, 1) == CMSIS_HAL_OK) {
+        if (block_type == HAL_KS_BLOCK_TYPE_ZEROED)
+            start = 1;
+        else if (block_type == HAL_KS_BLOCK_TYPE_ERASED &&
+                 keystore_check_blank(subsector, &is_blank) == CMSIS_HAL_OK)
+            start = !is_blank;
+    }
+    if (start)
+        start = keystore_erase_subsector_start(subsector) == CMSIS_HAL_OK;
+    hal_ks_unlock();
+
+    if (!start)
+        return 0;
+
+    do {
+        task_yield();
+        hal_ks_lock();
+        status = keystore_erase_poll();
+        hal_ks_unlock();
+    } while (status == HAL_BUSY);
+
+    return 1;
+}
+
+#ifdef DO_KEYSTORE_LOG
+/* Erase a subsector that the log-structured keystore has finished with.
+ * Returns 1 if there was one. Locking as in keystore_preerase_step().
+ */
+static int keystore_gc_step(void)
+{
+    HAL_StatusTypeDef status;
+
+    hal_ks_lock();
+    const int start = keystore_log_gc_start();
+    hal_ks_unlock();
+
+    if (!start)
+        return 0;
+
+    do {
+        task_yield();
+        hal_ks_lock();
+        status = keystore_log_gc_poll();
+        hal_ks_unlock();
+    } while (status == HAL_BUSY);
+
+    return 1;
+}
+#endif
+
+#ifdef DO_KEYSTORE_SNAPSHOT
+/* Save the blank map if it's changed and then settled down. Returns 1 if
+ * it did. Locking as in keystore_preerase_step().
+ */
+static int keystore_snapshot_step(void)
+{
+    HAL_StatusTypeDef status;
+
+    hal_ks_lock();
+    const int start = keystore_snapshot_start(KEYSTORE_SNAPSHOT_QUIET_MS);
+    hal_ks_unlock();
+
+    if (!start)
+        return 0;
+
+    do {
+        task_yield();
+        hal_ks_lock();
+        status = keystore_snapshot_poll();
+        hal_ks_unlock();
+    } while (status == HAL_BUSY);
+
+    return 1;
+}
+#endif
+
+/* Look after the keystore in the background:
+ *
+ * - Write back pages that have been sitting in the cache for a while, so
+ *   a power failure doesn't lose more than a second or so of changes.
+ *
+ * - With the log-structured keystore, when no RPC requests are waiting,
+ *   erase the subsectors it has freed.
+ *
+ * - With the blank map snapshot, when no RPC requests are waiting, save
+ *   the map once it's stopped changing.
+ *
+ * - When no RPC requests are waiting, keep a pool of free subsectors
+ *   erased. If a full pass over the keystore finds nothing to erase, wait
+ *   a while before trying again.
+ */
+#define KEYSTORE_PREERASE_RETRY_MS 10000
+
+static void keystore_task(void)
+{
+    uint32_t flush_tick = HAL_GetTick(), pass_tick = 0;
+    uint32_t scanned = 0;
+    struct keystore_cache_stats stats;
+
+    hal_ks_lock();
+    keystore_get_cache_stats(&stats);
+    hal_ks_unlock();
+
+    while (1) {
+        if (HAL_GetTick() - flush_tick >= KEYSTORE_CACHE_FLUSH_MS / 4) {
+            hal_ks_lock();
+            HAL_StatusTypeDef status = keystore_cache_flush_expired(KEYSTORE_CACHE_FLUSH_MS);
+            hal_ks_unlock();
+            /* The pages are lost, and nobody else will hear about it. */
+            if (status != CMSIS_HAL_OK)
+                hal_log(HAL_LOG_ERROR, "keystore: writing back cached pages failed");
+            flush_tick = HAL_GetTick();
+        }
+
+#ifdef DO_KEYSTORE_LOG
+        if (request_queue_len() == 0 && keystore_gc_step()) {
+            task_yield();
+        }
+        else
+#endif
+#ifdef DO_KEYSTORE_SNAPSHOT
+        if (request_queue_len() == 0 && keystore_snapshot_step()) {
+            task_yield();
+        }
+        else
+#endif
+        if (stats.blank_subsectors < keystore_preerase_depth &&
+            scanned < KEYSTORE_NUM_SUBSECTORS &&
+            request_queue_len() == 0) {
+            if (keystore_preerase_step())
+                scanned = 0;
+            else if (++scanned == KEYSTORE_NUM_SUBSECTORS)
+                pass_tick = HAL_GetTick();
+            task_yield();
+        }
+        else {
+            task_delay(KEYSTORE_CACHE_FLUSH_MS / 4);
+            if (scanned == KEYSTORE_NUM_SUBSECTORS &&
+                HAL_GetTick() - pass_tick >= KEYSTORE_PREERASE_RETRY_MS)
+                scanned = 0;
+        }
+
+        hal_ks_lock();
+        keystore_get_cache_stats(&stats);
+        hal_ks_unlock();
+    }
+}
+
 /* end of variables declared with __attribute__((section(".sdram1"))) */
 extern uint8_t _esdram1 __asm ("_esdram1");
 /* end of SDRAM1 section */
 extern uint8_t __end_sdram1 __asm ("__end_sdram1");
 static uint8_t *sdram_heap = &_esdram1;
 
-/* Allocate memory from SDRAM1. */
-static uint8_t *sdram_malloc(size_t size)
+/* Allocate memory from SDRAM1. The caller address is only used for
+ * DO_MEMORY_METRICS attribution.
+ */
+static uint8_t *_sdram_malloc(size_t size, const void *caller)
 {
     uint8_t *p = sdram_heap;
 
@@ -376,9 +644,21 @@ static uint8_t *sdram_malloc(size_t size)
     p += sizeof(uint32_t);
 
     sdram_heap += size + sizeof(uint32_t);
+
+#ifdef DO_MEMORY_METRICS
+    memory_metrics_alloc(p, size, caller);
+#else
+    caller = caller;
+#endif
+
     return p;
 }
 
+static uint8_t * __attribute__((noinline)) sdram_malloc(size_t size)
+{
+    return _sdram_malloc(size, __builtin_return_address(0));
+}
+
 /* A very limited form of free(), which only frees memory if it's at the
  * top of the heap.
  */
@@ -388,6 +668,9 @@ static hal_error_t sdram_free(uint8_t *ptr)
     uint32_t size = *(uint32_t *)p;
     if (ptr + size == sdram_heap) {
         sdram_heap = p;
+#ifdef DO_MEMORY_METRICS
+        memory_metrics_free(ptr);
+#endif
         return LIBHAL_OK;
     }
     else
@@ -409,7 +692,7 @@ hal_error_t sdram_stats(size_t *used, size_t *available)
  */
 void *hal_allocate_static_memory(const size_t size)
 {
-    return sdram_malloc(size);
+    return _sdram_malloc(size, __builtin_return_address(0));
 }
 
 hal_error_t hal_free_static_memory(const void * const ptr)
@@ -439,6 +722,11 @@ void hal_task_yield(void)
 
 void hal_task_yield_maybe(void)
 {
+#ifdef DO_FPGA_IRQ
+    /* In an FPGA core wait, sleep until the FPGA interrupts. */
+    if (fpga_irq_yield())
+        return;
+#endif
     task_yield_maybe();
 }
 
@@ -466,6 +754,31 @@ int main(void)
     stm_init();
     led_on(LED_GREEN);
 
+    /* Turn on the keystore caches before libhal starts using them. */
+#if KEYSTORE_READ_CACHE_SIZE > 0
+    void *keystore_read_cache = sdram_malloc(KEYSTORE_READ_CACHE_SIZE);
+    if (keystore_read_cache == NULL)
+        Error_Handler();
+    keystore_read_cache_init(keystore_read_cache, KEYSTORE_READ_CACHE_SIZE);
+#endif
+#if KEYSTORE_WRITE_CACHE_SIZE > 0
+    void *keystore_write_cache = sdram_malloc(KEYSTORE_WRITE_CACHE_SIZE);
+    if (keystore_write_cache == NULL)
+        Error_Handler();
+    keystore_write_cache_init(keystore_write_cache, KEYSTORE_WRITE_CACHE_SIZE);
+#endif
+#ifdef DO_KEYSTORE_LOG
+    if (keystore_log_init() != CMSIS_HAL_OK)
+        Error_Handler();
+#endif
+#ifdef DO_FPGA_IRQ
+    fpga_irq_init();
+#endif
+#ifdef DO_KEYSTORE_SNAPSHOT
+    /* If there's no usable snapshot, erases just go to the chip. */
+    (void) keystore_snapshot_load();
+#endif
+
     if (hal_rpc_server_init() != LIBHAL_OK)
         Error_Handler();
 
@@ -501,6 +814,19 @@ int main(void)
     if (busy_tcb == NULL)
         Error_Handler();
 
+    /* Create the keystore task. */
+    void *keystore_stack = (void *)sdram_malloc(KEYSTORE_STACK_SIZE);
+    if (task_add("keystore", keystore_task, NULL, keystore_stack, KEYSTORE_STACK_SIZE) == NULL)
+        Error_Handler();
+
+    /* Create the FPGA bitstream upload task. */
+    void *fpga_upload_stack = (void *)sdram_malloc(FPGA_UPLOAD_STACK_SIZE);
+    void *fpga_upload_buf = (void *)sdram_malloc(FPGA_UPLOAD_BUFFER_SIZE);
+    if (fpga_upload_stack == NULL || fpga_upload_buf == NULL)
+        Error_Handler();
+    if (task_add("fpga_upload", fpga_upload_task, fpga_upload_buf, fpga_upload_stack, FPGA_UPLOAD_STACK_SIZE) == NULL)
+        Error_Handler();
+
     /* Start the UART receiver. */
     if (HAL_UART_Receive_DMA(&huart_user, (uint8_t *) uart_ringbuf.buf, sizeof(uart_ringbuf.buf)) != CMSIS_HAL_OK)
         Error_Handler();
@@ -38,6 +38,7 @@
 #include "stm-uart.h"
 #include "stm-flash.h"
 #include "mgmt-cli.h"
+#include "mgmt-keystore.h"
 #include "mgmt-misc.h"
 #include "mgmt-bootloader.h"
 
@@ -73,6 +74,7 @@ static int cmd_bootloader_upload(struct cli_def *cli, const char *command, char
 
     int ret = cli_receive_data(cli, buf, sizeof(buf), _flash_write_callback);
     if (ret == CLI_OK) {
+        mgmt_keystore_sync();
         cli_print(cli, "\nRebooting\n");
         HAL_NVIC_SystemReset();
     }
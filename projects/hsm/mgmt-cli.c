@@ -50,6 +50,7 @@
 #include "mgmt-masterkey.h"
 #include "mgmt-tamper.h"
 #include "mgmt-task.h"
+#include "mgmt-memory.h"
 #include "mgmt-tamper.h"
 
 #undef HAL_OK
@@ -101,12 +102,20 @@ static ringbuf_t uart_ringbuf;
 /* current character received from UART */
 static uint8_t uart_rx;
 
+/* set while cli_uart_receive_bytes() is waiting for a block */
+static volatile int block_rx_busy;
+
 /* Callback for HAL_UART_Receive_DMA().
  */
 void HAL_UART1_RxCpltCallback(UART_HandleTypeDef *huart)
 {
     huart = huart;
 
+    if (block_rx_busy) {
+        block_rx_busy = 0;
+        return;
+    }
+
     ringbuf_write_char(&uart_ringbuf, uart_rx);
     task_wake(cli_task);
 }
@@ -121,8 +130,11 @@ static void uart_cli_print(struct cli_def *cli __attribute__ ((unused)), const c
 static ssize_t uart_cli_read(struct cli_def *cli __attribute__ ((unused)), void *buf, size_t count)
 {
     for (size_t i = 0; i < count; ++i) {
-        while (ringbuf_read_char(&uart_ringbuf, (uint8_t *)(buf + i)) == 0)
+        task_sleep_prepare();
+        while (ringbuf_read_char(&uart_ringbuf, (uint8_t *)(buf + i)) == 0) {
             task_sleep();
+            task_sleep_prepare();
+        }
     }
     return (ssize_t)count;
 }
@@ -150,6 +162,34 @@ int control_mgmt_uart_dma_rx(mgmt_cli_dma_state_t state)
     return 0;
 }
 
+/* Receive a block of data (a chunk of a file upload) with DMA, straight
+ * into buf. Unlike HAL_UART_Receive(), this yields while it waits, so other
+ * tasks get to run. The CLI's own DMA reception has to be stopped first.
+ */
+HAL_StatusTypeDef cli_uart_receive_bytes(uint8_t *buf, size_t len, uint32_t timeout)
+{
+    uint32_t tick_start = HAL_GetTick();
+
+    block_rx_busy = 1;
+    if (HAL_UART_Receive_DMA(&huart_mgmt, buf, len) != CMSIS_HAL_OK) {
+        block_rx_busy = 0;
+        return HAL_ERROR;
+    }
+
+    while (block_rx_busy) {
+        if (HAL_GetTick() - tick_start > timeout) {
+            block_rx_busy = 0;
+            HAL_UART_DMAStop(&huart_mgmt);
+            return HAL_TIMEOUT;
+        }
+        task_yield();
+    }
+
+    /* The DMA stream is circular, stop it before it wraps around. */
+    HAL_UART_DMAStop(&huart_mgmt);
+    return CMSIS_HAL_OK;
+}
+
 hal_user_t user;
 
 static int check_auth(const char *username, const char *password)
@@ -199,6 +239,7 @@ int cli_main(void)
     configure_cli_bootloader(cli);
     configure_cli_misc(cli);
     configure_cli_task(cli);
+    configure_cli_memory(cli);
     configure_cli_tamper(cli);
 
 
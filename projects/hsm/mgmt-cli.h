@@ -43,6 +43,7 @@ typedef enum {
 } mgmt_cli_dma_state_t;
 
 extern int control_mgmt_uart_dma_rx(mgmt_cli_dma_state_t state);
+extern HAL_StatusTypeDef cli_uart_receive_bytes(uint8_t *buf, size_t len, uint32_t timeout);
 
 extern int cli_main(void);
 
@@ -38,6 +38,7 @@
 #include "stm-uart.h"
 
 #include "mgmt-cli.h"
+#include "mgmt-keystore.h"
 
 #undef HAL_OK
 #define HAL_OK LIBHAL_OK
@@ -58,6 +59,7 @@ static int cmd_firmware_upload(struct cli_def *cli, const char *command, char *a
     }
 
     /* reboot and let the bootloader handle the upload */
+    mgmt_keystore_sync();
     cli_print(cli, "\n\n\nRebooting\n\n\n");
     HAL_NVIC_SystemReset();
 
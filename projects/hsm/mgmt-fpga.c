@@ -37,41 +37,155 @@
 #include "stm-init.h"
 #include "stm-uart.h"
 #include "stm-fpgacfg.h"
+#include "stm-fmc.h"
+#include "task.h"
 
 #include "mgmt-cli.h"
 #include "mgmt-fpga.h"
 #include "mgmt-misc.h"
+#ifdef DO_FPGA_IRQ
+#include "fpga-irq.h"
+#endif
 
 #undef HAL_OK
 #define HAL_OK LIBHAL_OK
 #include "hal.h"
 #undef HAL_OK
 
+#include "core-pool.h"
+
 #include <string.h>
 
 
 extern hal_user_t user;
 
 static volatile uint32_t dfu_offset = 0;
+static struct n25q128_update_stats dfu_stats;
 
+/* The bitstream goes into the config memory a sector at a time, written
+ * by the fpga_upload task from one of two sector buffers while the CLI
+ * task receives the next sector into the other. Erasing and programming a
+ * sector takes about as long as receiving it over the UART, so doing both
+ * at once gets the upload close to wire speed.
+ */
+static uint8_t *upload_buf[FPGA_UPLOAD_BUFFERS];
+static unsigned upload_fill;            /* buffer being received into */
+static size_t upload_fill_len;          /* bytes in it so far */
+
+static struct {
+    tcb_t *task;
+    const uint8_t * volatile buf;       /* sector to write, NULL when idle */
+    uint32_t offset;
+    size_t len;
+    volatile HAL_StatusTypeDef status;
+} upload_writer;
+
+void fpga_upload_task(void)
+{
+    uint8_t *buf = (uint8_t *)task_get_cookie(NULL);
+    for (size_t i = 0; i < FPGA_UPLOAD_BUFFERS; ++i)
+        upload_buf[i] = buf + i * FPGACFG_SECTOR_SIZE;
+    upload_writer.task = task_get_tcb();
+
+    while (1) {
+        task_sleep_prepare();
+        while (upload_writer.buf == NULL) {
+            task_sleep();
+            task_sleep_prepare();
+        }
+
+        /* fpgacfg_update_data() reads back what's already in the config
+         * memory and only erases and programs what differs, so re-uploading
+         * the same or a similar bitstream is quick. It erases the whole
+         * sector if the first subsector needs it. Going a subsector at a
+         * time, and yielding in between, lets the CLI task acknowledge
+         * chunks as they come in.
+         */
+        for (size_t i = 0; i < upload_writer.len && upload_writer.status == CMSIS_HAL_OK; i += N25Q128_SUBSECTOR_SIZE) {
+            upload_writer.status = fpgacfg_update_data(upload_writer.offset + i, upload_writer.buf + i,
+                                                       N25Q128_SUBSECTOR_SIZE, &dfu_stats);
+            task_yield();
+        }
+
+        upload_writer.buf = NULL;
+    }
+}
 
-static HAL_StatusTypeDef _flash_write_callback(uint8_t *buf, size_t len)
+/* Wait for the fpga_upload task to finish the sector it's on. */
+static HAL_StatusTypeDef _upload_wait(void)
+{
+    while (upload_writer.buf != NULL)
+        task_yield();
+    return upload_writer.status;
+}
+
+/* Hand the buffer we've been receiving into to the fpga_upload task, and
+ * start on the other one.
+ */
+static HAL_StatusTypeDef _upload_flush(void)
 {
-    HAL_StatusTypeDef res;
+    if (_upload_wait() != CMSIS_HAL_OK)
+        return HAL_ERROR;
+
+    if (upload_fill_len > 0) {
+        upload_writer.offset = dfu_offset - upload_fill_len;
+        upload_writer.len = upload_fill_len;
+        upload_writer.buf = upload_buf[upload_fill];
+        task_wake(upload_writer.task);
+
+        upload_fill = (upload_fill + 1) % FPGA_UPLOAD_BUFFERS;
+        upload_fill_len = 0;
+    }
 
-    if ((dfu_offset % FPGACFG_SECTOR_SIZE) == 0)
-	/* first page in sector, need to erase sector */
-	if ((res = fpgacfg_erase_sector(dfu_offset / FPGACFG_SECTOR_SIZE)) != CMSIS_HAL_OK)
-	    return res;
+    return CMSIS_HAL_OK;
+}
 
-    /* fpgacfg_write_data (a thin wrapper around n25q128_write_data)
-     * requires the offset and length to be page-aligned. The last chunk
-     * will be short, so we pad it out to the full chunk size.
+static HAL_StatusTypeDef _flash_write_callback(uint8_t *buf, size_t len)
+{
+    /* The config memory is written a subsector (one chunk) at a time. The
+     * last chunk will be short, but cli_receive_data pads it out with 0xff.
      */
     len = len;
-    res = fpgacfg_write_data(dfu_offset, buf, BITSTREAM_UPLOAD_CHUNK_SIZE);
+
+    if (upload_writer.status != CMSIS_HAL_OK)
+        return HAL_ERROR;
+
+    memcpy(upload_buf[upload_fill] + upload_fill_len, buf, BITSTREAM_UPLOAD_CHUNK_SIZE);
+    upload_fill_len += BITSTREAM_UPLOAD_CHUNK_SIZE;
     dfu_offset += BITSTREAM_UPLOAD_CHUNK_SIZE;
-    return res;
+
+    if (upload_fill_len == FPGACFG_SECTOR_SIZE)
+        return _upload_flush();
+
+    return CMSIS_HAL_OK;
+}
+
+/* How long the FPGA gets to load its bitstream after a reset. */
+#ifndef FPGA_CONFIG_TIMEOUT_MS
+#define FPGA_CONFIG_TIMEOUT_MS 5000
+#endif
+
+/* The FMC timing was calibrated against the bitstream the FPGA had at the
+ * time, and may not suit another one. After a reset or reconfiguration,
+ * drop to the safe clock, wait for the FPGA to load its bitstream, and
+ * calibrate again.
+ */
+static void _fpga_recalibrate(struct cli_def *cli)
+{
+    uint32_t tick_start = HAL_GetTick();
+
+    fmc_set_mode(FMC_CLK_DIVISION_SAFE, FMC_DATA_LATENCY_SAFE);
+
+    while (fpgacfg_check_done() != CMSIS_HAL_OK) {
+        if (HAL_GetTick() - tick_start > FPGA_CONFIG_TIMEOUT_MS) {
+            cli_print(cli, "FPGA has not loaded a bitstream, FMC bus left at the safe clock");
+            return;
+        }
+        task_yield();
+    }
+
+    if (fmc_calibrate() != CMSIS_HAL_OK)
+        cli_print(cli, "FMC bus calibration failed, running at the safe clock");
 }
 
 static int cmd_fpga_bitstream_upload(struct cli_def *cli, const char *command, char *argv[], int argc)
@@ -85,9 +199,15 @@ static int cmd_fpga_bitstream_upload(struct cli_def *cli, const char *command, c
         return CLI_ERROR;
     }
 
+    if (upload_writer.task == NULL) {
+        cli_print(cli, "FPGA upload task isn't running");
+        return CLI_ERROR;
+    }
+
     uint8_t buf[BITSTREAM_UPLOAD_CHUNK_SIZE];
 
     dfu_offset = 0;
+    memset(&dfu_stats, 0, sizeof(dfu_stats));
 
     fpgacfg_access_control(ALLOW_ARM);
 
@@ -97,11 +217,23 @@ static int cmd_fpga_bitstream_upload(struct cli_def *cli, const char *command, c
 	return CLI_ERROR;
     }
 
+    upload_fill = 0;
+    upload_fill_len = 0;
+    upload_writer.status = CMSIS_HAL_OK;
+
     cli_receive_data(cli, &buf[0], sizeof(buf), _flash_write_callback);
 
+    /* Write out the last partial sector, and wait for it. */
+    if (_upload_flush() != CMSIS_HAL_OK || _upload_wait() != CMSIS_HAL_OK)
+        cli_print(cli, "Writing the FPGA config memory failed");
+
     fpgacfg_access_control(ALLOW_FPGA);
+    _fpga_recalibrate(cli);
 
     cli_print(cli, "DFU offset now: %li (%li chunks)", dfu_offset, dfu_offset / BITSTREAM_UPLOAD_CHUNK_SIZE);
+    cli_print(cli, "%li pages unchanged, %li pages programmed, %li sectors and %li subsectors erased",
+              dfu_stats.pages_skipped, dfu_stats.pages_programmed,
+              dfu_stats.sectors_erased, dfu_stats.subsectors_erased);
     return CLI_OK;
 }
 
@@ -142,10 +274,16 @@ static int cmd_fpga_reset(struct cli_def *cli, const char *command, char *argv[]
     argv = argv;
     argc = argc;
 
+    if (!core_pool_reset()) {
+        cli_print(cli, "FPGA cores are in use, try again later");
+        return CLI_ERROR;
+    }
+
     fpgacfg_access_control(ALLOW_FPGA);
     fpgacfg_reset_fpga(RESET_FULL);
     hal_core_reset_table();
     cli_print(cli, "FPGA has been reset");
+    _fpga_recalibrate(cli);
 
     return CLI_OK;
 }
@@ -164,15 +302,83 @@ static int cmd_fpga_show_cores(struct cli_def *cli, const char *command, char *a
         return CLI_OK;
     }
 
+    uint32_t elapsed_ms = core_pool_elapsed_ms();
+
+    cli_print(cli, "base  name     vers   allocs  busy ms  busy%%");
     for (core = hal_core_iterate(NULL); core != NULL; core = hal_core_iterate(core)) {
+        struct core_pool_core_stats stats;
 	info = hal_core_info(core);
-	cli_print(cli, "%04x: %8.8s %4.4s",
-                  (unsigned int)info->base, info->name, info->version);
+        if (!core_pool_get_core_stats(core, &stats))
+            memset(&stats, 0, sizeof(stats));
+	cli_print(cli, "%04x: %8.8s %4.4s %8lu %8lu %5lu%s",
+                  (unsigned int)info->base, info->name, info->version,
+                  stats.allocs, (unsigned long)(stats.busy_us / 1000),
+                  elapsed_ms ? (unsigned long)(stats.busy_us / 10 / elapsed_ms) : 0UL,
+                  stats.busy ? " (in use)" : "");
+    }
+
+    cli_print(cli, "\nname     cores requests  queued max queue  avg wait us  max wait us");
+    struct core_pool_type_stats type;
+    for (unsigned n = 0; core_pool_get_type_stats(n, &type); ++n) {
+        cli_print(cli, "%8.8s %5lu %8lu %7lu %9lu %12lu %12lu",
+                  type.name, type.cores, type.requests, type.queued, type.queue_max,
+                  type.queued ? (unsigned long)(type.wait_us / type.queued) : 0UL,
+                  type.wait_max_us);
     }
+    cli_print(cli, "over the last %lu ms", elapsed_ms);
 
     return CLI_OK;
 }
 
+static int cmd_fpga_show_fmc(struct cli_def *cli, const char *command, char *argv[], int argc)
+{
+    struct fmc_mode mode;
+
+    command = command;
+    argv = argv;
+    argc = argc;
+
+    /* Make sure the current timing still works before bragging about it. */
+    if (fmc_check() != CMSIS_HAL_OK)
+        cli_print(cli, "FMC validation failed, fell back to the safe clock");
+
+    fmc_get_mode(&mode);
+    cli_print(cli, "FMC clock %lu MHz (HCLK / %lu), data latency %lu",
+              SystemCoreClock / 1000000 / mode.clk_division, mode.clk_division, mode.data_latency);
+    if (!mode.calibrated)
+        cli_print(cli, "  not calibrated (no bitstream to calibrate against)");
+    else if (mode.clk_division != FMC_CLK_DIVISION_FAST)
+        cli_print(cli, "  calibrated, but the fast clock didn't validate");
+    else
+        cli_print(cli, "  calibrated");
+    if (mode.fallbacks > 0)
+        cli_print(cli, "  fell back to the safe clock %lu times", mode.fallbacks);
+
+    return CLI_OK;
+}
+
+#ifdef DO_FPGA_IRQ
+static int cmd_fpga_show_irq(struct cli_def *cli, const char *command, char *argv[], int argc)
+{
+    struct fpga_irq_stats stats;
+
+    command = command;
+    argv = argv;
+    argc = argc;
+
+    fpga_irq_get_stats(&stats);
+
+    cli_print(cli, "FPGA interrupts: %lu", stats.irqs);
+    cli_print(cli, "Core waits: %lu, %lu status polls, %lu sleeps (%lu timed out)",
+              stats.waits, stats.polls, stats.sleeps, stats.timeouts);
+    if (stats.sleeps > 0)
+        cli_print(cli, "Polls avoided: about %lu (a poll takes %lu cycles)",
+                  stats.polls_avoided, stats.poll_cycles);
+
+    return CLI_OK;
+}
+#endif
+
 void configure_cli_fpga(struct cli_def *cli)
 {
     struct cli_command *c = cli_register_command(cli, NULL, "fpga", NULL, 0, 0, NULL);
@@ -181,7 +387,15 @@ void configure_cli_fpga(struct cli_def *cli)
     struct cli_command *c_bitstream = cli_register_command(cli, c, "bitstream", NULL, 0, 0, NULL);
 
     /* fpga show cores */
-    cli_register_command(cli, c_show, "cores", cmd_fpga_show_cores, 0, 0, "Show FPGA core names and versions");
+    cli_register_command(cli, c_show, "cores", cmd_fpga_show_cores, 0, 0, "Show FPGA cores, their use, and waits for them");
+
+    /* fpga show fmc */
+    cli_register_command(cli, c_show, "fmc", cmd_fpga_show_fmc, 0, 0, "Show FMC bus clock and latency");
+
+#ifdef DO_FPGA_IRQ
+    /* fpga show irq */
+    cli_register_command(cli, c_show, "irq", cmd_fpga_show_irq, 0, 0, "Show FPGA interrupt and core wait counters");
+#endif
 
     /* fpga reset */
     cli_register_command(cli, c, "reset", cmd_fpga_reset, 0, 0, "Reset FPGA (config reset)");
@@ -36,6 +36,7 @@
 #define __STM32_CLI_MGMT_FPGA_H
 
 #include <libcli.h>
+#include "stm-fpgacfg.h"
 
 
 /* The chunk size have to be a multiple of the SPI flash page size (256 bytes),
@@ -44,6 +45,15 @@
 #define BITSTREAM_UPLOAD_CHUNK_SIZE 4096
 
 
+/* The fpga_upload task writes bitstream uploads a sector at a time from
+ * one of these buffers, while the next sector is received into another.
+ * Whoever creates the task allocates them (in SDRAM) and passes them as
+ * the task's cookie.
+ */
+#define FPGA_UPLOAD_BUFFERS 2
+#define FPGA_UPLOAD_BUFFER_SIZE (FPGA_UPLOAD_BUFFERS * FPGACFG_SECTOR_SIZE)
+
 extern void configure_cli_fpga(struct cli_def *cli);
+extern void fpga_upload_task(void);
 
 #endif /* __STM32_CLI_MGMT_FPGA_H */
@@ -36,10 +36,14 @@
 #define HAL_OK CMSIS_HAL_OK
 #include "stm-init.h"
 #include "stm-keystore.h"
+#ifdef DO_KEYSTORE_LOG
+#include "keystore-log.h"
+#endif
 #include "stm-fpgacfg.h"
 #include "stm-uart.h"
 
 #include "mgmt-cli.h"
+#include "mgmt-keystore.h"
 
 #undef HAL_OK
 #define LIBHAL_OK HAL_OK
@@ -317,6 +321,130 @@ static int cmd_keystore_show_keys(struct cli_def *cli, const char *command, char
     return err ? CLI_ERROR : CLI_OK;
 }
 
+extern unsigned keystore_preerase_depth;
+
+static int cmd_keystore_set_erase_pool(struct cli_def *cli, const char *command, char *argv[], int argc)
+{
+    command = command;
+
+    if (argc != 1) {
+	cli_print(cli, "Wrong number of arguments (%i).", argc);
+	cli_print(cli, "Syntax: keystore set erase-pool <number>");
+	return CLI_ERROR;
+    }
+
+    keystore_preerase_depth = strtoul(argv[0], NULL, 0);
+
+    return CLI_OK;
+}
+
+static int cmd_keystore_show_cache(struct cli_def *cli, const char *command, char *argv[], int argc)
+{
+    struct keystore_cache_stats stats;
+
+    command = command;
+    argv = argv;
+    argc = argc;
+
+    hal_ks_lock();
+    keystore_get_cache_stats(&stats);
+    hal_ks_unlock();
+
+    uint32_t reads = stats.read_hits + stats.read_misses;
+    cli_print(cli, "Read cache: %lu subsectors", stats.read_entries);
+    cli_print(cli, "  hits %lu, misses %lu (%lu%% hits)",
+              stats.read_hits, stats.read_misses,
+              reads ? (uint32_t)((uint64_t)stats.read_hits * 100 / reads) : 0);
+    cli_print(cli, "Write-back cache: %lu pages, %lu pending", stats.write_entries, stats.write_pending);
+    cli_print(cli, "  pages written %lu, unchanged %lu, merged %lu, written back %lu, failed %lu",
+              stats.write_pages, stats.write_unchanged, stats.write_merges, stats.write_backs,
+              stats.write_back_errors);
+    cli_print(cli, "Blank subsectors: %lu (pre-erase pool depth %u)",
+              stats.blank_subsectors, keystore_preerase_depth);
+    cli_print(cli, "  reads skipped %lu, erases skipped %lu",
+              stats.blank_reads, stats.erases_skipped);
+#ifdef DO_KEYSTORE_SNAPSHOT
+    cli_print(cli, "  snapshot generation %lu (%s), %lu blank at boot, %lu saved",
+              stats.snapshot_generation, stats.snapshot_current ? "current" : "stale",
+              stats.snapshot_loaded, stats.snapshot_saves);
+#endif
+
+#ifdef DO_KEYSTORE_LOG
+    struct keystore_log_stats log;
+
+    hal_ks_lock();
+    keystore_log_get_stats(&log);
+    hal_ks_unlock();
+
+    cli_print(cli, "Log-structured keystore: %lu blocks, %lu mapped", log.blocks, log.mapped);
+    cli_print(cli, "  subsectors free %lu, dirty %lu", log.free, log.dirty);
+    cli_print(cli, "  erases remapped %lu, erased in background %lu, on write %lu",
+              log.remaps, log.gc_erases, log.sync_erases);
+    cli_print(cli, "  journal generation %lu, %lu/%lu records, %lu checkpoints",
+              log.generation, log.journal_used, log.journal_size, log.checkpoints);
+#endif
+
+    return CLI_OK;
+}
+
+static int cmd_keystore_reset_cache(struct cli_def *cli, const char *command, char *argv[], int argc)
+{
+    cli = cli;
+    command = command;
+    argv = argv;
+    argc = argc;
+
+    hal_ks_lock();
+    keystore_reset_cache_stats();
+    hal_ks_unlock();
+
+    return CLI_OK;
+}
+
+/* Write out anything in the keystore cache, e.g. before a reboot. */
+void mgmt_keystore_sync(void)
+{
+    hal_ks_lock();
+    keystore_sync();
+#ifdef DO_KEYSTORE_SNAPSHOT
+    /* Save the blank map too, so the next boot can use it. */
+    if (keystore_snapshot_start(0))
+        while (keystore_snapshot_poll() == HAL_BUSY)
+            ;
+#endif
+    hal_ks_unlock();
+}
+
+static int cmd_keystore_sync(struct cli_def *cli, const char *command, char *argv[], int argc)
+{
+    command = command;
+    argv = argv;
+    argc = argc;
+
+    hal_ks_lock();
+    HAL_StatusTypeDef status = keystore_sync();
+    hal_ks_unlock();
+
+    if (status != CMSIS_HAL_OK) {
+        cli_print(cli, "Failed writing back keystore cache: %i", status);
+        return CLI_ERROR;
+    }
+
+    return CLI_OK;
+}
+
+/* Only what isn't blank gets erased, so this takes anywhere from a
+ * couple of seconds (to check an empty keystore) to most of a minute.
+ */
+static struct cli_def *erase_cli;
+
+static void keystore_erase_progress(uint32_t sectors_done, uint32_t num_sectors, uint32_t subsectors_erased)
+{
+    if (sectors_done % (num_sectors / 8) == 0)
+        cli_print(erase_cli, "  %3lu%% checked, %lu subsectors erased",
+                  sectors_done * 100 / num_sectors, subsectors_erased);
+}
+
 static int cmd_keystore_erase(struct cli_def *cli, const char *command, char *argv[], int argc)
 {
     hal_error_t err;
@@ -350,11 +478,19 @@ static int cmd_keystore_erase(struct cli_def *cli, const char *command, char *ar
         }
     }
 
-    cli_print(cli, "OK, erasing keystore, this will take about 45 seconds...");
-    if ((status = keystore_erase_bulk()) != CMSIS_HAL_OK) {
+    cli_print(cli, "OK, erasing keystore...");
+    /* The erase yields while the chip is busy, so keep RPC tasks off it. */
+    const uint32_t start = HAL_GetTick();
+    erase_cli = cli;
+    hal_ks_lock();
+    status = keystore_erase_used(keystore_erase_progress);
+    hal_ks_unlock();
+    if (status != CMSIS_HAL_OK) {
         cli_print(cli, "Failed erasing token keystore: %i", status);
 	return CLI_ERROR;
     }
+    const uint32_t elapsed = HAL_GetTick() - start;
+    cli_print(cli, "Erased in %lu.%03lu seconds", elapsed / 1000, elapsed % 1000);
 
     if ((err = hal_ks_init(hal_ks_token, 0)) != LIBHAL_OK) {
         cli_print(cli, "Failed to reinitialize token keystore: %s", hal_error_string(err));
@@ -387,22 +523,35 @@ void configure_cli_keystore(struct cli_def *cli)
     struct cli_command *c_set    = cli_register_command(cli, c, "set",    NULL, 0, 0, NULL);
     struct cli_command *c_clear  = cli_register_command(cli, c, "clear",  NULL, 0, 0, NULL);
     struct cli_command *c_delete = cli_register_command(cli, c, "delete", NULL, 0, 0, NULL);
+    struct cli_command *c_reset  = cli_register_command(cli, c, "reset",  NULL, 0, 0, NULL);
 
     /* keystore show keys */
     cli_register_command(cli, c_show, "keys", cmd_keystore_show_keys, 0, 0, "Show what PINs and keys are in the keystore");
 
+    /* keystore show cache */
+    cli_register_command(cli, c_show, "cache", cmd_keystore_show_cache, 0, 0, "Show keystore cache statistics");
+
     /* keystore set pin */
     struct cli_command *c_set_pin = cli_register_command(cli, c_set, "pin", cmd_keystore_set_pin, 0, 0, "Set either 'wheel', 'user' or 'so' PIN");
 
     /* keystore set pin iterations */
     cli_register_command(cli, c_set_pin, "iterations", cmd_keystore_set_pin_iterations, 0, 0, "Set PBKDF2 iterations for PINs");
 
+    /* keystore set erase-pool */
+    cli_register_command(cli, c_set, "erase-pool", cmd_keystore_set_erase_pool, 0, 0, "Set number of free subsectors to keep erased");
+
     /* keystore clear pin */
     cli_register_command(cli, c_clear, "pin", cmd_keystore_clear_pin, 0, 0, "Clear either 'wheel', 'user' or 'so' PIN");
 
     /* keystore delete key */
     cli_register_command(cli, c_delete, "key", cmd_keystore_delete_key, 0, 0, "Delete a key");
 
+    /* keystore reset cache */
+    cli_register_command(cli, c_reset, "cache", cmd_keystore_reset_cache, 0, 0, "Reset keystore cache statistics");
+
     /* keystore erase */
     cli_register_command(cli, c, "erase", cmd_keystore_erase, 0, 0, "Erase the whole keystore");
+
+    /* keystore sync */
+    cli_register_command(cli, c, "sync", cmd_keystore_sync, 0, 0, "Write back cached keystore changes");
 }
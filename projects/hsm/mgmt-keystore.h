@@ -38,5 +38,6 @@
 #include <libcli.h>
 
 extern void configure_cli_keystore(struct cli_def *cli);
+extern void mgmt_keystore_sync(void);
 
 #endif /* __STM32_CLI_MGMT_KEYSTORE_H */
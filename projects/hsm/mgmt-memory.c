@@ -0,0 +1,263 @@
+/*
+ * mgmt-memory.c
+ * -------------
+ * CLI 'memory' functions.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Show SDRAM allocator statistics. With DO_MEMORY_METRICS, every
+ * allocation is recorded with its size and the address of the code that
+ * asked for it, so we can see which libhal paths are driving SDRAM growth.
+ * Caller addresses can be resolved with addr2line against hsm.elf.
+ */
+
+#include "mgmt-cli.h"
+#include "mgmt-memory.h"
+
+#include <string.h>
+
+extern void sdram_stats(size_t *used, size_t *available);
+
+#ifdef DO_MEMORY_METRICS
+
+extern void hal_critical_section_start(void);
+extern void hal_critical_section_end(void);
+
+/* Number of live allocations we can track. Allocations beyond this are
+ * still counted in the totals and histogram, but not attributed.
+ */
+#ifndef MEMORY_METRICS_TABLE_SIZE
+#define MEMORY_METRICS_TABLE_SIZE 256
+#endif
+
+/* Number of distinct call sites reported by 'memory show'. */
+#ifndef MEMORY_METRICS_TOP
+#define MEMORY_METRICS_TOP 10
+#endif
+
+/* Histogram buckets are powers of 2, from <= 16 bytes to > 64 KB. */
+#define MEMORY_METRICS_MIN_BUCKET 4
+#define MEMORY_METRICS_NUM_BUCKETS 14
+
+typedef struct {
+    const void *ptr;
+    const void *caller;
+    size_t size;
+} alloc_record_t;
+
+static alloc_record_t alloc_table[MEMORY_METRICS_TABLE_SIZE];
+static size_t n_records;
+static size_t n_untracked;
+static size_t n_allocs, n_frees;
+static size_t bytes_live, bytes_max;
+static size_t histogram[MEMORY_METRICS_NUM_BUCKETS];
+
+static unsigned size_bucket(size_t size)
+{
+    unsigned i;
+
+    for (i = 0; i < MEMORY_METRICS_NUM_BUCKETS - 1; ++i)
+        if (size <= (1U << (i + MEMORY_METRICS_MIN_BUCKET)))
+            break;
+
+    return i;
+}
+
+/* Called from sdram_malloc(), possibly in interrupt context (RxCallback),
+ * so keep it short.
+ */
+void memory_metrics_alloc(const void *ptr, size_t size, const void *caller)
+{
+    if (ptr == NULL)
+        return;
+
+    hal_critical_section_start();
+
+    ++n_allocs;
+    ++histogram[size_bucket(size)];
+
+    bytes_live += size;
+    if (bytes_live > bytes_max)
+        bytes_max = bytes_live;
+
+    if (n_records < MEMORY_METRICS_TABLE_SIZE) {
+        alloc_record_t *r = &alloc_table[n_records++];
+        r->ptr = ptr;
+        r->caller = caller;
+        r->size = size;
+    }
+    else {
+        ++n_untracked;
+    }
+
+    hal_critical_section_end();
+}
+
+void memory_metrics_free(const void *ptr)
+{
+    hal_critical_section_start();
+
+    ++n_frees;
+
+    /* Frees are rare (sdram_free only releases the top of the heap), so a
+     * linear search is fine. Fill the hole with the last record.
+     */
+    for (size_t i = 0; i < n_records; ++i) {
+        if (alloc_table[i].ptr == ptr) {
+            bytes_live -= alloc_table[i].size;
+            alloc_table[i] = alloc_table[--n_records];
+            break;
+        }
+    }
+
+    hal_critical_section_end();
+}
+
+typedef struct {
+    const void *caller;
+    size_t bytes;
+    size_t count;
+} caller_total_t;
+
+static void show_top_callers(struct cli_def *cli)
+{
+    caller_total_t totals[MEMORY_METRICS_TOP];
+    size_t n_totals = 0;
+    static alloc_record_t snapshot[MEMORY_METRICS_TABLE_SIZE];
+    size_t n;
+
+    /* Take a consistent copy, because RxCallback can allocate at any time. */
+    hal_critical_section_start();
+    n = n_records;
+    memcpy(snapshot, alloc_table, n * sizeof(*snapshot));
+    hal_critical_section_end();
+
+    /* Repeatedly pick the caller with the largest total that we haven't
+     * reported yet. This is quadratic, but the table is small and this
+     * is a debugging command.
+     */
+    while (n_totals < MEMORY_METRICS_TOP) {
+        caller_total_t best = { NULL, 0, 0 };
+
+        for (size_t i = 0; i < n; ++i) {
+            const void *caller = snapshot[i].caller;
+            size_t j;
+
+            for (j = 0; j < n_totals; ++j)
+                if (totals[j].caller == caller)
+                    break;
+            if (j < n_totals)
+                continue;
+
+            /* skip callers we've already totalled in this pass */
+            for (j = 0; j < i; ++j)
+                if (snapshot[j].caller == caller)
+                    break;
+            if (j < i)
+                continue;
+
+            caller_total_t t = { caller, 0, 0 };
+            for (j = i; j < n; ++j) {
+                if (snapshot[j].caller == caller) {
+                    t.bytes += snapshot[j].size;
+                    ++t.count;
+                }
+            }
+
+            if (t.bytes > best.bytes)
+                best = t;
+        }
+
+        if (best.count == 0)
+            break;
+
+        totals[n_totals++] = best;
+    }
+
+    cli_print(cli, "caller          bytes           allocations");
+    cli_print(cli, "--------        --------        -----------");
+    for (size_t i = 0; i < n_totals; ++i)
+        cli_print(cli, "0x%08lx      %-15u %u",
+                  (unsigned long)totals[i].caller, totals[i].bytes, totals[i].count);
+}
+
+static void show_histogram(struct cli_def *cli)
+{
+    cli_print(cli, "size            allocations");
+    cli_print(cli, "--------        -----------");
+    for (unsigned i = 0; i < MEMORY_METRICS_NUM_BUCKETS; ++i) {
+        if (histogram[i] == 0)
+            continue;
+        if (i == MEMORY_METRICS_NUM_BUCKETS - 1)
+            cli_print(cli, "> %-13u %u",
+                      1U << (i - 1 + MEMORY_METRICS_MIN_BUCKET), histogram[i]);
+        else
+            cli_print(cli, "<= %-12u %u",
+                      1U << (i + MEMORY_METRICS_MIN_BUCKET), histogram[i]);
+    }
+}
+#endif
+
+static int cmd_memory_show(struct cli_def *cli, const char *command, char *argv[], int argc)
+{
+    command = command;
+    argv = argv;
+    argc = argc;
+
+    size_t used, available;
+    sdram_stats(&used, &available);
+    cli_print(cli, "SDRAM used: %u, available: %u", used, available);
+
+#ifdef DO_MEMORY_METRICS
+    cli_print(cli, "SDRAM high water: %u", bytes_max);
+    cli_print(cli, "Live allocations: %u (%u bytes), untracked: %u",
+              n_allocs - n_frees, bytes_live, n_untracked);
+    cli_print(cli, "Allocations since boot: %u, frees: %u", n_allocs, n_frees);
+
+    cli_print(cli, " ");
+    show_top_callers(cli);
+
+    cli_print(cli, " ");
+    show_histogram(cli);
+#else
+    cli_print(cli, "Rebuild with DO_MEMORY_METRICS=1 for per-caller allocation statistics");
+#endif
+
+    return CLI_OK;
+}
+
+void configure_cli_memory(struct cli_def *cli)
+{
+    struct cli_command *c = cli_register_command(cli, NULL, "memory", NULL, 0, 0, NULL);
+
+    /* memory show */
+    cli_register_command(cli, c, "show", cmd_memory_show, 0, 0, "Show SDRAM allocation statistics");
+}
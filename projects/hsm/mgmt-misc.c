@@ -35,7 +35,9 @@
 #define HAL_OK CMSIS_HAL_OK
 #include "stm-init.h"
 #include "stm-uart.h"
+#include "stm-crc.h"
 #include "mgmt-cli.h"
+#include "mgmt-keystore.h"
 #include "mgmt-misc.h"
 #undef HAL_OK
 
@@ -49,7 +51,7 @@
 
 int cli_receive_data(struct cli_def *cli, uint8_t *buf, size_t len, cli_data_callback data_callback)
 {
-    hal_crc32_t crc = 0, my_crc = hal_crc32_init();
+    uint32_t crc = 0, my_crc = stm_crc32_init();
     uint32_t filesize = 0, counter = 0;
     size_t n = len;
 
@@ -75,12 +77,15 @@ int cli_receive_data(struct cli_def *cli, uint8_t *buf, size_t len, cli_data_cal
 
 	if (filesize < n) n = filesize;
 
-	if (uart_receive_bytes((void *) buf, n, 2000) != CMSIS_HAL_OK) {
+	/* This yields while the chunk comes in, so a data_callback that hands
+	 * its work off to another task gets it done in the meantime.
+	 */
+	if (cli_uart_receive_bytes(buf, n, 2000) != CMSIS_HAL_OK) {
 	    cli_print(cli, "Receive timed out");
 	    goto fail;
 	}
 	filesize -= n;
-	my_crc = hal_crc32_update(my_crc, buf, n);
+	my_crc = stm_crc32_update(my_crc, buf, n);
 
 	/* After reception of a chunk but before ACKing we have "all" the time in the world to
 	 * calculate CRC and invoke the data_callback.
@@ -94,7 +99,7 @@ int cli_receive_data(struct cli_def *cli, uint8_t *buf, size_t len, cli_data_cal
 	uart_send_bytes((void *) &counter, 4);
     }
 
-    my_crc = hal_crc32_finalize(my_crc);
+    my_crc = stm_crc32_finalize(my_crc);
     cli_print(cli, "Send CRC-32");
     uart_receive_bytes((void *) &crc, sizeof(crc), 2000);
     cli_print(cli, "CRC-32 0x%x, calculated CRC 0x%x", (unsigned int) crc, (unsigned int) my_crc);
@@ -148,6 +153,7 @@ static int cmd_reboot(struct cli_def *cli, const char *command, char *argv[], in
     argv = argv;
     argc = argc;
 
+    mgmt_keystore_sync();
     cli_print(cli, "\n\n\nRebooting\n\n\n");
     HAL_NVIC_SystemReset();
 
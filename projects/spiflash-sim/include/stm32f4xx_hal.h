@@ -0,0 +1,266 @@
+/*
+ * stm32f4xx_hal.h
+ * ---------------
+ * Just enough of the STM32 HAL to build the SPI flash code on a host.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This stands in for the real stm32f4xx_hal.h when building the SPI flash
+ * driver and the keystore on a host. The definitions follow the real HAL
+ * closely enough for spiflash_n25q128.c and stm-keystore.c to compile
+ * unchanged; the functions are implemented in n25q128-sim.c, on top of a
+ * model of the flash chip.
+ */
+
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    HAL_OK       = 0x00,
+    HAL_ERROR    = 0x01,
+    HAL_BUSY     = 0x02,
+    HAL_TIMEOUT  = 0x03
+} HAL_StatusTypeDef;
+
+typedef enum {
+    HAL_UNLOCKED = 0x00,
+    HAL_LOCKED   = 0x01
+} HAL_LockTypeDef;
+
+#define __HAL_UNLOCK(__HANDLE__)        do { (__HANDLE__)->Lock = HAL_UNLOCKED; } while (0)
+
+#define __HAL_LINKDMA(__HANDLE__, __PPP_DMA_FIELD__, __DMA_HANDLE__) \
+    do {                                                             \
+        (__HANDLE__)->__PPP_DMA_FIELD__ = &(__DMA_HANDLE__);         \
+        (__DMA_HANDLE__).Parent = (__HANDLE__);                      \
+    } while (0)
+
+/* GPIO */
+
+typedef struct {
+    uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef enum {
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct {
+    uint32_t Pin;
+    uint32_t Mode;
+    uint32_t Pull;
+    uint32_t Speed;
+    uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+#define GPIO_PIN_0                      ((uint16_t)0x0001)
+#define GPIO_PIN_1                      ((uint16_t)0x0002)
+#define GPIO_PIN_2                      ((uint16_t)0x0004)
+#define GPIO_PIN_3                      ((uint16_t)0x0008)
+#define GPIO_PIN_4                      ((uint16_t)0x0010)
+#define GPIO_PIN_5                      ((uint16_t)0x0020)
+#define GPIO_PIN_6                      ((uint16_t)0x0040)
+#define GPIO_PIN_7                      ((uint16_t)0x0080)
+#define GPIO_PIN_8                      ((uint16_t)0x0100)
+#define GPIO_PIN_9                      ((uint16_t)0x0200)
+#define GPIO_PIN_10                     ((uint16_t)0x0400)
+#define GPIO_PIN_11                     ((uint16_t)0x0800)
+#define GPIO_PIN_12                     ((uint16_t)0x1000)
+#define GPIO_PIN_13                     ((uint16_t)0x2000)
+#define GPIO_PIN_14                     ((uint16_t)0x4000)
+#define GPIO_PIN_15                     ((uint16_t)0x8000)
+
+#define GPIO_MODE_INPUT                 0x00000000U
+#define GPIO_MODE_OUTPUT_PP             0x00000001U
+#define GPIO_NOPULL                     0x00000000U
+#define GPIO_SPEED_LOW                  0x00000000U
+
+extern GPIO_TypeDef sim_gpio[11];
+#define GPIOA                           (&sim_gpio[0])
+#define GPIOB                           (&sim_gpio[1])
+#define GPIOC                           (&sim_gpio[2])
+#define GPIOD                           (&sim_gpio[3])
+#define GPIOE                           (&sim_gpio[4])
+#define GPIOF                           (&sim_gpio[5])
+#define GPIOG                           (&sim_gpio[6])
+#define GPIOH                           (&sim_gpio[7])
+#define GPIOI                           (&sim_gpio[8])
+#define GPIOJ                           (&sim_gpio[9])
+#define GPIOK                           (&sim_gpio[10])
+
+#define __GPIOA_CLK_ENABLE()            do { } while (0)
+#define __GPIOB_CLK_ENABLE()            do { } while (0)
+#define __GPIOC_CLK_ENABLE()            do { } while (0)
+#define __GPIOD_CLK_ENABLE()            do { } while (0)
+#define __GPIOE_CLK_ENABLE()            do { } while (0)
+#define __GPIOF_CLK_ENABLE()            do { } while (0)
+#define __GPIOG_CLK_ENABLE()            do { } while (0)
+#define __GPIOH_CLK_ENABLE()            do { } while (0)
+#define __GPIOI_CLK_ENABLE()            do { } while (0)
+#define __GPIOJ_CLK_ENABLE()            do { } while (0)
+#define __GPIOK_CLK_ENABLE()            do { } while (0)
+
+extern void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init);
+extern void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+
+/* DMA */
+
+#define HAL_DMA_ERROR_NONE              0x00000000U
+#define HAL_DMA_ERROR_TE                0x00000001U
+#define HAL_DMA_ERROR_FE                0x00000002U
+
+typedef struct __DMA_HandleTypeDef {
+    void *Instance;
+    void *Parent;
+    volatile uint32_t ErrorCode;
+} DMA_HandleTypeDef;
+
+extern HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma);
+extern void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma);
+
+/* SPI */
+
+typedef struct {
+    volatile uint32_t CR1;
+    volatile uint32_t CR2;
+} SPI_TypeDef;
+
+#define SPI_CR1_BR                      0x00000038U
+#define SPI_CR2_RXDMAEN                 0x00000001U
+#define SPI_CR2_TXDMAEN                 0x00000002U
+
+extern SPI_TypeDef sim_spi[6];
+#define SPI1                            (&sim_spi[0])
+#define SPI2                            (&sim_spi[1])
+#define SPI3                            (&sim_spi[2])
+#define SPI4                            (&sim_spi[3])
+#define SPI5                            (&sim_spi[4])
+#define SPI6                            (&sim_spi[5])
+
+typedef struct {
+    uint32_t Mode;
+    uint32_t Direction;
+    uint32_t DataSize;
+    uint32_t CLKPolarity;
+    uint32_t CLKPhase;
+    uint32_t NSS;
+    uint32_t BaudRatePrescaler;
+    uint32_t FirstBit;
+    uint32_t TIMode;
+    uint32_t CRCCalculation;
+    uint32_t CRCPolynomial;
+} SPI_InitTypeDef;
+
+typedef enum {
+    HAL_SPI_STATE_RESET = 0x00,
+    HAL_SPI_STATE_READY = 0x01,
+    HAL_SPI_STATE_BUSY  = 0x02
+} HAL_SPI_StateTypeDef;
+
+#define HAL_SPI_ERROR_NONE              0x00000000U
+#define HAL_SPI_ERROR_DMA               0x00000010U
+
+typedef struct __SPI_HandleTypeDef {
+    SPI_TypeDef *Instance;
+    SPI_InitTypeDef Init;
+    DMA_HandleTypeDef *hdmatx;
+    DMA_HandleTypeDef *hdmarx;
+    HAL_LockTypeDef Lock;
+    volatile HAL_SPI_StateTypeDef State;
+    volatile uint32_t ErrorCode;
+} SPI_HandleTypeDef;
+
+#define SPI_MODE_MASTER                 0x00000104U
+#define SPI_DIRECTION_2LINES            0x00000000U
+#define SPI_DATASIZE_8BIT               0x00000000U
+#define SPI_POLARITY_LOW                0x00000000U
+#define SPI_PHASE_1EDGE                 0x00000000U
+#define SPI_NSS_SOFT                    0x00000200U
+#define SPI_FIRSTBIT_MSB                0x00000000U
+#define SPI_TIMODE_DISABLE              0x00000000U
+#define SPI_CRCCALCULATION_DISABLE      0x00000000U
+
+#define SPI_BAUDRATEPRESCALER_2         0x00000000U
+#define SPI_BAUDRATEPRESCALER_4         0x00000008U
+#define SPI_BAUDRATEPRESCALER_8         0x00000010U
+#define SPI_BAUDRATEPRESCALER_16        0x00000018U
+#define SPI_BAUDRATEPRESCALER_32        0x00000020U
+#define SPI_BAUDRATEPRESCALER_64        0x00000028U
+#define SPI_BAUDRATEPRESCALER_128       0x00000030U
+#define SPI_BAUDRATEPRESCALER_256       0x00000038U
+
+extern HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef *hspi);
+extern HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+extern HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+extern HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size, uint32_t Timeout);
+extern HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size);
+extern HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size);
+
+extern void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi);
+extern void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi);
+extern void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi);
+
+/* RCC, SysTick */
+
+extern uint32_t HAL_RCC_GetPCLK1Freq(void);
+extern uint32_t HAL_RCC_GetPCLK2Freq(void);
+
+extern uint32_t HAL_GetTick(void);
+extern void HAL_Delay(uint32_t Delay);
+
+/* Core clock and the DWT cycle counter, which counts simulated time.
+ * DWT is a function call, so every read of CYCCNT sees the current time.
+ */
+
+extern uint32_t SystemCoreClock;
+
+typedef struct {
+    uint32_t DEMCR;
+} CoreDebug_Type;
+
+typedef struct {
+    uint32_t CTRL;
+    uint32_t CYCCNT;
+} DWT_Type;
+
+#define CoreDebug_DEMCR_TRCENA_Msk      (1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk          (1UL << 0)
+
+extern CoreDebug_Type sim_coredebug;
+extern DWT_Type *sim_dwt(void);
+#define CoreDebug                       (&sim_coredebug)
+#define DWT                             (sim_dwt())
+
+#endif /* __STM32F4xx_HAL_H */
@@ -0,0 +1,519 @@
+/*
+ * n25q128-sim.c
+ * -------------
+ * Simulated N25Q128 SPI flash, behind a host stand-in for the STM32 HAL.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This lets spiflash_n25q128.c and stm-keystore.c run unmodified on a
+ * host, against a model of the chip that keeps track of simulated time.
+ * The model decodes the command stream byte by byte, the way the chip
+ * does, so it sees exactly what the driver sends: a program or erase
+ * takes effect when chip select goes high, WIP stays set for the
+ * datasheet time afterwards, and anything the real chip would ignore
+ * (commands while busy, program/erase without WREN) is counted as a
+ * violation.
+ *
+ * SPI transfers advance simulated time by a per-call overhead plus the
+ * bytes on the wire at the configured SCK rate. DMA transfers complete
+ * synchronously, and then call the driver's completion callback as the
+ * DMA interrupt would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm-init.h"
+#include "stm-keystore.h"
+#include "n25q128-sim.h"
+
+#define SIM_NUM_BYTES	(N25Q128_PAGE_SIZE * N25Q128_NUM_PAGES)
+
+#define SIM_STATUS_WIP	0x01
+#define SIM_STATUS_WEL	0x02
+
+GPIO_TypeDef sim_gpio[11];
+SPI_TypeDef sim_spi[6];
+
+uint64_t sim_ns;
+
+struct n25q128_sim_timing n25q128_sim_timing = {
+    .spi_call_ns        = 2500,
+    .spi_byte_ns        = 300,
+    .dma_setup_ns       = 3000,
+    .gpio_ns            = 50,
+    .tick_ns            = 20,
+    .page_program_us    = 500,
+    .subsector_erase_ms = 250,
+    .sector_erase_ms    = 700,
+    .bulk_erase_ms      = 45000,    /* the CLI says "about 45 seconds" */
+};
+
+struct n25q128_sim_stats n25q128_sim_stats;
+
+static struct {
+    SPI_TypeDef *spi;
+    GPIO_TypeDef *cs_port;
+    uint16_t cs_pin;
+    int selected;
+
+    uint8_t mem[SIM_NUM_BYTES];
+    int wel;
+    uint64_t busy_until;
+    uint64_t last_poll;         /* for busy_wait_ns */
+
+    /* Current transaction */
+    uint8_t command;
+    int ignore;
+    uint32_t pos, addr;
+    uint8_t page[N25Q128_PAGE_SIZE];
+    uint32_t page_len;
+} chip;
+
+#define stats n25q128_sim_stats
+#define timing n25q128_sim_timing
+
+static inline int chip_busy(void)
+{
+    return sim_ns < chip.busy_until;
+}
+
+static void chip_start_op(uint64_t duration_ns)
+{
+    chip.busy_until = sim_ns + duration_ns;
+}
+
+static uint8_t chip_status(void)
+{
+    /* WEL clears when the program or erase it enabled has finished */
+    if (chip.busy_until != 0 && !chip_busy()) {
+        chip.busy_until = 0;
+        chip.wel = 0;
+    }
+    return (chip_busy() ? SIM_STATUS_WIP : 0) | (chip.wel ? SIM_STATUS_WEL : 0);
+}
+
+static void chip_select(void)
+{
+    chip.selected = 1;
+    chip.pos = 0;
+    chip.addr = 0;
+    chip.page_len = 0;
+    chip.ignore = 0;
+}
+
+static int chip_needs_wel(void)
+{
+    if (chip.wel)
+        return 1;
+    ++stats.wel_violations;
+    return 0;
+}
+
+static void chip_erase(uint32_t addr, uint32_t size, uint32_t ms)
+{
+    addr &= ~(size - 1);
+    memset(chip.mem + addr, 0xFF, size);
+    chip_start_op((uint64_t) ms * 1000000);
+}
+
+/* Chip select went high: execute whatever was clocked in. */
+static void chip_deselect(void)
+{
+    chip.selected = 0;
+    if (chip.ignore || chip.pos == 0)
+        return;
+
+    switch (chip.command) {
+    case N25Q128_COMMAND_WRITE_ENABLE:
+        if (chip.pos == 1)
+            chip.wel = 1;
+        break;
+
+    case N25Q128_COMMAND_PAGE_PROGRAM:
+        if (chip.pos < 5 || !chip_needs_wel())
+            break;
+        /* Programming can only clear bits. The address wraps within the
+         * page, so the last N25Q128_PAGE_SIZE bytes sent are what count.
+         */
+        {
+            uint32_t base = chip.addr & ~(N25Q128_PAGE_SIZE - 1);
+            uint32_t n = chip.page_len < N25Q128_PAGE_SIZE ? chip.page_len : N25Q128_PAGE_SIZE;
+            for (uint32_t i = 0; i < n; ++i) {
+                uint32_t col = (chip.addr + i) % N25Q128_PAGE_SIZE;
+                chip.mem[base + col] &= chip.page[col];
+            }
+        }
+        ++stats.page_programs;
+        chip_start_op((uint64_t) timing.page_program_us * 1000);
+        break;
+
+    case N25Q128_COMMAND_ERASE_SUBSECTOR:
+        if (chip.pos != 4 || !chip_needs_wel())
+            break;
+        ++stats.subsector_erases;
+        chip_erase(chip.addr, N25Q128_SUBSECTOR_SIZE, timing.subsector_erase_ms);
+        break;
+
+    case N25Q128_COMMAND_ERASE_SECTOR:
+        if (chip.pos != 4 || !chip_needs_wel())
+            break;
+        ++stats.sector_erases;
+        chip_erase(chip.addr, N25Q128_SECTOR_SIZE, timing.sector_erase_ms);
+        break;
+
+    case N25Q128_COMMAND_ERASE_BULK:
+        if (chip.pos != 1 || !chip_needs_wel())
+            break;
+        ++stats.bulk_erases;
+        chip_erase(0, SIM_NUM_BYTES, timing.bulk_erase_ms);
+        break;
+    }
+}
+
+/* Clock one byte in and one byte out. */
+static uint8_t chip_xfer(uint8_t in)
+{
+    uint32_t pos = chip.pos++;
+
+    if (pos == 0) {
+        chip.command = in;
+        if (in == N25Q128_COMMAND_READ_STATUS) {
+            ++stats.status_reads;
+            if (chip_busy())
+                stats.busy_wait_ns += sim_ns - chip.last_poll;
+        }
+        else if (chip_busy()) {
+            ++stats.busy_violations;
+            chip.ignore = 1;
+        }
+        else {
+            chip_status();
+            switch (in) {
+            case N25Q128_COMMAND_READ:         ++stats.reads; break;
+            case N25Q128_COMMAND_FAST_READ:    ++stats.fast_reads; break;
+            case N25Q128_COMMAND_READ_ID:      ++stats.id_reads; break;
+            case N25Q128_COMMAND_WRITE_ENABLE: ++stats.write_enables; break;
+            case N25Q128_COMMAND_PAGE_PROGRAM:
+            case N25Q128_COMMAND_ERASE_SUBSECTOR:
+            case N25Q128_COMMAND_ERASE_SECTOR:
+            case N25Q128_COMMAND_ERASE_BULK:
+                break;
+            default:
+                ++stats.unknown_commands;
+                chip.ignore = 1;
+            }
+        }
+        chip.last_poll = sim_ns;
+        return 0xFF;
+    }
+
+    if (chip.ignore)
+        return 0xFF;
+
+    switch (chip.command) {
+    case N25Q128_COMMAND_READ_STATUS:
+        if (chip_busy())
+            stats.busy_wait_ns += sim_ns - chip.last_poll;
+        chip.last_poll = sim_ns;
+        return chip_status();
+
+    case N25Q128_COMMAND_READ_ID: {
+        static const uint8_t id[] = { N25Q128_ID_MANUFACTURER, N25Q128_ID_DEVICE_TYPE, N25Q128_ID_DEVICE_CAPACITY };
+        return (pos <= sizeof(id)) ? id[pos - 1] : 0x00;
+    }
+
+    case N25Q128_COMMAND_READ:
+    case N25Q128_COMMAND_FAST_READ: {
+        uint32_t data_pos = (chip.command == N25Q128_COMMAND_READ) ? 4 : 4 + N25Q128_FAST_READ_DUMMY_BYTES;
+        if (pos < 4) {
+            chip.addr = (chip.addr << 8) | in;
+            return 0xFF;
+        }
+        if (pos < data_pos)
+            return 0xFF;
+        ++stats.bytes_read;
+        return chip.mem[chip.addr++ % SIM_NUM_BYTES];
+    }
+
+    case N25Q128_COMMAND_PAGE_PROGRAM:
+    case N25Q128_COMMAND_ERASE_SUBSECTOR:
+    case N25Q128_COMMAND_ERASE_SECTOR:
+        if (pos < 4)
+            chip.addr = ((chip.addr << 8) | in) % SIM_NUM_BYTES;
+        else if (chip.command == N25Q128_COMMAND_PAGE_PROGRAM) {
+            chip.page[(chip.addr + chip.page_len) % N25Q128_PAGE_SIZE] = in;
+            ++chip.page_len;
+        }
+        return 0xFF;
+    }
+
+    return 0xFF;
+}
+
+void n25q128_sim_attach(SPI_TypeDef *spi, GPIO_TypeDef *cs_port, uint16_t cs_pin)
+{
+    chip.spi = spi;
+    chip.cs_port = cs_port;
+    chip.cs_pin = cs_pin;
+    memset(chip.mem, 0xFF, sizeof(chip.mem));
+}
+
+int n25q128_sim_load(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    size_t n = fread(chip.mem, 1, sizeof(chip.mem), f);
+    fclose(f);
+    return n == sizeof(chip.mem) ? 0 : -1;
+}
+
+int n25q128_sim_save(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+    size_t n = fwrite(chip.mem, 1, sizeof(chip.mem), f);
+    return (fclose(f) == 0 && n == sizeof(chip.mem)) ? 0 : -1;
+}
+
+/* HAL stand-ins */
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+    return 45000000;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+    return 90000000;
+}
+
+uint32_t HAL_GetTick(void)
+{
+    sim_ns += timing.tick_ns;
+    return (uint32_t) (sim_ns / 1000000);
+}
+
+uint32_t SystemCoreClock = 180000000;
+
+CoreDebug_Type sim_coredebug;
+
+DWT_Type *sim_dwt(void)
+{
+    static DWT_Type dwt;
+    dwt.CYCCNT = (uint32_t) (sim_ns * (SystemCoreClock / 1000000) / 1000);
+    return &dwt;
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+    sim_ns += (uint64_t) Delay * 1000000;
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+    (void) GPIOx;
+    (void) GPIO_Init;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    sim_ns += timing.gpio_ns;
+
+    if (PinState == GPIO_PIN_SET)
+        GPIOx->ODR |= GPIO_Pin;
+    else
+        GPIOx->ODR &= ~GPIO_Pin;
+
+    if (GPIOx != chip.cs_port || !(GPIO_Pin & chip.cs_pin))
+        return;
+
+    if (PinState == GPIO_PIN_RESET && !chip.selected)
+        chip_select();
+    else if (PinState == GPIO_PIN_SET && chip.selected)
+        chip_deselect();
+}
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef *hspi)
+{
+    hspi->Instance->CR1 = hspi->Init.BaudRatePrescaler & SPI_CR1_BR;
+    hspi->State = HAL_SPI_STATE_READY;
+    return HAL_OK;
+}
+
+/* Time for one byte on the wire at the SPI's SCK rate. */
+static uint32_t spi_byte_time(SPI_HandleTypeDef *hspi)
+{
+    uint32_t pclk = (hspi->Instance == SPI2 || hspi->Instance == SPI3) ?
+        HAL_RCC_GetPCLK1Freq() : HAL_RCC_GetPCLK2Freq();
+    uint32_t sck = pclk >> (((hspi->Instance->CR1 & SPI_CR1_BR) >> 3) + 1);
+    return (uint32_t) (8ULL * 1000000000 / sck);
+}
+
+static HAL_StatusTypeDef spi_xfer(SPI_HandleTypeDef *hspi, const uint8_t *tx, uint8_t *rx, uint16_t len, int dma)
+{
+    uint32_t byte_ns = spi_byte_time(hspi);
+
+    if (hspi->State != HAL_SPI_STATE_READY)
+        return HAL_BUSY;
+
+    ++stats.spi_calls;
+    if (dma) {
+        ++stats.dma_transfers;
+        sim_ns += timing.dma_setup_ns;
+    }
+    else {
+        sim_ns += timing.spi_call_ns;
+        if (byte_ns < timing.spi_byte_ns)
+            byte_ns = timing.spi_byte_ns;
+    }
+
+    int connected = hspi->Instance == chip.spi && chip.selected;
+
+    for (uint16_t i = 0; i < len; ++i) {
+        uint8_t in = (tx != NULL) ? tx[i] : 0xFF;
+        uint8_t out = connected ? chip_xfer(in) : 0xFF;
+        if (rx != NULL)
+            rx[i] = out;
+        sim_ns += byte_ns;
+    }
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+    (void) Timeout;
+    return spi_xfer(hspi, pData, NULL, Size, 0);
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+    (void) Timeout;
+    return spi_xfer(hspi, NULL, pData, Size, 0);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size, uint32_t Timeout)
+{
+    (void) Timeout;
+    return spi_xfer(hspi, pTxData, pRxData, Size, 0);
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size)
+{
+    if (hspi->hdmatx == NULL || spi_xfer(hspi, pData, NULL, Size, 1) != HAL_OK)
+        return HAL_ERROR;
+    HAL_SPI_TxCpltCallback(hspi);
+    return HAL_OK;
+}
+
+/* In 2-line master mode the HAL implements this as a full-duplex transfer,
+ * so completion comes through the TxRx callback.
+ */
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size)
+{
+    if (hspi->hdmarx == NULL || spi_xfer(hspi, NULL, pData, Size, 1) != HAL_OK)
+        return HAL_ERROR;
+    HAL_SPI_TxRxCpltCallback(hspi);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma)
+{
+    (void) hdma;
+    return HAL_OK;
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma)
+{
+    (void) hdma;
+}
+
+/* stm-init.c stand-ins */
+
+void Error_Handler(void)
+{
+    fprintf(stderr, "Error_Handler called\n");
+    abort();
+}
+
+static const char *image_path;
+
+static void sim_exit(void)
+{
+    n25q128_sim_report();
+    if (image_path != NULL && n25q128_sim_save(image_path) != 0)
+        fprintf(stderr, "n25q128-sim: can't save %s\n", image_path);
+    if (stats.busy_violations || stats.wel_violations || stats.unknown_commands)
+        _Exit(1);
+}
+
+/* The board tests call this first. Set N25Q128_SIM_IMAGE to a file name to
+ * start from (and save back to) a flash image, instead of a blank chip.
+ */
+void stm_init(void)
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    n25q128_sim_attach(SPI1, KSM_PROM_CS_N_GPIO_Port, KSM_PROM_CS_N_Pin);
+
+    image_path = getenv("N25Q128_SIM_IMAGE");
+    if (image_path != NULL && n25q128_sim_load(image_path) != 0)
+        fprintf(stderr, "n25q128-sim: can't load %s, starting blank\n", image_path);
+
+    keystore_init();
+    atexit(sim_exit);
+}
+
+void n25q128_sim_report(void)
+{
+    printf("\nn25q128-sim: %llu.%03llu sec simulated\n",
+           (unsigned long long) (sim_ns / 1000000000),
+           (unsigned long long) (sim_ns / 1000000 % 1000));
+    printf("  READ %llu, FAST READ %llu, %llu bytes read\n",
+           (unsigned long long) stats.reads, (unsigned long long) stats.fast_reads,
+           (unsigned long long) stats.bytes_read);
+    printf("  RDSR %llu (%llu ms polling a busy chip), RDID %llu, WREN %llu\n",
+           (unsigned long long) stats.status_reads,
+           (unsigned long long) (stats.busy_wait_ns / 1000000),
+           (unsigned long long) stats.id_reads, (unsigned long long) stats.write_enables);
+    printf("  PP %llu, SSE %llu, SE %llu, BE %llu\n",
+           (unsigned long long) stats.page_programs, (unsigned long long) stats.subsector_erases,
+           (unsigned long long) stats.sector_erases, (unsigned long long) stats.bulk_erases);
+    printf("  SPI calls %llu, DMA transfers %llu\n",
+           (unsigned long long) stats.spi_calls, (unsigned long long) stats.dma_transfers);
+    printf("  violations: %llu while busy, %llu without WEL, %llu unknown commands\n",
+           (unsigned long long) stats.busy_violations, (unsigned long long) stats.wel_violations,
+           (unsigned long long) stats.unknown_commands);
+}
@@ -0,0 +1,91 @@
+/*
+ * n25q128-sim.h
+ * -------------
+ * Simulated N25Q128 SPI flash, behind a host stand-in for the STM32 HAL.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __N25Q128_SIM_H
+#define __N25Q128_SIM_H
+
+#include <stdint.h>
+
+#include "stm32f4xx_hal.h"
+
+/* Simulated time since start-up. HAL_GetTick() is derived from this, so
+ * the board tests' timings come out in simulated milliseconds.
+ */
+extern uint64_t sim_ns;
+
+/* What things cost. The chip timings are the datasheet's typical values;
+ * the MCU costs are rough figures for the STM32F429 at 180 MHz, and are
+ * worth calibrating against a real board before trusting absolute numbers.
+ */
+struct n25q128_sim_timing {
+    uint32_t spi_call_ns;       /* per HAL_SPI_* call (setup, flag checks) */
+    uint32_t spi_byte_ns;       /* floor per polled byte (HAL poll loop) */
+    uint32_t dma_setup_ns;      /* per DMA transfer (stream setup, IRQ) */
+    uint32_t gpio_ns;           /* per HAL_GPIO_WritePin */
+    uint32_t tick_ns;           /* per HAL_GetTick */
+    uint32_t page_program_us;   /* tPP */
+    uint32_t subsector_erase_ms;/* tSSE */
+    uint32_t sector_erase_ms;   /* tSE */
+    uint32_t bulk_erase_ms;     /* tBE */
+};
+
+extern struct n25q128_sim_timing n25q128_sim_timing;
+
+struct n25q128_sim_stats {
+    uint64_t reads, fast_reads, bytes_read;
+    uint64_t status_reads, id_reads, write_enables;
+    uint64_t page_programs, subsector_erases, sector_erases, bulk_erases;
+    uint64_t spi_calls, dma_transfers;
+    uint64_t busy_wait_ns;      /* time spent polling a busy chip */
+
+    /* Things the real chip would ignore, or get wrong. Non-zero means a
+     * driver bug, and makes the program exit with an error.
+     */
+    uint64_t busy_violations;   /* commands other than RDSR while busy */
+    uint64_t wel_violations;    /* program/erase without write enable */
+    uint64_t unknown_commands;
+};
+
+extern struct n25q128_sim_stats n25q128_sim_stats;
+
+/* Connect a simulated chip to an SPI peripheral and its chip select pin. */
+extern void n25q128_sim_attach(SPI_TypeDef *spi, GPIO_TypeDef *cs_port, uint16_t cs_pin);
+
+/* Load or save the flash contents, to carry state between runs. */
+extern int n25q128_sim_load(const char *path);
+extern int n25q128_sim_save(const char *path);
+
+extern void n25q128_sim_report(void);
+
+#endif /* __N25Q128_SIM_H */
@@ -36,6 +36,17 @@
  */
 
 #include "spiflash_n25q128.h"
+#include "task.h"
+
+/* The bootloader and the board tests don't link with the tasker, so we
+ * refer to it weakly, and spin while DMA or the flash is busy if it isn't
+ * there.
+ */
+#pragma weak task_get_tcb
+#pragma weak task_sleep_prepare
+#pragma weak task_sleep
+#pragma weak task_wake
+#pragma weak task_yield
 
 #define N25Q128_NUM_BYTES	(N25Q128_PAGE_SIZE * N25Q128_NUM_PAGES)
 
@@ -55,6 +66,150 @@ static inline void _n25q128_deselect(struct spiflash_ctx *ctx)
     HAL_GPIO_WritePin(ctx->cs_n_port, ctx->cs_n_pin, GPIO_PIN_SET);
 }
 
+/*
+ * DMA transfers.
+ *
+ * The HAL SPI callbacks only tell us the SPI handle, so keep track of which
+ * context has a DMA transfer in progress on each SPI.
+ */
+
+#define N25Q128_MAX_DMA_CTX 2
+static struct spiflash_ctx *dma_ctx[N25Q128_MAX_DMA_CTX];
+
+/* The 64KB CCM RAM is only connected to the D-bus. */
+#define is_ccmram(x) (((uintptr_t)(x) & 0xFFFF0000) == 0x10000000)
+
+static inline int _n25q128_use_dma(struct spiflash_ctx *ctx, const uint8_t *buf, const uint32_t len)
+{
+    return (ctx->use_dma &&
+            len >= N25Q128_DMA_THRESHOLD && len <= 0xFFFF &&
+            ctx->hspi->hdmarx != NULL && ctx->hspi->hdmatx != NULL &&
+            !is_ccmram(buf));
+}
+
+static struct spiflash_ctx *_n25q128_find_dma_ctx(SPI_HandleTypeDef *hspi)
+{
+    for (int i = 0; i < N25Q128_MAX_DMA_CTX; ++i)
+        if (dma_ctx[i] != NULL && dma_ctx[i]->hspi == hspi)
+            return dma_ctx[i];
+    return NULL;
+}
+
+static void _n25q128_dma_prepare(struct spiflash_ctx *ctx)
+{
+    if (_n25q128_find_dma_ctx(ctx->hspi) != ctx) {
+        for (int i = 0; i < N25Q128_MAX_DMA_CTX; ++i) {
+            if (dma_ctx[i] == NULL || dma_ctx[i]->hspi == ctx->hspi) {
+                dma_ctx[i] = ctx;
+                break;
+            }
+        }
+    }
+
+    ctx->dma_status = HAL_OK;
+    ctx->dma_waiter = (task_get_tcb == NULL) ? NULL : task_get_tcb();
+    ctx->dma_busy = 1;
+}
+
+static void _n25q128_dma_done(SPI_HandleTypeDef *hspi, HAL_StatusTypeDef status)
+{
+    struct spiflash_ctx *ctx = _n25q128_find_dma_ctx(hspi);
+
+    if (ctx == NULL || !ctx->dma_busy)
+        return;
+
+    ctx->dma_status = status;
+    ctx->dma_busy = 0;
+    if (ctx->dma_waiter != NULL)
+        task_wake(ctx->dma_waiter);
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    _n25q128_dma_done(hspi, HAL_OK);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    _n25q128_dma_done(hspi, HAL_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    /* The DMA FIFO error interrupt can fire in direct mode without anything
+     * being wrong, and the transfer carries on to completion.
+     */
+    if (hspi->ErrorCode == HAL_SPI_ERROR_DMA &&
+        (hspi->hdmarx->ErrorCode & ~HAL_DMA_ERROR_FE) == 0 &&
+        (hspi->hdmatx->ErrorCode & ~HAL_DMA_ERROR_FE) == 0)
+        return;
+
+    _n25q128_dma_done(hspi, HAL_ERROR);
+}
+
+/* Wait for a DMA transfer to finish. If we're in a task, sleep until the
+ * completion interrupt wakes us; otherwise spin, with a timeout.
+ */
+static HAL_StatusTypeDef _n25q128_dma_wait(struct spiflash_ctx *ctx)
+{
+    uint32_t tick_start = HAL_GetTick();
+
+    if (ctx->dma_waiter != NULL)
+        task_sleep_prepare();
+    while (ctx->dma_busy) {
+        if (ctx->dma_waiter != NULL) {
+            task_sleep();
+            task_sleep_prepare();
+        }
+        else if (HAL_GetTick() - tick_start > N25Q128_SPI_TIMEOUT) {
+            HAL_DMA_Abort(ctx->hspi->hdmatx);
+            HAL_DMA_Abort(ctx->hspi->hdmarx);
+            ctx->hspi->Instance->CR2 &= ~(SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN);
+            ctx->hspi->State = HAL_SPI_STATE_READY;
+            __HAL_UNLOCK(ctx->hspi);
+            ctx->dma_busy = 0;
+            return HAL_TIMEOUT;
+        }
+    }
+
+    /* The HAL accumulates DMA errors, and never clears them. */
+    ctx->hspi->hdmarx->ErrorCode = HAL_DMA_ERROR_NONE;
+    ctx->hspi->hdmatx->ErrorCode = HAL_DMA_ERROR_NONE;
+
+    return ctx->dma_status;
+}
+
+/* Send data, by DMA if it's long enough to be worth it. */
+static HAL_StatusTypeDef _n25q128_transmit(struct spiflash_ctx *ctx, const uint8_t *buf, const uint32_t len)
+{
+    if (!_n25q128_use_dma(ctx, buf, len))
+        return HAL_SPI_Transmit(ctx->hspi, (uint8_t *)buf, len, N25Q128_SPI_TIMEOUT);
+
+    _n25q128_dma_prepare(ctx);
+    if (HAL_SPI_Transmit_DMA(ctx->hspi, (uint8_t *)buf, len) != HAL_OK) {
+        ctx->dma_busy = 0;
+        return HAL_ERROR;
+    }
+    return _n25q128_dma_wait(ctx);
+}
+
+/* Receive data, by DMA if it's long enough to be worth it. In 2-line master
+ * mode, the HAL clocks out the contents of the receive buffer while it
+ * reads, which is harmless here.
+ */
+static HAL_StatusTypeDef _n25q128_receive(struct spiflash_ctx *ctx, uint8_t *buf, const uint32_t len)
+{
+    if (!_n25q128_use_dma(ctx, buf, len))
+        return HAL_SPI_Receive(ctx->hspi, buf, len, N25Q128_SPI_TIMEOUT);
+
+    _n25q128_dma_prepare(ctx);
+    if (HAL_SPI_Receive_DMA(ctx->hspi, buf, len) != HAL_OK) {
+        ctx->dma_busy = 0;
+        return HAL_ERROR;
+    }
+    return _n25q128_dma_wait(ctx);
+}
+
 /* Read a bit from the status register. */
 static inline int _n25q128_get_status_bit(struct spiflash_ctx *ctx, unsigned bitnum)
 {
@@ -92,10 +247,17 @@ static inline int _n25q128_get_wip_flag(struct spiflash_ctx *ctx)
     return _n25q128_get_status_bit(ctx, 0);
 }
 
+/* Page programs finish in well under a millisecond, so we poll those
+ * without yielding; anything still busy after this long is an erase, and
+ * other tasks get to run between polls.
+ */
+#define N25Q128_WIP_SPIN_MS	2
+
 /* Wait until the flash memory is done writing */
 static HAL_StatusTypeDef _n25q128_wait_while_wip(struct spiflash_ctx *ctx, uint32_t timeout)
 {
-    uint32_t tick_end = HAL_GetTick() + timeout;
+    uint32_t tick_start = HAL_GetTick();
+    int can_yield = task_get_tcb != NULL && task_get_tcb() != NULL;
 
     do {
         switch (_n25q128_get_wip_flag(ctx)) {
@@ -105,9 +267,11 @@ static HAL_StatusTypeDef _n25q128_wait_while_wip(struct spiflash_ctx *ctx, uint3
             return HAL_ERROR;
         default:
             /* try again */
+            if (can_yield && HAL_GetTick() - tick_start >= N25Q128_WIP_SPIN_MS)
+                task_yield();
             continue;
         }
-    } while (HAL_GetTick() < tick_end);
+    } while (HAL_GetTick() - tick_start < timeout);
 
     return HAL_TIMEOUT;
 }
@@ -162,42 +326,123 @@ HAL_StatusTypeDef n25q128_check_id(struct spiflash_ctx *ctx)
 }
 
 
-HAL_StatusTypeDef n25q128_write_page(struct spiflash_ctx *ctx, uint32_t page_offset, const uint8_t *page_buffer)
-{
-    // tx buffer
-    uint8_t spi_tx[4];
-
-    // check offset
-    if (page_offset >= N25Q128_NUM_PAGES) return HAL_ERROR;
-
-    // enable writing
-    if (_n25q128_write_enable(ctx) != 0) return HAL_ERROR;
+/* Page programming.
+ *
+ * The chip won't accept anything but READ STATUS while it's programming a
+ * page, so the most we can do is keep the gaps between pages short:
+ *
+ * - WRITE ENABLE is sent without reading WEL back. Instead, the first
+ *   status byte after PAGE PROGRAM has to show WIP, which it can only do
+ *   if WRITE ENABLE took. If it doesn't (the chip was quicker than us, or
+ *   it really didn't program), the page is read back and checked.
+ *
+ * - While waiting for the program to finish, we hold chip select low and
+ *   let READ STATUS clock out the status register continuously, instead
+ *   of sending a new command for every poll.
+ *
+ * - n25q128_write_data() sets up the command for page N+1 while page N
+ *   is programming, and starts it as soon as WIP drops.
+ */
 
-    // calculate byte address
+static inline void _n25q128_page_command(uint8_t *spi_tx, uint32_t page_offset)
+{
     uint32_t byte_offset = page_offset * N25Q128_PAGE_SIZE;
 
-    // prepare PROGRAM PAGE command
     spi_tx[0] = N25Q128_COMMAND_PAGE_PROGRAM;
     spi_tx[1] = (uint8_t)(byte_offset >> 16);
     spi_tx[2] = (uint8_t)(byte_offset >>  8);
     spi_tx[3] = (uint8_t)(byte_offset >>  0);
+}
+
+/* Send WRITE ENABLE, then PAGE PROGRAM and the data. */
+static HAL_StatusTypeDef _n25q128_program_start(struct spiflash_ctx *ctx, const uint8_t *spi_tx, const uint8_t *page_buffer)
+{
+    uint8_t wren = N25Q128_COMMAND_WRITE_ENABLE;
 
-    // activate, send command, send data, deselect
     _n25q128_select(ctx);
-    int ok = 
-        HAL_SPI_Transmit(ctx->hspi, spi_tx, 4, N25Q128_SPI_TIMEOUT) == HAL_OK &&
-        HAL_SPI_Transmit(ctx->hspi, (uint8_t *) page_buffer, N25Q128_PAGE_SIZE, N25Q128_SPI_TIMEOUT) == HAL_OK;
+    int ok =
+        HAL_SPI_Transmit(ctx->hspi, &wren, 1, N25Q128_SPI_TIMEOUT) == HAL_OK;
     _n25q128_deselect(ctx);
 
-    // check
     if (!ok) return HAL_ERROR;
 
-    // wait until write finishes
-    return _n25q128_wait_while_wip(ctx, 1000);
+    _n25q128_select(ctx);
+    ok =
+        HAL_SPI_Transmit(ctx->hspi, (uint8_t *)spi_tx, 4, N25Q128_SPI_TIMEOUT) == HAL_OK &&
+        _n25q128_transmit(ctx, page_buffer, N25Q128_PAGE_SIZE) == HAL_OK;
+    _n25q128_deselect(ctx);
+
+    return ok ? HAL_OK : HAL_ERROR;
+}
+
+/* Check that a page program took: every bit that was to be cleared is. */
+static HAL_StatusTypeDef _n25q128_program_verify(struct spiflash_ctx *ctx, uint32_t page_offset, const uint8_t *page_buffer)
+{
+    uint8_t page[N25Q128_PAGE_SIZE];
+
+    if (n25q128_read_page(ctx, page_offset, page) != HAL_OK)
+        return HAL_ERROR;
+
+    for (size_t i = 0; i < N25Q128_PAGE_SIZE; ++i)
+        if (page[i] & ~page_buffer[i])
+            return HAL_ERROR;
+
+    return HAL_OK;
+}
+
+/* Wait for a page program to finish. */
+static HAL_StatusTypeDef _n25q128_program_wait(struct spiflash_ctx *ctx, uint32_t page_offset, const uint8_t *page_buffer)
+{
+    uint8_t spi_tx = N25Q128_COMMAND_READ_STATUS;
+    uint8_t status;
+    uint32_t tick_start = HAL_GetTick();
+    int first = 1;
+
+    _n25q128_select(ctx);
+    if (HAL_SPI_Transmit(ctx->hspi, &spi_tx, 1, N25Q128_SPI_TIMEOUT) != HAL_OK) {
+        _n25q128_deselect(ctx);
+        return HAL_ERROR;
+    }
+
+    do {
+        if (HAL_SPI_Receive(ctx->hspi, &status, 1, N25Q128_SPI_TIMEOUT) != HAL_OK) {
+            _n25q128_deselect(ctx);
+            return HAL_ERROR;
+        }
+        if ((status & 1) == 0) {
+            _n25q128_deselect(ctx);
+            return first ? _n25q128_program_verify(ctx, page_offset, page_buffer) : HAL_OK;
+        }
+        first = 0;
+    } while (HAL_GetTick() - tick_start < N25Q128_WIP_SPIN_MS);
+
+    _n25q128_deselect(ctx);
+
+    /* This is taking longer than it should; poll the slow way. */
+    return _n25q128_wait_while_wip(ctx, N25Q128_SPI_TIMEOUT);
+}
+
+HAL_StatusTypeDef n25q128_write_page(struct spiflash_ctx *ctx, uint32_t page_offset, const uint8_t *page_buffer)
+{
+    // tx buffer
+    uint8_t spi_tx[4];
+
+    // check offset
+    if (page_offset >= N25Q128_NUM_PAGES) return HAL_ERROR;
+
+    // prepare PROGRAM PAGE command
+    _n25q128_page_command(spi_tx, page_offset);
+
+    // enable writing, send command and data, wait until write finishes
+    if (_n25q128_program_start(ctx, spi_tx, page_buffer) != HAL_OK)
+        return HAL_ERROR;
+
+    return _n25q128_program_wait(ctx, page_offset, page_buffer);
 }
 
 
-static HAL_StatusTypeDef n25q128_erase_something(struct spiflash_ctx *ctx, uint8_t command, uint32_t byte_offset)
+/* Start an erase, and return without waiting for it to finish. */
+static HAL_StatusTypeDef n25q128_erase_start_something(struct spiflash_ctx *ctx, uint8_t command, uint32_t byte_offset)
 {
     // check offset
     if (byte_offset >= N25Q128_NUM_BYTES) return HAL_ERROR;
@@ -208,7 +453,7 @@ static HAL_StatusTypeDef n25q128_erase_something(struct spiflash_ctx *ctx, uint8
     // enable writing
     if (_n25q128_write_enable(ctx) != 0) return HAL_ERROR;
 
-    // send command (ERASE SECTOR or ERASE SUBSECTOR)
+    // send command (ERASE SECTOR, ERASE SUBSECTOR or ERASE BULK)
     spi_tx[0] = command;
     spi_tx[1] = (uint8_t)(byte_offset >> 16);
     spi_tx[2] = (uint8_t)(byte_offset >>  8);
@@ -217,53 +462,85 @@ static HAL_StatusTypeDef n25q128_erase_something(struct spiflash_ctx *ctx, uint8
     // activate, send command, deselect
     _n25q128_select(ctx);
     int ok =
-        HAL_SPI_Transmit(ctx->hspi, spi_tx, 4, N25Q128_SPI_TIMEOUT) == HAL_OK;
+        HAL_SPI_Transmit(ctx->hspi, spi_tx,
+                         command == N25Q128_COMMAND_ERASE_BULK ? 1 : 4,
+                         N25Q128_SPI_TIMEOUT) == HAL_OK;
     _n25q128_deselect(ctx);
 
     // check
-    if (!ok) return HAL_ERROR;
+    return ok ? HAL_OK : HAL_ERROR;
+}
+
 
-    // wait for erase to finish
-    return _n25q128_wait_while_wip(ctx, 1000);
+HAL_StatusTypeDef n25q128_erase_sector_start(struct spiflash_ctx *ctx, uint32_t sector_offset)
+{
+    return n25q128_erase_start_something(ctx, N25Q128_COMMAND_ERASE_SECTOR,
+                                         sector_offset * N25Q128_SECTOR_SIZE);
 }
 
 
-HAL_StatusTypeDef n25q128_erase_sector(struct spiflash_ctx *ctx, uint32_t sector_offset)
+HAL_StatusTypeDef n25q128_erase_subsector_start(struct spiflash_ctx *ctx, uint32_t subsector_offset)
 {
-    return n25q128_erase_something(ctx, N25Q128_COMMAND_ERASE_SECTOR,
-				   sector_offset * N25Q128_SECTOR_SIZE);
+    return n25q128_erase_start_something(ctx, N25Q128_COMMAND_ERASE_SUBSECTOR,
+                                         subsector_offset * N25Q128_SUBSECTOR_SIZE);
 }
 
 
-HAL_StatusTypeDef n25q128_erase_subsector(struct spiflash_ctx *ctx, uint32_t subsector_offset)
+HAL_StatusTypeDef n25q128_erase_bulk_start(struct spiflash_ctx *ctx)
 {
-    return n25q128_erase_something(ctx, N25Q128_COMMAND_ERASE_SUBSECTOR,
-				   subsector_offset * N25Q128_SUBSECTOR_SIZE);
+    return n25q128_erase_start_something(ctx, N25Q128_COMMAND_ERASE_BULK, 0);
 }
 
 
-HAL_StatusTypeDef n25q128_erase_bulk(struct spiflash_ctx *ctx)
+/* Check on an erase (or program) started earlier.
+ * Returns HAL_BUSY while the chip is still working, HAL_OK when it's done.
+ */
+HAL_StatusTypeDef n25q128_erase_poll(struct spiflash_ctx *ctx)
 {
-    // tx buffer
-    uint8_t spi_tx[1];
+    switch (_n25q128_get_wip_flag(ctx)) {
+    case 0:
+        return HAL_OK;
+    case 1:
+        return HAL_BUSY;
+    default:
+        return HAL_ERROR;
+    }
+}
 
-    // enable writing
-    if (_n25q128_write_enable(ctx) != 0) return HAL_ERROR;
 
-    // send command
-    spi_tx[0] = N25Q128_COMMAND_ERASE_BULK;
+/* Wait for an erase started earlier to finish, yielding to other tasks
+ * while the chip is busy.
+ */
+HAL_StatusTypeDef n25q128_erase_wait(struct spiflash_ctx *ctx, uint32_t timeout)
+{
+    return _n25q128_wait_while_wip(ctx, timeout);
+}
 
-    // activate, send command, deselect
-    _n25q128_select(ctx);
-    int ok =
-        HAL_SPI_Transmit(ctx->hspi, spi_tx, 1, N25Q128_SPI_TIMEOUT) == HAL_OK;
-    _n25q128_deselect(ctx);
 
-    // check
-    if (!ok) return HAL_ERROR;
+HAL_StatusTypeDef n25q128_erase_sector(struct spiflash_ctx *ctx, uint32_t sector_offset)
+{
+    if (n25q128_erase_sector_start(ctx, sector_offset) != HAL_OK)
+        return HAL_ERROR;
+
+    return _n25q128_wait_while_wip(ctx, N25Q128_ERASE_SECTOR_TIMEOUT);
+}
+
+
+HAL_StatusTypeDef n25q128_erase_subsector(struct spiflash_ctx *ctx, uint32_t subsector_offset)
+{
+    if (n25q128_erase_subsector_start(ctx, subsector_offset) != HAL_OK)
+        return HAL_ERROR;
+
+    return _n25q128_wait_while_wip(ctx, N25Q128_ERASE_SUBSECTOR_TIMEOUT);
+}
 
-    // wait for erase to finish
-    return _n25q128_wait_while_wip(ctx, 60000);
+
+HAL_StatusTypeDef n25q128_erase_bulk(struct spiflash_ctx *ctx)
+{
+    if (n25q128_erase_bulk_start(ctx) != HAL_OK)
+        return HAL_ERROR;
+
+    return _n25q128_wait_while_wip(ctx, N25Q128_ERASE_BULK_TIMEOUT);
 }
 
 
@@ -294,12 +571,28 @@ HAL_StatusTypeDef n25q128_write_data(struct spiflash_ctx *ctx, uint32_t offset,
 
     if (offset % N25Q128_PAGE_SIZE != 0 || len % N25Q128_PAGE_SIZE != 0) return HAL_ERROR;
 
-    for (page = 0; page < len / N25Q128_PAGE_SIZE; page++) {
-	if (n25q128_write_page(ctx, offset / N25Q128_PAGE_SIZE, buf) != 0) {
-	    return HAL_ERROR;
-	}
-	buf += N25Q128_PAGE_SIZE;
-	offset += N25Q128_PAGE_SIZE;
+    const uint32_t first = offset / N25Q128_PAGE_SIZE;
+    const uint32_t n = len / N25Q128_PAGE_SIZE;
+
+    if (first + n > N25Q128_NUM_PAGES) return HAL_ERROR;
+
+    // two command buffers, so the next one can be set up while the chip is busy
+    uint8_t spi_tx[2][4];
+
+    if (n > 0)
+        _n25q128_page_command(spi_tx[0], first);
+
+    for (page = 0; page < n; page++) {
+        if (_n25q128_program_start(ctx, spi_tx[page & 1], buf) != HAL_OK)
+            return HAL_ERROR;
+
+        if (page + 1 < n)
+            _n25q128_page_command(spi_tx[(page + 1) & 1], first + page + 1);
+
+        if (_n25q128_program_wait(ctx, first + page, buf) != HAL_OK)
+            return HAL_ERROR;
+
+        buf += N25Q128_PAGE_SIZE;
     }
 
     return HAL_OK;
@@ -309,7 +602,7 @@ HAL_StatusTypeDef n25q128_write_data(struct spiflash_ctx *ctx, uint32_t offset,
 HAL_StatusTypeDef n25q128_read_data(struct spiflash_ctx *ctx, uint32_t offset, uint8_t *buf, const uint32_t len)
 {
     // tx buffer
-    uint8_t spi_tx[4];
+    uint8_t spi_tx[4 + N25Q128_FAST_READ_DUMMY_BYTES];
 
     /*
      * The data sheet says:
@@ -326,8 +619,16 @@ HAL_StatusTypeDef n25q128_read_data(struct spiflash_ctx *ctx, uint32_t offset, u
     // avoid overflow
     if (offset + len > N25Q128_NUM_BYTES) return HAL_ERROR;
 
-    // prepare READ command
-    spi_tx[0] = N25Q128_COMMAND_READ;
+    // prepare READ or FAST READ command
+    uint16_t cmd_len = 4;
+    if (ctx->read_mode == N25Q128_READ_FAST) {
+        spi_tx[0] = N25Q128_COMMAND_FAST_READ;
+        for (int i = 0; i < N25Q128_FAST_READ_DUMMY_BYTES; i++)
+            spi_tx[cmd_len++] = 0xFF;
+    }
+    else {
+        spi_tx[0] = N25Q128_COMMAND_READ;
+    }
     spi_tx[1] = (uint8_t)(offset >> 16);
     spi_tx[2] = (uint8_t)(offset >>  8);
     spi_tx[3] = (uint8_t)(offset >>  0);
@@ -335,10 +636,152 @@ HAL_StatusTypeDef n25q128_read_data(struct spiflash_ctx *ctx, uint32_t offset, u
     // activate, send command, read response, deselect
     _n25q128_select(ctx);
     int ok =
-        HAL_SPI_Transmit(ctx->hspi, spi_tx, 4, N25Q128_SPI_TIMEOUT) == HAL_OK &&
-        HAL_SPI_Receive(ctx->hspi, buf, len, N25Q128_SPI_TIMEOUT) == HAL_OK;
+        HAL_SPI_Transmit(ctx->hspi, spi_tx, cmd_len, N25Q128_SPI_TIMEOUT) == HAL_OK &&
+        _n25q128_receive(ctx, buf, len) == HAL_OK;
     _n25q128_deselect(ctx);
 
     // check
     return ok ? HAL_OK : HAL_ERROR;
 }
+
+/* Work out the SCK frequency from the peripheral's bus clock and the
+ * configured prescaler. SPI1, SPI4..6 are on APB2; SPI2 and SPI3 on APB1.
+ */
+uint32_t n25q128_spi_clock(struct spiflash_ctx *ctx)
+{
+    SPI_TypeDef *spi = ctx->hspi->Instance;
+    uint32_t pclk = (spi == SPI2 || spi == SPI3) ?
+        HAL_RCC_GetPCLK1Freq() : HAL_RCC_GetPCLK2Freq();
+
+    // BR[2:0] selects fPCLK/2 .. fPCLK/256
+    return pclk >> (((ctx->hspi->Init.BaudRatePrescaler & SPI_CR1_BR) >> 3) + 1);
+}
+
+/* Pick the cheapest read command that is within spec at the current SPI
+ * clock. READ has no dummy cycles, so it wins whenever it's allowed.
+ * Call this after HAL_SPI_Init().
+ */
+void n25q128_select_read_mode(struct spiflash_ctx *ctx)
+{
+    ctx->read_mode = (n25q128_spi_clock(ctx) > N25Q128_READ_MAX_HZ) ?
+        N25Q128_READ_FAST : N25Q128_READ_NORMAL;
+}
+
+/* Compare one page on the chip with the page we'd like it to hold. */
+static n25q128_compare_t _n25q128_compare_page(const uint8_t *chip, const uint8_t *page)
+{
+    n25q128_compare_t result = N25Q128_SAME;
+
+    for (int i = 0; i < N25Q128_PAGE_SIZE; i++) {
+        if ((chip[i] & page[i]) != page[i])
+            return N25Q128_ERASE;
+        if (chip[i] != page[i])
+            result = N25Q128_PROGRAM;
+    }
+
+    return result;
+}
+
+static int _n25q128_page_blank(const uint8_t *page)
+{
+    for (int i = 0; i < N25Q128_PAGE_SIZE; i++)
+        if (page[i] != 0xFF)
+            return 0;
+    return 1;
+}
+
+/* Compare one subsector on the chip with the data we'd like it to hold,
+ * page by page (so the caller's stack only needs room for one page).
+ */
+static HAL_StatusTypeDef _n25q128_compare_subsector(struct spiflash_ctx *ctx, uint32_t subsector,
+                                                    const uint8_t *buf, n25q128_compare_t *pages)
+{
+    uint8_t chip[N25Q128_PAGE_SIZE];
+    uint32_t page = subsector * (N25Q128_SUBSECTOR_SIZE / N25Q128_PAGE_SIZE);
+
+    for (int i = 0; i < N25Q128_SUBSECTOR_SIZE / N25Q128_PAGE_SIZE; i++, page++) {
+        if (n25q128_read_page(ctx, page, chip) != HAL_OK)
+            return HAL_ERROR;
+        pages[i] = _n25q128_compare_page(chip, buf + i * N25Q128_PAGE_SIZE);
+    }
+
+    return HAL_OK;
+}
+
+/* Find out what writing this data would take, without writing anything.
+ * The result is the worst case over all the pages.
+ */
+HAL_StatusTypeDef n25q128_compare_data(struct spiflash_ctx *ctx, uint32_t offset, const uint8_t *buf, const uint32_t len, n25q128_compare_t *result)
+{
+    n25q128_compare_t pages[N25Q128_SUBSECTOR_SIZE / N25Q128_PAGE_SIZE];
+
+    if (offset % N25Q128_SUBSECTOR_SIZE != 0 || len % N25Q128_SUBSECTOR_SIZE != 0 ||
+        offset + len > N25Q128_NUM_BYTES || result == NULL)
+        return HAL_ERROR;
+
+    *result = N25Q128_SAME;
+
+    for (uint32_t n = 0; n < len; n += N25Q128_SUBSECTOR_SIZE) {
+        if (_n25q128_compare_subsector(ctx, (offset + n) / N25Q128_SUBSECTOR_SIZE, buf + n, pages) != HAL_OK)
+            return HAL_ERROR;
+        for (int i = 0; i < N25Q128_SUBSECTOR_SIZE / N25Q128_PAGE_SIZE; i++)
+            if (pages[i] > *result)
+                *result = pages[i];
+    }
+
+    return HAL_OK;
+}
+
+/* Write data without the caller having erased anything first. Each
+ * subsector is read back and compared with the new data: pages that already
+ * match are skipped, pages that only need bits cleared are programmed as
+ * they are, and only a subsector with a page that needs bits set is erased
+ * (after which its blank pages are skipped too). Rewriting a nearly
+ * identical image this way costs a read of the chip plus the differences,
+ * rather than an erase and program of everything.
+ */
+HAL_StatusTypeDef n25q128_update_data(struct spiflash_ctx *ctx, uint32_t offset, const uint8_t *buf, const uint32_t len, struct n25q128_update_stats *stats)
+{
+    n25q128_compare_t pages[N25Q128_SUBSECTOR_SIZE / N25Q128_PAGE_SIZE];
+
+    if (offset % N25Q128_SUBSECTOR_SIZE != 0 || len % N25Q128_SUBSECTOR_SIZE != 0 ||
+        offset + len > N25Q128_NUM_BYTES)
+        return HAL_ERROR;
+
+    for (uint32_t n = 0; n < len; n += N25Q128_SUBSECTOR_SIZE, buf += N25Q128_SUBSECTOR_SIZE) {
+        const uint32_t subsector = (offset + n) / N25Q128_SUBSECTOR_SIZE;
+        const uint32_t first = subsector * (N25Q128_SUBSECTOR_SIZE / N25Q128_PAGE_SIZE);
+        int erase = 0;
+
+        if (_n25q128_compare_subsector(ctx, subsector, buf, pages) != HAL_OK)
+            return HAL_ERROR;
+
+        for (int i = 0; i < N25Q128_SUBSECTOR_SIZE / N25Q128_PAGE_SIZE; i++)
+            if (pages[i] == N25Q128_ERASE)
+                erase = 1;
+
+        if (erase) {
+            if (n25q128_erase_subsector(ctx, subsector) != HAL_OK)
+                return HAL_ERROR;
+            if (stats != NULL)
+                stats->subsectors_erased++;
+        }
+
+        for (int i = 0; i < N25Q128_SUBSECTOR_SIZE / N25Q128_PAGE_SIZE; i++) {
+            const uint8_t *page = buf + i * N25Q128_PAGE_SIZE;
+            int skip = erase ? _n25q128_page_blank(page) : pages[i] == N25Q128_SAME;
+
+            if (skip) {
+                if (stats != NULL)
+                    stats->pages_skipped++;
+                continue;
+            }
+            if (n25q128_write_page(ctx, first + i, page) != HAL_OK)
+                return HAL_ERROR;
+            if (stats != NULL)
+                stats->pages_programmed++;
+        }
+    }
+
+    return HAL_OK;
+}
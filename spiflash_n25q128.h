@@ -41,6 +41,7 @@
 #include "stm32f4xx_hal.h"
 
 #define N25Q128_COMMAND_READ		0x03
+#define N25Q128_COMMAND_FAST_READ	0x0B
 #define N25Q128_COMMAND_READ_STATUS	0x05
 #define N25Q128_COMMAND_READ_ID		0x9E
 #define N25Q128_COMMAND_WRITE_ENABLE	0x06
@@ -60,17 +61,74 @@
 
 #define N25Q128_SPI_TIMEOUT		1000
 
+/* Timeouts (ms) for the erase commands to complete */
+#define N25Q128_ERASE_SUBSECTOR_TIMEOUT	1000
+#define N25Q128_ERASE_SECTOR_TIMEOUT	1000
+#define N25Q128_ERASE_BULK_TIMEOUT	60000
+
+/* READ is only specified up to this clock; above it, FAST READ is needed. */
+#define N25Q128_READ_MAX_HZ		54000000
+
+/* FAST READ takes this many dummy bytes after the address (8 dummy clock
+ * cycles, the power-on default of the volatile configuration register).
+ */
+#define N25Q128_FAST_READ_DUMMY_BYTES	1
+
 #define N25Q128_ID_MANUFACTURER		0x20
 #define N25Q128_ID_DEVICE_TYPE		0xBA
 #define N25Q128_ID_DEVICE_CAPACITY	0x18
 
+/* Transfers at least this long use DMA, if the SPI handle has DMA streams
+ * linked to it. Shorter ones aren't worth the setup and interrupt.
+ */
+#define N25Q128_DMA_THRESHOLD		64
+
+/* Read command to use for n25q128_read_data.
+ *
+ * The dual and quad output modes need DQ1..DQ3 wired to something that can
+ * sample them; on this board both flash chips hang off plain STM32 SPI
+ * peripherals (one MISO line), so only single-line modes are offered.
+ */
+typedef enum {
+    N25Q128_READ_NORMAL = 0,	/* READ (0x03), no dummy cycles */
+    N25Q128_READ_FAST,		/* FAST READ (0x0B), one dummy byte */
+} n25q128_read_mode_t;
+
 struct spiflash_ctx {
     SPI_HandleTypeDef *hspi;
     GPIO_TypeDef *cs_n_port;
     uint16_t cs_n_pin;
+
+    /* Read command, see n25q128_select_read_mode() */
+    n25q128_read_mode_t read_mode;
+
+    /* Use DMA for long transfers (needs DMA streams linked to hspi) */
+    int use_dma;
+
+    /* DMA transfer state, private to the driver */
+    volatile int dma_busy;
+    volatile HAL_StatusTypeDef dma_status;
+    void *dma_waiter;
+};
+
+/* How the data on the chip compares with data we'd like to write there */
+typedef enum {
+    N25Q128_SAME = 0,		/* the chip already holds the data */
+    N25Q128_PROGRAM,		/* it can be programmed, only clearing bits */
+    N25Q128_ERASE,		/* some bits have to go from 0 to 1 */
+} n25q128_compare_t;
+
+/* Running totals for n25q128_update_data(), zeroed by the caller */
+struct n25q128_update_stats {
+    uint32_t pages_skipped;	/* pages that already held the data */
+    uint32_t pages_programmed;
+    uint32_t subsectors_erased;
+    uint32_t sectors_erased;	/* by the caller, see fpgacfg_update_data() */
 };
 
 extern HAL_StatusTypeDef n25q128_check_id(struct spiflash_ctx *ctx);
+extern uint32_t n25q128_spi_clock(struct spiflash_ctx *ctx);
+extern void n25q128_select_read_mode(struct spiflash_ctx *ctx);
 extern HAL_StatusTypeDef n25q128_read_data(struct spiflash_ctx *ctx, uint32_t offset, uint8_t *buf, const uint32_t len);
 extern HAL_StatusTypeDef n25q128_write_page(struct spiflash_ctx *ctx, uint32_t page_offset, const uint8_t *page_buffer);
 extern HAL_StatusTypeDef n25q128_write_data(struct spiflash_ctx *ctx, uint32_t offset, const uint8_t *buf, const uint32_t len);
@@ -78,6 +136,21 @@ extern HAL_StatusTypeDef n25q128_erase_subsector(struct spiflash_ctx *ctx, uint3
 extern HAL_StatusTypeDef n25q128_erase_sector(struct spiflash_ctx *ctx, uint32_t sector_offset);
 extern HAL_StatusTypeDef n25q128_erase_bulk(struct spiflash_ctx *ctx);
 
+/* Compare-before-program: read back what's on the chip and only erase or
+ * program what has to change. Offset and length must be subsector-aligned.
+ */
+extern HAL_StatusTypeDef n25q128_compare_data(struct spiflash_ctx *ctx, uint32_t offset, const uint8_t *buf, const uint32_t len, n25q128_compare_t *result);
+extern HAL_StatusTypeDef n25q128_update_data(struct spiflash_ctx *ctx, uint32_t offset, const uint8_t *buf, const uint32_t len, struct n25q128_update_stats *stats);
+
+/* Asynchronous erase: start it, then poll (or wait) for completion.
+ * Nothing else may be done with the chip until the erase has finished.
+ */
+extern HAL_StatusTypeDef n25q128_erase_subsector_start(struct spiflash_ctx *ctx, uint32_t subsector_offset);
+extern HAL_StatusTypeDef n25q128_erase_sector_start(struct spiflash_ctx *ctx, uint32_t sector_offset);
+extern HAL_StatusTypeDef n25q128_erase_bulk_start(struct spiflash_ctx *ctx);
+extern HAL_StatusTypeDef n25q128_erase_poll(struct spiflash_ctx *ctx);
+extern HAL_StatusTypeDef n25q128_erase_wait(struct spiflash_ctx *ctx, uint32_t timeout);
+
 #define n25q128_read_page(ctx, page_offset, page_buffer) \
     n25q128_read_data(ctx, page_offset * N25Q128_PAGE_SIZE, page_buffer, N25Q128_PAGE_SIZE)
 #define n25q128_read_subsector(ctx, subsector_offset, subsector_buffer) \
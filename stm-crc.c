@@ -0,0 +1,115 @@
+/*
+ * stm-crc.c
+ * ---------
+ * CRC-32 using the STM32's CRC unit.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The F4's CRC unit computes CRC-32 (polynomial 0x04C11DB7) over 32-bit
+ * words, most significant bit first, starting from 0xFFFFFFFF after a
+ * reset. The CRC-32 everyone else uses is bit-reflected: each byte goes
+ * in least significant bit first. Reversing the bits of a little-endian
+ * word (RBIT, one instruction) puts its four bytes in that order, and
+ * reversing the bits of the result gives the reflected CRC.
+ *
+ * The unit can't be loaded with an initial value, so to carry on from
+ * a running CRC we reset it and write one word that takes it from
+ * 0xFFFFFFFF to that value: run the shift register backwards 32 steps
+ * from the value we want, which gives what it has to hold before the
+ * word is shifted in, and XOR in the 0xFFFFFFFF that's already there.
+ *
+ * A DMA stream can't do the bit reversal, so the CPU feeds the unit. At
+ * a few cycles a word, that's still several times faster than a table
+ * lookup per byte. Unaligned bytes at either end, and short buffers, are
+ * done in software.
+ */
+
+#include "stm-init.h"
+#include "stm-crc.h"
+
+#define CRC32_POLY              0x04C11DB7
+#define CRC32_POLY_REFLECTED    0xEDB88320
+
+/* Buffers shorter than this aren't worth setting up the unit for. */
+#define CRC32_HW_THRESHOLD      16
+
+static int crc_clock_enabled;
+
+static uint32_t crc32_byte(uint32_t crc, uint8_t b)
+{
+    crc ^= b;
+    for (int i = 0; i < 8; ++i)
+        crc = (crc >> 1) ^ (CRC32_POLY_REFLECTED & -(crc & 1));
+    return crc;
+}
+
+/* Run the unit's shift register backwards by 32 bits. This works
+ * because the polynomial's bottom bit is set: after a forward step, the
+ * bottom bit says whether the polynomial was XORed in.
+ */
+static uint32_t crc32_unshift(uint32_t r)
+{
+    for (int i = 0; i < 32; ++i)
+        r = (r & 1) ? ((r ^ CRC32_POLY) >> 1) | 0x80000000 : r >> 1;
+    return r;
+}
+
+uint32_t stm_crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    for (; len > 0 && ((uint32_t)p & 3) != 0; --len)
+        crc = crc32_byte(crc, *p++);
+
+    if (len >= CRC32_HW_THRESHOLD) {
+        if (!crc_clock_enabled) {
+            __HAL_RCC_CRC_CLK_ENABLE();
+            crc_clock_enabled = 1;
+        }
+
+        const uint32_t *w = (const uint32_t *)p;
+        const uint32_t *end = w + len / 4;
+
+        CRC->CR = CRC_CR_RESET;
+        CRC->DR = ~crc32_unshift(__RBIT(crc));
+        while (w < end)
+            CRC->DR = __RBIT(*w++);
+        crc = __RBIT(CRC->DR);
+
+        p = (const uint8_t *)w;
+        len %= 4;
+    }
+
+    for (; len > 0; --len)
+        crc = crc32_byte(crc, *p++);
+
+    return crc;
+}
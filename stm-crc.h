@@ -0,0 +1,62 @@
+/*
+ * stm-crc.h
+ * ---------
+ * CRC-32 using the STM32's CRC unit.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __STM32_CRC_H
+#define __STM32_CRC_H
+
+#include "stm32f4xx_hal.h"
+
+/* The same CRC-32 as libhal's hal_crc32_*() (and zlib's crc32(), and
+ * Python's binascii.crc32()), so the two can be used interchangeably:
+ *
+ *     crc = stm_crc32_init();
+ *     crc = stm_crc32_update(crc, buf, len);  (as often as needed)
+ *     crc = stm_crc32_finalize(crc);
+ *
+ * The CRC unit is shared, but each call runs to completion without
+ * yielding, so tasks can interleave calls with their own running CRCs.
+ */
+static inline uint32_t stm_crc32_init(void)
+{
+    return 0xFFFFFFFF;
+}
+
+static inline uint32_t stm_crc32_finalize(uint32_t crc)
+{
+    return ~crc;
+}
+
+extern uint32_t stm_crc32_update(uint32_t crc, const void *buf, size_t len);
+
+#endif /* __STM32_CRC_H */
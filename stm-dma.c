@@ -0,0 +1,303 @@
+/*
+ * stm-dma.c
+ * ---------
+ * Asynchronous memory-to-memory copies using DMA2.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Only DMA2 can do memory-to-memory transfers. We use DMA2 Stream1, which
+ * isn't mapped to any peripheral we use (USART1 RX is on DMA2 Stream2).
+ *
+ * The DMA is configured for 32-bit transfers through the FIFO, so the
+ * bulk of a copy must be word-aligned. When both buffers are 16-byte
+ * aligned, we also use 4-beat bursts, which can't cross a 1KB boundary
+ * at that alignment. The last (n % 16) bytes are copied by the CPU, so
+ * the DMA length is always a whole number of bursts.
+ *
+ * A transfer is limited to 65535 items, so larger copies are split into
+ * chunks, and each chunk is started from the completion interrupt of the
+ * previous one.
+ */
+
+#include <string.h>
+
+#include "stm-init.h"
+#include "stm-dma.h"
+#include "task.h"
+
+/* The bootloader and the board tests don't link with the tasker, so we
+ * refer to it weakly, and spin if it isn't there.
+ */
+#pragma weak task_get_tcb
+#pragma weak task_sleep_prepare
+#pragma weak task_sleep
+#pragma weak task_wake
+#pragma weak task_yield
+
+DMA_HandleTypeDef hdma_memcpy;
+
+/* Largest transfer, in words. This is a multiple of the burst size. */
+#define DMA_MEMCPY_MAX_WORDS    65532
+
+#define is_word_aligned(x)      (((uint32_t)(x) & 3) == 0)
+#define is_burst_aligned(x)     (((uint32_t)(x) & 15) == 0)
+
+/* The 64KB CCM RAM is only connected to the D-bus. */
+#define is_ccmram(x)            (((uint32_t)(x) & 0xFFFF0000) == 0x10000000)
+
+typedef enum {
+    DMA_MEMCPY_IDLE,            /* stream is free */
+    DMA_MEMCPY_BUSY,            /* transfer in progress */
+    DMA_MEMCPY_DONE             /* transfer finished, owner hasn't collected it */
+} dma_memcpy_state_t;
+
+static volatile dma_memcpy_state_t state = DMA_MEMCPY_IDLE;
+static volatile HAL_StatusTypeDef result;
+static tcb_t *owner;
+static uint32_t next_src, next_dst, words_left;
+static int initialized = 0;
+
+static inline tcb_t *current_task(void)
+{
+    return (task_get_tcb == NULL) ? NULL : task_get_tcb();
+}
+
+static HAL_StatusTypeDef start_chunk(void)
+{
+    uint32_t nwords = (words_left > DMA_MEMCPY_MAX_WORDS) ? DMA_MEMCPY_MAX_WORDS : words_left;
+    uint32_t src = next_src, dst = next_dst;
+
+    words_left -= nwords;
+    next_src += nwords * 4;
+    next_dst += nwords * 4;
+
+    /* The HAL accumulates errors, and never clears them. */
+    hdma_memcpy.ErrorCode = HAL_DMA_ERROR_NONE;
+
+    return HAL_DMA_Start_IT(&hdma_memcpy, src, dst, nwords);
+}
+
+static void finish(HAL_StatusTypeDef status)
+{
+    result = status;
+    state = DMA_MEMCPY_DONE;
+    if (owner != NULL)
+        task_wake(owner);
+}
+
+static void dma_memcpy_cplt_callback(DMA_HandleTypeDef *hdma)
+{
+    hdma = hdma;
+
+    if (words_left == 0)
+        finish(HAL_OK);
+    else if (start_chunk() != HAL_OK)
+        finish(HAL_ERROR);
+}
+
+static void dma_memcpy_error_callback(DMA_HandleTypeDef *hdma)
+{
+    /* A FIFO error on a memory-to-memory stream just means the FIFO
+     * under- or overran briefly; the transfer carries on, and we'll get
+     * a transfer-complete interrupt. A transfer error disables the stream.
+     */
+    if ((hdma->ErrorCode & ~HAL_DMA_ERROR_FE) == 0)
+        return;
+
+    finish(HAL_ERROR);
+}
+
+static HAL_StatusTypeDef dma_memcpy_init(uint32_t burst)
+{
+    if (initialized && hdma_memcpy.Init.MemBurst == burst)
+        return HAL_OK;
+
+    if (!initialized) {
+        __HAL_RCC_DMA2_CLK_ENABLE();
+        HAL_NVIC_SetPriority(DMA2_Stream1_IRQn, 0, 0);
+        HAL_NVIC_EnableIRQ(DMA2_Stream1_IRQn);
+    }
+
+    hdma_memcpy.Instance = DMA2_Stream1;
+    hdma_memcpy.Init.Channel = DMA_CHANNEL_0;
+    hdma_memcpy.Init.Direction = DMA_MEMORY_TO_MEMORY;
+    hdma_memcpy.Init.PeriphInc = DMA_PINC_ENABLE;
+    hdma_memcpy.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_memcpy.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    hdma_memcpy.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    hdma_memcpy.Init.Mode = DMA_NORMAL;
+    hdma_memcpy.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_memcpy.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+    hdma_memcpy.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+    hdma_memcpy.Init.MemBurst = burst;
+    hdma_memcpy.Init.PeriphBurst = (burst == DMA_MBURST_INC4) ? DMA_PBURST_INC4 : DMA_PBURST_SINGLE;
+
+    if (HAL_DMA_Init(&hdma_memcpy) != HAL_OK)
+        return HAL_ERROR;
+
+    hdma_memcpy.XferCpltCallback = dma_memcpy_cplt_callback;
+    hdma_memcpy.XferErrorCallback = dma_memcpy_error_callback;
+    initialized = 1;
+
+    return HAL_OK;
+}
+
+/* Claim the stream and start copying nwords words. */
+static HAL_StatusTypeDef dma_start(uint32_t dst, uint32_t src, size_t nwords, uint32_t burst)
+{
+    tcb_t *self = current_task();
+
+    /* Claim the stream. If it's ours, collect the previous copy. */
+    if (state != DMA_MEMCPY_IDLE && owner == self)
+        (void)dma_memcpy_wait();
+    while (state != DMA_MEMCPY_IDLE) {
+        if (self != NULL)
+            task_yield();
+    }
+    state = DMA_MEMCPY_BUSY;
+    owner = self;
+
+    if (dma_memcpy_init(burst) != HAL_OK) {
+        state = DMA_MEMCPY_IDLE;
+        owner = NULL;
+        return HAL_ERROR;
+    }
+
+    next_src = src;
+    next_dst = dst;
+    words_left = nwords;
+
+    if (start_chunk() != HAL_OK) {
+        state = DMA_MEMCPY_IDLE;
+        owner = NULL;
+        return HAL_ERROR;
+    }
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef dma_memcpy_start(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+
+    if (n < DMA_MEMCPY_THRESHOLD ||
+        !is_word_aligned(d) || !is_word_aligned(s) ||
+        is_ccmram(d) || is_ccmram(s)) {
+        memcpy(d, s, n);
+        return HAL_OK;
+    }
+
+    uint32_t burst = (is_burst_aligned(d) && is_burst_aligned(s)) ? DMA_MBURST_INC4 : DMA_MBURST_SINGLE;
+
+    /* The DMA length is always a whole number of bursts. */
+    size_t tail = n & 15;
+    n -= tail;
+
+    if (dma_start((uint32_t)d, (uint32_t)s, n / 4, burst) != HAL_OK)
+        return HAL_ERROR;
+
+    /* Copy the odd bytes at the end while the DMA does the rest. */
+    memcpy(d + n, s + n, tail);
+
+    return HAL_OK;
+}
+
+/* Copy whole words for device memory (the FPGA on the FMC bus), where
+ * every access has to be a single 32-bit read or write: no bursts, and no
+ * byte-sized tail. This spins until the copy is done: an FMC block takes
+ * microseconds, less than a trip through the tasker, and it's usually made
+ * in the middle of an RPC, where the dispatch task shouldn't sleep.
+ */
+HAL_StatusTypeDef dma_memcpy_words(volatile void *dst, const volatile void *src, size_t nwords)
+{
+    volatile uint32_t *d = (volatile uint32_t *)dst;
+    const volatile uint32_t *s = (const volatile uint32_t *)src;
+
+    if (!is_word_aligned(d) || !is_word_aligned(s))
+        return HAL_ERROR;
+
+    if (nwords == 0)
+        return HAL_OK;
+
+    if (is_ccmram(d) || is_ccmram(s)) {
+        while (nwords-- > 0)
+            *d++ = *s++;
+        return HAL_OK;
+    }
+
+    if (dma_start((uint32_t)d, (uint32_t)s, nwords, DMA_MBURST_SINGLE) != HAL_OK)
+        return HAL_ERROR;
+
+    while (state == DMA_MEMCPY_BUSY)
+        ;
+
+    return dma_memcpy_wait();
+}
+
+HAL_StatusTypeDef dma_memcpy_wait(void)
+{
+    tcb_t *self = current_task();
+
+    /* Nothing in progress for this task (including CPU copies). */
+    if (state == DMA_MEMCPY_IDLE || owner != self)
+        return HAL_OK;
+
+    if (self != NULL)
+        task_sleep_prepare();
+    while (state == DMA_MEMCPY_BUSY) {
+        if (self != NULL) {
+            task_sleep();
+            task_sleep_prepare();
+        }
+    }
+
+    HAL_StatusTypeDef status = result;
+    owner = NULL;
+    state = DMA_MEMCPY_IDLE;
+
+    return status;
+}
+
+int dma_memcpy_busy(void)
+{
+    return (state == DMA_MEMCPY_BUSY && owner == current_task());
+}
+
+HAL_StatusTypeDef dma_memcpy(void *dst, const void *src, size_t n)
+{
+    HAL_StatusTypeDef status;
+
+    if ((status = dma_memcpy_start(dst, src, n)) != HAL_OK)
+        return status;
+
+    return dma_memcpy_wait();
+}
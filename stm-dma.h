@@ -0,0 +1,83 @@
+/*
+ * stm-dma.h
+ * ---------
+ * Asynchronous memory-to-memory copies using DMA2.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __STM32_DMA_H
+#define __STM32_DMA_H
+
+#include "stm-init.h"
+
+/* Copies shorter than this are done by the CPU, because setting up the
+ * DMA stream, taking the completion interrupt and switching tasks would
+ * cost more than the copy itself.
+ */
+#ifndef DMA_MEMCPY_THRESHOLD
+#define DMA_MEMCPY_THRESHOLD 512
+#endif
+
+/* Start copying n bytes from src to dst, and return without waiting for
+ * the copy to finish. The caller must not touch either buffer until
+ * dma_memcpy_wait() returns. Buffers must not overlap.
+ *
+ * There is only one DMA memcpy stream. If another task is using it, we
+ * yield until it's free. If the current task already has a copy in
+ * progress, we wait for that to finish first.
+ *
+ * Short copies, copies involving CCM RAM (which isn't reachable by DMA),
+ * and copies that aren't word-aligned are done immediately by the CPU.
+ */
+extern HAL_StatusTypeDef dma_memcpy_start(void *dst, const void *src, size_t n);
+
+/* Wait for the current task's copy to finish. If the tasker is running,
+ * the task sleeps until the DMA completion interrupt wakes it; otherwise
+ * we spin.
+ */
+extern HAL_StatusTypeDef dma_memcpy_wait(void);
+
+/* Return non-zero if the current task's copy is still in progress. */
+extern int dma_memcpy_busy(void);
+
+/* Synchronous version: start and wait. */
+extern HAL_StatusTypeDef dma_memcpy(void *dst, const void *src, size_t n);
+
+/* Copy nwords 32-bit words, one single-beat transfer at a time, as device
+ * memory like the FPGA's FMC window needs. Both addresses must be
+ * word-aligned. Synchronous, but the task sleeps while the DMA runs.
+ */
+extern HAL_StatusTypeDef dma_memcpy_words(volatile void *dst, const volatile void *src, size_t nwords);
+
+/* This is only exposed because it's used in the DMA IRQ handler code.
+ * Pretend you never saw it.
+ */
+extern DMA_HandleTypeDef hdma_memcpy;
+
+#endif /* __STM32_DMA_H */
@@ -109,13 +109,31 @@ HAL_StatusTypeDef stm_flash_erase_sectors(const uint32_t start_offset, const uin
     return HAL_OK;
 }
 
+/* Is a flash sector erased already? It's memory-mapped, so checking is a
+ * lot cheaper than erasing it again.
+ */
+static int stm_flash_sector_blank(uint32_t sector)
+{
+    const uint32_t *p = (const uint32_t *) flash_sector_offsets[sector];
+    const uint32_t *end = (const uint32_t *) flash_sector_offsets[sector + 1];
+
+    while (p < end)
+        if (*p++ != 0xFFFFFFFF)
+            return 0;
+
+    return 1;
+}
+
 HAL_StatusTypeDef stm_flash_write32(uint32_t offset, const uint32_t *buf, const size_t elements)
 {
     uint32_t sector = stm_flash_sector_num(offset);
     size_t i;
     HAL_StatusTypeDef err = HAL_OK;
 
-    if (offset == flash_sector_offsets[sector]) {
+    if (sector >= FLASH_NUM_SECTORS)
+        return HAL_ERROR;
+
+    if (offset == flash_sector_offsets[sector] && !stm_flash_sector_blank(sector)) {
 	/* Request to write to beginning of a flash sector, erase it first. */
 	if (stm_flash_erase_sectors(offset, offset) != 0) {
 	    return HAL_ERROR;
@@ -125,7 +143,11 @@ HAL_StatusTypeDef stm_flash_write32(uint32_t offset, const uint32_t *buf, const
     HAL_FLASH_Unlock();
 
     for (i = 0; i < elements; i++) {
-	if ((err = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, offset, buf[i])) != HAL_OK) {
+	/* Don't program words that already hold the value (blank padding,
+	 * mostly), it only costs time.
+	 */
+	if (*(volatile const uint32_t *) offset != buf[i] &&
+	    (err = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, offset, buf[i])) != HAL_OK) {
 	    break;
 	}
 	offset += 4;
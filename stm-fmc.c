@@ -33,9 +33,16 @@
  */
 #include "stm-init.h"
 #include "stm-fmc.h"
+#include "stm-dma.h"
 
 
 static SRAM_HandleTypeDef _fmc_fpga_inst;
+static FMC_NORSRAM_TimingTypeDef fmc_timing;
+static struct fmc_mode fmc_mode;
+static uint32_t fmc_reference[FMC_BOARD_ID_WORDS];
+
+static void fmc_settle(void);
+static void fmc_set_timing(uint32_t clk_division, uint32_t data_latency);
 
 void fmc_init(void)
 {
@@ -135,11 +142,32 @@ void fmc_init(void)
     // keep clock always active
     _fmc_fpga_inst.Init.ContinuousClock = FMC_CONTINUOUS_CLOCK_SYNC_ASYNC;
 
-    /*
-     * configure fmc timing parameters
-     */
-    FMC_NORSRAM_TimingTypeDef fmc_timing;
+    // initialize fmc, at the safe clock until fmc_calibrate() says otherwise
+    fmc_set_timing(FMC_CLK_DIVISION_SAFE, FMC_DATA_LATENCY_SAFE);
+    HAL_SRAM_Init(&_fmc_fpga_inst, &fmc_timing, NULL);
+
+    fmc_settle();
+}
 
+static void fmc_settle(void)
+{
+    // STM32 only enables FMC clock right before the very first read/write
+    // access. FPGA takes certain time (<= 100 us) to lock its PLL to this frequency,
+    // so a certain number of initial FMC transactions may be missed. One read transaction
+    // takes ~0.1 us (9 ticks @ 90 MHz), so doing 1000 dummy reads will make sure, that FPGA
+    // has already locked its PLL and is ready. Another way around is to repeatedly read
+    // some register that is guaranteed to have known value until reading starts returning
+    // correct data.
+    //
+    // The same goes for every change of FMC_CLK, see fmc_calibrate().
+
+    // The reads are volatile, so the compiler can't optimize them away.
+    for (int cyc = 0; cyc < 1000; cyc++)
+        (void) *(__IO uint32_t *)FMC_FPGA_BASE_ADDR;
+}
+
+static void fmc_set_timing(uint32_t clk_division, uint32_t data_latency)
+{
     // don't care in sync mode
     fmc_timing.AddressSetupTime = 15;
 
@@ -152,8 +180,6 @@ void fmc_init(void)
     // not needed, since nwait will be polled manually
     fmc_timing.BusTurnAroundDuration = 0;
 
-    // use smallest allowed divisor for best performance
-    //
     // FMC_CLK = HCLK / CLKDivision, HCLK is 180 MHz
     //
     // Allowed values for CLKDivision are integers >= 2.
@@ -162,34 +188,197 @@ void fmc_init(void)
     // Division == 3: FMC_CLK = 180 / 3 = 60 MHz (one step below)
     // ...
     //
+    // 60 MHz always works; 90 MHz depends on the board and the bitstream,
+    // so fmc_calibrate() has to try it against the FPGA.
+    fmc_timing.CLKDivision = clk_division;
 
-//  fmc_timing.CLKDivision = 2;     // 90 MHz
-    fmc_timing.CLKDivision = 3;     // 60 MHz
-
-    // use min suitable for fastest transfer
-    fmc_timing.DataLatency = 4;
+    // FMC_CLK cycles from address to data, fixed by the FPGA's interface
+    fmc_timing.DataLatency = data_latency;
 
     // don't care in sync mode
     fmc_timing.AccessMode = FMC_ACCESS_MODE_A;
 
-    // initialize fmc
-    HAL_SRAM_Init(&_fmc_fpga_inst, &fmc_timing, NULL);
-		
-    // STM32 only enables FMC clock right before the very first read/write
-    // access. FPGA takes certain time (<= 100 us) to lock its PLL to this frequency,
-    // so a certain number of initial FMC transactions may be missed. One read transaction
-    // takes ~0.1 us (9 ticks @ 90 MHz), so doing 1000 dummy reads will make sure, that FPGA
-    // has already locked its PLL and is ready. Another way around is to repeatedly read
-    // some register that is guaranteed to have known value until reading starts returning
-    // correct data.
-		
-    // to prevent compiler from optimizing this away, we pretent we're calculating sum
-    int cyc;
-    uint32_t sum;
-    volatile uint32_t part;
-
-    for (cyc = 0; cyc < 1000; cyc++) {
-      part = *(__IO uint32_t *)FMC_FPGA_BASE_ADDR;
-      sum += part;
+    fmc_mode.clk_division = clk_division;
+    fmc_mode.data_latency = data_latency;
+}
+
+/* Switch FMC timing with the bank enabled, then wait for the FPGA's PLL to
+ * catch up.
+ */
+static void fmc_switch_timing(uint32_t clk_division, uint32_t data_latency)
+{
+    fmc_set_timing(clk_division, data_latency);
+    FMC_NORSRAM_Timing_Init(_fmc_fpga_inst.Instance, &fmc_timing, _fmc_fpga_inst.Init.NSBank);
+    fmc_settle();
+}
+
+static inline uint32_t fmc_read(uint32_t addr)
+{
+    uint32_t data;
+    fmc_read_32(addr, &data);
+    return data;
+}
+
+/* Are the board registers readable (and the scratch register writable) at
+ * the current FMC timing? The reference values were read at the safe clock.
+ */
+static int fmc_validate(void)
+{
+    static const uint32_t patterns[] = {
+        0x00000000, 0xFFFFFFFF, 0xAAAAAAAA, 0x55555555,
+        0x0F0F0F0F, 0xF0F0F0F0, 0x01234567, 0xFEDCBA98,
+    };
+
+    for (int round = 0; round < FMC_CALIBRATE_ROUNDS; round++) {
+        for (int i = 0; i < FMC_BOARD_ID_WORDS; i++)
+            if (fmc_read(FMC_BOARD_ADDR_NAME0 + 4 * i) != fmc_reference[i])
+                return 0;
+
+        /* walking ones, then some patterns that flip lots of bits at once */
+        uint32_t data = (round < 32) ? (1UL << round) :
+            patterns[round % (sizeof(patterns) / sizeof(*patterns))] ^ (uint32_t) round;
+
+        fmc_write_32(FMC_BOARD_ADDR_SCRATCH, data);
+        if (fmc_read(FMC_BOARD_ADDR_SCRATCH) != data)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Read the board core's name and version at the safe clock, and check
+ * that the scratch register works. Without a bitstream loaded, there's
+ * nothing to calibrate against.
+ */
+static int fmc_read_reference(void)
+{
+    for (int i = 0; i < FMC_BOARD_ID_WORDS; i++)
+        fmc_reference[i] = fmc_read(FMC_BOARD_ADDR_NAME0 + 4 * i);
+
+    if (fmc_reference[0] == 0x00000000 || fmc_reference[0] == 0xFFFFFFFF)
+        return 0;
+
+    return fmc_validate();
+}
+
+/* Find the fastest FMC timing that works with the FPGA as it is now:
+ * 90 MHz with the smallest data latency that passes fmc_validate(), or the
+ * safe 60 MHz if none does. The FPGA has to have loaded its bitstream, and
+ * nothing else may touch it while this runs.
+ */
+HAL_StatusTypeDef fmc_calibrate(void)
+{
+    HAL_StatusTypeDef status = HAL_ERROR;
+
+    fmc_switch_timing(FMC_CLK_DIVISION_SAFE, FMC_DATA_LATENCY_SAFE);
+    fmc_mode.calibrated = 0;
+
+    if (!fmc_read_reference())
+        return HAL_ERROR;
+
+    uint32_t scratch = fmc_read(FMC_BOARD_ADDR_SCRATCH);
+
+    for (uint32_t latency = FMC_DATA_LATENCY_MIN; latency <= FMC_DATA_LATENCY_MAX; latency++) {
+        fmc_switch_timing(FMC_CLK_DIVISION_FAST, latency);
+        if (fmc_validate()) {
+            status = HAL_OK;
+            break;
+        }
     }
+
+    if (status != HAL_OK)
+        fmc_switch_timing(FMC_CLK_DIVISION_SAFE, FMC_DATA_LATENCY_SAFE);
+
+    fmc_write_32(FMC_BOARD_ADDR_SCRATCH, scratch);
+    fmc_mode.calibrated = 1;
+    return status;
+}
+
+/* Check that the FMC timing still works, and drop back to the safe clock
+ * if it doesn't (say, after a bitstream with slower timing was loaded).
+ * Returns HAL_ERROR if it fell back.
+ */
+HAL_StatusTypeDef fmc_check(void)
+{
+    if (!fmc_mode.calibrated || fmc_mode.clk_division == FMC_CLK_DIVISION_SAFE)
+        return HAL_OK;
+
+    uint32_t scratch = fmc_read(FMC_BOARD_ADDR_SCRATCH);
+    int ok = fmc_validate();
+    if (ok) {
+        fmc_write_32(FMC_BOARD_ADDR_SCRATCH, scratch);
+        return HAL_OK;
+    }
+
+    fmc_switch_timing(FMC_CLK_DIVISION_SAFE, FMC_DATA_LATENCY_SAFE);
+    fmc_write_32(FMC_BOARD_ADDR_SCRATCH, scratch);
+    ++fmc_mode.fallbacks;
+    return HAL_ERROR;
+}
+
+void fmc_get_mode(struct fmc_mode *mode)
+{
+    *mode = fmc_mode;
+}
+
+/* Switch to the given timing without checking that it works, for test
+ * programs that want to compare settings. fmc_calibrate() puts things
+ * right afterwards.
+ */
+void fmc_set_mode(uint32_t clk_division, uint32_t data_latency)
+{
+    fmc_switch_timing(clk_division, data_latency);
+    fmc_mode.calibrated = 0;
+}
+
+/* The block has to fit in the FPGA's address window, without wrapping. */
+static inline int fmc_block_ok(uint32_t addr, size_t nwords)
+{
+    return (addr & 3) == 0 && addr <= FMC_FPGA_ADDR_MASK &&
+        nwords <= (FMC_FPGA_ADDR_MASK - addr) / 4 + 1;
+}
+
+HAL_StatusTypeDef fmc_write_block(uint32_t addr, const uint32_t *buf, size_t nwords)
+{
+    if (!fmc_block_ok(addr, nwords))
+        return HAL_ERROR;
+
+    __IO uint32_t *p = (__IO uint32_t *)fmc_fpga_addr(addr);
+
+    if (nwords >= FMC_DMA_THRESHOLD)
+        return dma_memcpy_words(p, buf, nwords);
+
+    /* Unrolled, so the bus sees back-to-back writes. */
+    for (; nwords >= 4; nwords -= 4, p += 4, buf += 4) {
+        p[0] = buf[0];
+        p[1] = buf[1];
+        p[2] = buf[2];
+        p[3] = buf[3];
+    }
+    while (nwords-- > 0)
+        *p++ = *buf++;
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef fmc_read_block(uint32_t addr, uint32_t *buf, size_t nwords)
+{
+    if (!fmc_block_ok(addr, nwords))
+        return HAL_ERROR;
+
+    __IO uint32_t *p = (__IO uint32_t *)fmc_fpga_addr(addr);
+
+    if (nwords >= FMC_DMA_THRESHOLD)
+        return dma_memcpy_words(buf, p, nwords);
+
+    for (; nwords >= 4; nwords -= 4, p += 4, buf += 4) {
+        buf[0] = p[0];
+        buf[1] = p[1];
+        buf[2] = p[2];
+        buf[3] = p[3];
+    }
+    while (nwords-- > 0)
+        *buf++ = *p++;
+
+    return HAL_OK;
 }
@@ -49,12 +49,63 @@
     __HAL_RCC_##port##_CLK_ENABLE();		       \
     HAL_GPIO_Init(port, &GPIO_InitStruct)
 
+/* FMC_CLK = HCLK / division. The safe setting is what the FPGA has always
+ * been run at; the fast one has to pass fmc_calibrate() first.
+ */
+#define FMC_CLK_DIVISION_SAFE           3   // 60 MHz
+#define FMC_DATA_LATENCY_SAFE           4
+#define FMC_CLK_DIVISION_FAST           2   // 90 MHz
+#define FMC_DATA_LATENCY_MIN            2   // data latencies to try at 90 MHz
+#define FMC_DATA_LATENCY_MAX            6
+
+/* Calibration talks to the board registers core at the bottom of the FPGA
+ * address space: its name and version words are compared with what was
+ * read at the safe clock, and its general-purpose register is written and
+ * read back with a set of bit patterns.
+ */
+#define FMC_BOARD_ADDR_NAME0            0x000
+#define FMC_BOARD_ID_WORDS              3   // name0, name1, version
+#define FMC_BOARD_ADDR_SCRATCH          0x3FC
+#define FMC_CALIBRATE_ROUNDS            64
+
+struct fmc_mode {
+    uint32_t clk_division;
+    uint32_t data_latency;
+    int calibrated;             /* fmc_calibrate() has picked this */
+    uint32_t fallbacks;         /* times fmc_check() dropped to the safe clock */
+};
 
 extern void fmc_init(void);
+extern HAL_StatusTypeDef fmc_calibrate(void);
+extern HAL_StatusTypeDef fmc_check(void);
+extern void fmc_get_mode(struct fmc_mode *mode);
+extern void fmc_set_mode(uint32_t clk_division, uint32_t data_latency);
 
 static inline void *fmc_fpga_addr(off_t addr)
 {
     return (void *)(FMC_FPGA_BASE_ADDR + (addr & FMC_FPGA_ADDR_MASK));
 }
 
+static inline void fmc_write_32(uint32_t addr, uint32_t data)
+{
+    *(__IO uint32_t *)fmc_fpga_addr(addr) = data;
+}
+
+static inline void fmc_read_32(uint32_t addr, uint32_t *data)
+{
+    *data = *(__IO uint32_t *)fmc_fpga_addr(addr);
+}
+
+/* Block transfers to and from consecutive FPGA registers, such as a core's
+ * operand memory. Words go over the bus as they are, with no byte swapping.
+ * Blocks of at least FMC_DMA_THRESHOLD words go by DMA, and the calling
+ * task sleeps until they're done; shorter ones are copied by the CPU.
+ */
+#ifndef FMC_DMA_THRESHOLD
+#define FMC_DMA_THRESHOLD               128
+#endif
+
+extern HAL_StatusTypeDef fmc_write_block(uint32_t addr, const uint32_t *buf, size_t nwords);
+extern HAL_StatusTypeDef fmc_read_block(uint32_t addr, uint32_t *buf, size_t nwords);
+
 #endif /* __STM_FMC_H */
@@ -37,8 +37,15 @@
 #include "stm-init.h"
 
 static SPI_HandleTypeDef hspi_fpgacfg;
+static DMA_HandleTypeDef hdma_fpgacfg_rx;
+static DMA_HandleTypeDef hdma_fpgacfg_tx;
 
-static struct spiflash_ctx fpgacfg_ctx = {&hspi_fpgacfg, PROM_CS_N_GPIO_Port, PROM_CS_N_Pin};
+static struct spiflash_ctx fpgacfg_ctx = {
+    .hspi = &hspi_fpgacfg,
+    .cs_n_port = PROM_CS_N_GPIO_Port,
+    .cs_n_pin = PROM_CS_N_Pin,
+    .use_dma = 1
+};
 
 void fpgacfg_init(void)
 {
@@ -65,7 +72,22 @@ void fpgacfg_init(void)
     hspi_fpgacfg.Init.TIMode = SPI_TIMODE_DISABLE;
     hspi_fpgacfg.Init.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
     hspi_fpgacfg.Init.CRCPolynomial = 10;
+    __HAL_LINKDMA(&hspi_fpgacfg, hdmarx, hdma_fpgacfg_rx);
+    __HAL_LINKDMA(&hspi_fpgacfg, hdmatx, hdma_fpgacfg_tx);
     HAL_SPI_Init(&hspi_fpgacfg);
+    n25q128_select_read_mode(&fpgacfg_ctx);
+}
+
+/* The SPI2 DMA streams are configured in HAL_SPI_MspInit(). */
+
+void DMA1_Stream3_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_fpgacfg_rx);
+}
+
+void DMA1_Stream4_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_fpgacfg_tx);
 }
 
 HAL_StatusTypeDef fpgacfg_check_id(void)
@@ -78,6 +100,32 @@ HAL_StatusTypeDef fpgacfg_write_data(uint32_t offset, const uint8_t *buf, const
     return n25q128_write_data(&fpgacfg_ctx, offset, buf, len);
 }
 
+/* Write part of a bitstream without erasing it first, skipping whatever
+ * already matches (see n25q128_update_data()). The data should arrive in
+ * order, a subsector at a time. If the first subsector of a sector has to
+ * be erased, the new bitstream probably has little in common with the old
+ * one, so the whole sector is erased in one go, which is much faster than
+ * erasing its subsectors one at a time.
+ */
+HAL_StatusTypeDef fpgacfg_update_data(uint32_t offset, const uint8_t *buf, const uint32_t len, struct n25q128_update_stats *stats)
+{
+    if (offset % FPGACFG_SECTOR_SIZE == 0 && len > 0) {
+        n25q128_compare_t result;
+
+        if (n25q128_compare_data(&fpgacfg_ctx, offset, buf, N25Q128_SUBSECTOR_SIZE, &result) != HAL_OK)
+            return HAL_ERROR;
+
+        if (result == N25Q128_ERASE) {
+            if (n25q128_erase_sector(&fpgacfg_ctx, offset / FPGACFG_SECTOR_SIZE) != HAL_OK)
+                return HAL_ERROR;
+            if (stats != NULL)
+                stats->sectors_erased++;
+        }
+    }
+
+    return n25q128_update_data(&fpgacfg_ctx, offset, buf, len, stats);
+}
+
 void fpgacfg_access_control(enum fpgacfg_access_ctrl access)
 {
     if (access == ALLOW_ARM) {
@@ -122,3 +170,33 @@ HAL_StatusTypeDef fpgacfg_erase_sector(uint32_t sector_offset)
 {
     return n25q128_erase_sector(&fpgacfg_ctx, sector_offset);
 }
+
+#ifdef DO_FPGA_IRQ
+static void (*fpgacfg_irq_callback)(void);
+
+void fpgacfg_irq_init(void (*callback)(void))
+{
+    GPIO_InitTypeDef GPIO_InitStruct;
+
+    fpgacfg_irq_callback = callback;
+
+    /* The port clock is already on, see FPGACFG_GPIO_INIT(). */
+    GPIO_InitStruct.Pin = FPGA_IRQ_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING;
+    GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+    HAL_GPIO_Init(FPGA_IRQ_Port, &GPIO_InitStruct);
+
+    HAL_NVIC_SetPriority(FPGA_IRQ_EXTI_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(FPGA_IRQ_EXTI_IRQn);
+}
+
+void FPGA_IRQ_EXTI_IRQHandler(void)
+{
+    if (__HAL_GPIO_EXTI_GET_IT(FPGA_IRQ_Pin) != RESET) {
+        __HAL_GPIO_EXTI_CLEAR_IT(FPGA_IRQ_Pin);
+        if (fpgacfg_irq_callback != NULL)
+            fpgacfg_irq_callback();
+    }
+}
+#endif /* DO_FPGA_IRQ */
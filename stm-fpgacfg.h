@@ -57,6 +57,16 @@
 #define FPGA_DONE_Port                 GPIOJ
 #define FPGA_DONE_Pin                  GPIO_PIN_15
 
+/* Spare FPGA-to-STM32 line that a bitstream can raise when a core finishes
+ * (see DO_FPGA_IRQ). Override these if the bitstream uses a different one.
+ */
+#ifndef FPGA_IRQ_Port
+#define FPGA_IRQ_Port                  GPIOJ
+#define FPGA_IRQ_Pin                   GPIO_PIN_14
+#define FPGA_IRQ_EXTI_IRQn             EXTI15_10_IRQn
+#define FPGA_IRQ_EXTI_IRQHandler       EXTI15_10_IRQHandler
+#endif
+
 #define FPGACFG_GPIO_INIT()		\
     __GPIOI_CLK_ENABLE();		\
     __GPIOF_CLK_ENABLE();		\
@@ -88,11 +98,14 @@ enum fpgacfg_reset {
 extern void fpgacfg_init(void);
 extern HAL_StatusTypeDef fpgacfg_check_id(void);
 extern HAL_StatusTypeDef fpgacfg_write_data(uint32_t offset, const uint8_t *buf, const uint32_t len);
+extern HAL_StatusTypeDef fpgacfg_update_data(uint32_t offset, const uint8_t *buf, const uint32_t len, struct n25q128_update_stats *stats);
 extern HAL_StatusTypeDef fpgacfg_erase_sector(uint32_t sector_offset);
 extern void fpgacfg_access_control(enum fpgacfg_access_ctrl access);
 /* Reset the FPGA */
 extern void fpgacfg_reset_fpga(enum fpgacfg_reset reset);
 /* Check status of FPGA bitstream loading */
 extern HAL_StatusTypeDef fpgacfg_check_done(void);
+/* Call back (from the interrupt handler) on each rising edge of FPGA_IRQ */
+extern void fpgacfg_irq_init(void (*callback)(void));
 
 #endif /* __STM32_FPGACFG_H */
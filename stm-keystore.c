@@ -32,12 +32,22 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stddef.h>
+#include <string.h>
+
 #include "stm-init.h"
 #include "stm-keystore.h"
 
 static SPI_HandleTypeDef hspi_keystore;
+static DMA_HandleTypeDef hdma_keystore_rx;
+static DMA_HandleTypeDef hdma_keystore_tx;
 
-struct spiflash_ctx keystore_ctx = {&hspi_keystore, KSM_PROM_CS_N_GPIO_Port, KSM_PROM_CS_N_Pin};
+struct spiflash_ctx keystore_ctx = {
+    .hspi = &hspi_keystore,
+    .cs_n_port = KSM_PROM_CS_N_GPIO_Port,
+    .cs_n_pin = KSM_PROM_CS_N_Pin,
+    .use_dma = 1
+};
 
 /* SPI1 (keystore memory) init function */
 void keystore_init(void)
@@ -59,7 +69,22 @@ void keystore_init(void)
     hspi_keystore.Init.TIMode = SPI_TIMODE_DISABLE;
     hspi_keystore.Init.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
     hspi_keystore.Init.CRCPolynomial = 10;
+    __HAL_LINKDMA(&hspi_keystore, hdmarx, hdma_keystore_rx);
+    __HAL_LINKDMA(&hspi_keystore, hdmatx, hdma_keystore_tx);
     HAL_SPI_Init(&hspi_keystore);
+    n25q128_select_read_mode(&keystore_ctx);
+}
+
+/* The SPI1 DMA streams are configured in HAL_SPI_MspInit(). */
+
+void DMA2_Stream0_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_keystore_rx);
+}
+
+void DMA2_Stream3_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_keystore_tx);
 }
 
 HAL_StatusTypeDef keystore_check_id(void)
@@ -67,27 +92,1122 @@ HAL_StatusTypeDef keystore_check_id(void)
     return n25q128_check_id(&keystore_ctx);
 }
 
+/* Caches.
+ *
+ * Two caches can sit between libhal and the chip, each switched on by
+ * handing it a buffer (the HSM puts both in SDRAM). Without them, every
+ * call goes straight to the chip, as it does in the bootloader.
+ *
+ * The read cache holds whole subsectors as they are on the chip, and
+ * replaces the least recently used one on a miss. libhal tends to read the
+ * same blocks over and over (e.g. a pkey_match scan followed by pkey_open
+ * on the keys it found), and a hit costs a memcpy instead of an SPI
+ * transfer. Programs are ANDed into cached subsectors; erases drop them.
+ *
+ * The write-back cache collects page programs. libhal's flash keystore
+ * programs the same pages over and over (block headers, the PIN block,
+ * the index), and every page program costs the better part of a
+ * millisecond. Pending programs are written out when they've been waiting
+ * a while, when the cache fills up, or on keystore_sync().
+ *
+ * Programming can only clear bits, so a pending page is kept as an AND
+ * mask: it starts out all ones, each write is ANDed into it, and reads AND
+ * it over whatever is on the chip. That gives the same result as
+ * programming the chip every time, without reading the page first.
+ *
+ * Pages are written out in the order in which they were dirtied, and
+ * everything pending is written out before an erase, so an erase is never
+ * reordered ahead of a program that preceded it. A write is only merged
+ * into the most recently dirtied page; a write to an older pending page
+ * first writes it out, along with everything dirtied before it, so libhal's
+ * deprecate / write new block / zero old header sequence reaches the chip
+ * in order.
+ *
+ * Finally, we keep a map of subsectors known to be blank: set by erases,
+ * by keystore_check_blank(), and by reads that find a whole subsector
+ * blank (as libhal's scan of the keystore does), cleared by writes. Reads of a blank
+ * subsector don't go to the chip, and erasing one again is skipped, so a
+ * background task that erases free subsectors ahead of time (see the HSM's
+ * keystore task) takes the erase off libhal's critical path.
+ *
+ * With DO_KEYSTORE_SNAPSHOT, the blank map is also saved on the chip, so
+ * that after a reboot, erasing a subsector that's still blank costs a read
+ * instead of an erase (see keystore_snapshot_load()).
+ *
+ * Like the rest of this API, the caches rely on the caller to serialize
+ * access (in the HSM, the keystore mutex).
+ *
+ * Everything in this file works on the whole chip. KEYSTORE_NUM_SUBSECTORS
+ * may be less than that (see keystore-log.h), so range checks here use
+ * the N25Q128 geometry.
+ */
+
+#define CACHE_FREE 0xFFFFFFFF
+
+#define KEYSTORE_PAGES_PER_SUBSECTOR (KEYSTORE_SUBSECTOR_SIZE / KEYSTORE_PAGE_SIZE)
+#define KEYSTORE_PAGES_PER_SECTOR    (KEYSTORE_SECTOR_SIZE / KEYSTORE_PAGE_SIZE)
+#define KEYSTORE_SUBSECTORS_PER_SECTOR (KEYSTORE_SECTOR_SIZE / KEYSTORE_SUBSECTOR_SIZE)
+
+struct keystore_rcache_entry {
+    uint32_t subsector;         /* subsector number, or CACHE_FREE */
+    uint32_t used;              /* LRU stamp */
+    uint8_t data[KEYSTORE_SUBSECTOR_SIZE];
+};
+
+struct keystore_wcache_entry {
+    uint32_t page;              /* page number, or CACHE_FREE */
+    uint32_t seq;               /* order in which entries were dirtied */
+    uint32_t tick;              /* when the entry was dirtied */
+    uint8_t data[KEYSTORE_PAGE_SIZE];
+};
+
+static struct keystore_rcache_entry *rcache;
+static size_t rcache_len;
+static uint32_t rcache_clock;
+
+static struct keystore_wcache_entry *wcache;
+static size_t wcache_len, wcache_used;
+static uint32_t wcache_seq;
+
+static uint32_t blank[N25Q128_NUM_SUBSECTORS / 32];
+static size_t blank_count;
+
+#ifdef DO_KEYSTORE_SNAPSHOT
+/* Subsectors the snapshot says are blank, which we haven't checked yet. */
+static uint32_t hint[N25Q128_NUM_SUBSECTORS / 32];
+#endif
+
+/* An asynchronous erase in progress */
+static int erase_busy;
+static uint32_t erase_first, erase_num;
+
+static struct keystore_cache_stats stats;
+
+#ifdef DO_KEYSTORE_SNAPSHOT
+static struct {
+    int enabled;                /* the snapshot subsectors are ours to use */
+    int slot;                   /* where the latest snapshot is, or -1 */
+    int current;                /* it's still safe to load */
+    int changed;                /* the blank map has changed since */
+    int pending;                /* keystore_snapshot_start() is erasing a slot */
+    int target;                 /* ...this one */
+    uint32_t generation;        /* highest one on the chip */
+    uint32_t changed_tick;
+} snap = { .slot = -1 };
+#endif
+
+static inline int blank_get(uint32_t subsector)
+{
+    return (blank[subsector / 32] >> (subsector % 32)) & 1;
+}
+
+#ifdef DO_KEYSTORE_SNAPSHOT
+static inline int hint_get(uint32_t subsector)
+{
+    return (hint[subsector / 32] >> (subsector % 32)) & 1;
+}
+#endif
+
+/* Record what we now know about some subsectors, which replaces whatever
+ * the snapshot said about them.
+ */
+static void blank_set_range(uint32_t first, uint32_t num, int value)
+{
+    for (uint32_t s = first; s < first + num; ++s) {
+        uint32_t bit = 1UL << (s % 32);
+#ifdef DO_KEYSTORE_SNAPSHOT
+        hint[s / 32] &= ~bit;
+#endif
+        if (value && !(blank[s / 32] & bit)) {
+            blank[s / 32] |= bit;
+            ++blank_count;
+        }
+        else if (!value && (blank[s / 32] & bit)) {
+            blank[s / 32] &= ~bit;
+            --blank_count;
+        }
+        else {
+            continue;
+        }
+#ifdef DO_KEYSTORE_SNAPSHOT
+        if (s < KEYSTORE_NUM_SUBSECTORS) {
+            snap.changed = 1;
+            snap.changed_tick = HAL_GetTick();
+        }
+#endif
+    }
+}
+
+#ifdef DO_KEYSTORE_SNAPSHOT
+static HAL_StatusTypeDef snapshot_write_prepare(uint32_t first, uint32_t last);
+#endif
+
+/* An erase failed, so we don't know what's in those subsectors any more.
+ * If the snapshot could say any of them is blank, mark it stale first;
+ * once the blank bits are cleared, a later write wouldn't know to.
+ */
+static void erase_failed(uint32_t first, uint32_t num)
+{
+#ifdef DO_KEYSTORE_SNAPSHOT
+    (void) snapshot_write_prepare(first, first + num - 1);
+#endif
+    blank_set_range(first, num, 0);
+}
+
+static void erase_done(HAL_StatusTypeDef status)
+{
+    erase_busy = 0;
+    if (status != HAL_OK)
+        erase_failed(erase_first, erase_num);
+}
+
+/* Wait for an asynchronous erase to finish before touching the chip,
+ * which ignores most commands while it's erasing.
+ */
+static HAL_StatusTypeDef keystore_idle(void)
+{
+    if (!erase_busy)
+        return HAL_OK;
+
+    HAL_StatusTypeDef status =
+        n25q128_erase_wait(&keystore_ctx, N25Q128_ERASE_SECTOR_TIMEOUT);
+    erase_done(status);
+    return status;
+}
+
+void keystore_read_cache_init(void *buf, size_t len)
+{
+    rcache = buf;
+    rcache_len = len / sizeof(*rcache);
+
+    if (rcache_len == 0)
+        rcache = NULL;
+
+    for (size_t i = 0; i < rcache_len; ++i)
+        rcache[i].subsector = CACHE_FREE;
+}
+
+void keystore_write_cache_init(void *buf, size_t len)
+{
+    wcache = buf;
+    wcache_len = len / sizeof(*wcache);
+    wcache_used = 0;
+
+    if (wcache_len == 0)
+        wcache = NULL;
+
+    for (size_t i = 0; i < wcache_len; ++i)
+        wcache[i].page = CACHE_FREE;
+}
+
+void keystore_get_cache_stats(struct keystore_cache_stats *s)
+{
+    *s = stats;
+    s->read_entries = rcache_len;
+    s->write_entries = wcache_len;
+    s->write_pending = wcache_used;
+    s->blank_subsectors = blank_count;
+#ifdef DO_KEYSTORE_SNAPSHOT
+    s->snapshot_generation = (snap.slot >= 0) ? snap.generation : 0;
+    s->snapshot_current = snap.current;
+#endif
+}
+
+void keystore_reset_cache_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+static struct keystore_rcache_entry *rcache_find(uint32_t subsector)
+{
+    for (size_t i = 0; i < rcache_len; ++i)
+        if (rcache[i].subsector == subsector)
+            return &rcache[i];
+    return NULL;
+}
+
+/* Find a subsector in the read cache, reading it from the chip (in place
+ * of the least recently used entry) if it isn't there.
+ */
+static struct keystore_rcache_entry *rcache_load(uint32_t subsector)
+{
+    struct keystore_rcache_entry *e = rcache_find(subsector);
+
+    if (e != NULL) {
+        ++stats.read_hits;
+    }
+    else {
+        ++stats.read_misses;
+
+        e = rcache_find(CACHE_FREE);
+        if (e == NULL) {
+            e = &rcache[0];
+            for (size_t i = 1; i < rcache_len; ++i)
+                if ((int32_t)(rcache[i].used - e->used) < 0)
+                    e = &rcache[i];
+        }
+
+        e->subsector = CACHE_FREE;
+        if (keystore_idle() != HAL_OK ||
+            n25q128_read_subsector(&keystore_ctx, subsector, e->data) != HAL_OK)
+            return NULL;
+        e->subsector = subsector;
+    }
+
+    e->used = ++rcache_clock;
+    return e;
+}
+
+/* Keep the read cache in step with a page program. */
+static void rcache_program(uint32_t page, const uint8_t *data, HAL_StatusTypeDef status)
+{
+    struct keystore_rcache_entry *e;
+
+    if (rcache == NULL || (e = rcache_find(page / KEYSTORE_PAGES_PER_SUBSECTOR)) == NULL)
+        return;
+
+    /* If the program failed, we don't know what's on the chip. */
+    if (status != HAL_OK) {
+        e->subsector = CACHE_FREE;
+        return;
+    }
+
+    uint8_t *p = e->data + (page % KEYSTORE_PAGES_PER_SUBSECTOR) * KEYSTORE_PAGE_SIZE;
+    for (size_t i = 0; i < KEYSTORE_PAGE_SIZE; ++i)
+        p[i] &= data[i];
+}
+
+/* Read from the chip, or from the read cache, or not at all if the
+ * subsector is known to be blank.
+ */
+static HAL_StatusTypeDef chip_read(uint32_t offset, uint8_t *buf, uint32_t len, int use_rcache)
+{
+    if (offset > N25Q128_NUM_SUBSECTORS * KEYSTORE_SUBSECTOR_SIZE ||
+        len > N25Q128_NUM_SUBSECTORS * KEYSTORE_SUBSECTOR_SIZE - offset)
+        return HAL_ERROR;
+
+    while (len > 0) {
+        uint32_t subsector = offset / KEYSTORE_SUBSECTOR_SIZE;
+        uint32_t off = offset % KEYSTORE_SUBSECTOR_SIZE;
+        uint32_t n = KEYSTORE_SUBSECTOR_SIZE - off;
+        if (n > len)
+            n = len;
+
+        if (blank_get(subsector)) {
+            ++stats.blank_reads;
+            memset(buf, 0xff, n);
+        }
+        else if (use_rcache && rcache != NULL) {
+            struct keystore_rcache_entry *e = rcache_load(subsector);
+            if (e == NULL)
+                return HAL_ERROR;
+            memcpy(buf, e->data + off, n);
+        }
+        else if (keystore_idle() != HAL_OK ||
+                 n25q128_read_data(&keystore_ctx, offset, buf, n) != HAL_OK) {
+            return HAL_ERROR;
+        }
+
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+
+    return HAL_OK;
+}
+
+static struct keystore_wcache_entry *wcache_find(uint32_t page)
+{
+    for (size_t i = 0; i < wcache_len; ++i)
+        if (wcache[i].page == page)
+            return &wcache[i];
+    return NULL;
+}
+
+static struct keystore_wcache_entry *wcache_oldest(void)
+{
+    struct keystore_wcache_entry *e = NULL;
+    for (size_t i = 0; i < wcache_len; ++i)
+        if (wcache[i].page != CACHE_FREE &&
+            (e == NULL || (int32_t)(wcache[i].seq - e->seq) < 0))
+            e = &wcache[i];
+    return e;
+}
+
+/* Program a pending page, and free its entry whether or not that worked,
+ * so a bad page doesn't wedge the cache.
+ */
+static HAL_StatusTypeDef wcache_write_back(struct keystore_wcache_entry *e)
+{
+    HAL_StatusTypeDef status = keystore_idle();
+
+    if (status == HAL_OK)
+        status = n25q128_write_page(&keystore_ctx, e->page, e->data);
+    rcache_program(e->page, e->data, status);
+    ++stats.write_backs;
+    if (status != HAL_OK)
+        ++stats.write_back_errors;
+
+    e->page = CACHE_FREE;
+    --wcache_used;
+    return status;
+}
+
+/* Write out pending pages, oldest first, that have been waiting at least
+ * `age' ms.
+ */
+HAL_StatusTypeDef keystore_cache_flush_expired(uint32_t age)
+{
+    HAL_StatusTypeDef status = HAL_OK;
+    struct keystore_wcache_entry *e;
+    uint32_t now = HAL_GetTick();
+
+    while ((e = wcache_oldest()) != NULL && now - e->tick >= age)
+        if (wcache_write_back(e) != HAL_OK)
+            status = HAL_ERROR;
+
+    return status;
+}
+
+/* Write out pending pages, oldest first, up to and including the one
+ * dirtied at `seq'.
+ */
+static HAL_StatusTypeDef wcache_write_back_through(uint32_t seq)
+{
+    HAL_StatusTypeDef status = HAL_OK;
+    struct keystore_wcache_entry *e;
+
+    while ((e = wcache_oldest()) != NULL && (int32_t)(e->seq - seq) <= 0)
+        if (wcache_write_back(e) != HAL_OK)
+            status = HAL_ERROR;
+
+    return status;
+}
+
+HAL_StatusTypeDef keystore_sync(void)
+{
+    return keystore_cache_flush_expired(0);
+}
+
+/* Get ready to erase part of the flash: cached reads of the area are
+ * dropped, pending programs to it are moot, and everything else pending
+ * is written out first.
+ */
+static HAL_StatusTypeDef cache_erase_prepare(uint32_t first_subsector, uint32_t num_subsectors)
+{
+    for (size_t i = 0; i < rcache_len; ++i)
+        if (rcache[i].subsector - first_subsector < num_subsectors)
+            rcache[i].subsector = CACHE_FREE;
+
+    if (wcache == NULL)
+        return HAL_OK;
+
+    uint32_t first_page = first_subsector * KEYSTORE_PAGES_PER_SUBSECTOR;
+    uint32_t num_pages = num_subsectors * KEYSTORE_PAGES_PER_SUBSECTOR;
+
+    for (size_t i = 0; i < wcache_len; ++i)
+        if (wcache[i].page - first_page < num_pages) {
+            wcache[i].page = CACHE_FREE;
+            --wcache_used;
+        }
+
+    return keystore_sync();
+}
+
+/* Remember any whole subsectors in a read that turned out to be blank. */
+static void blank_learn(uint32_t offset, const uint8_t *buf, const uint32_t len)
+{
+#ifdef DO_KEYSTORE_SNAPSHOT
+    /* A subsector the snapshot said was blank isn't, so somebody wrote the
+     * chip without marking the snapshot stale. Do that now.
+     */
+    for (uint32_t a = offset, end; a < offset + len; a = end) {
+        const uint32_t subsector = a / KEYSTORE_SUBSECTOR_SIZE;
+        end = (subsector + 1) * KEYSTORE_SUBSECTOR_SIZE;
+        if (end > offset + len)
+            end = offset + len;
+        if (!hint_get(subsector))
+            continue;
+        uint32_t i;
+        for (i = a; i < end && buf[i - offset] == 0xff; ++i)
+            ;
+        if (i < end) {
+            (void) snapshot_write_prepare(subsector, subsector);
+            blank_set_range(subsector, 1, 0);
+        }
+    }
+#endif
+
+    uint32_t off = (KEYSTORE_SUBSECTOR_SIZE - offset % KEYSTORE_SUBSECTOR_SIZE) % KEYSTORE_SUBSECTOR_SIZE;
+
+    for (; off + KEYSTORE_SUBSECTOR_SIZE <= len; off += KEYSTORE_SUBSECTOR_SIZE) {
+        const uint32_t subsector = (offset + off) / KEYSTORE_SUBSECTOR_SIZE;
+        if (blank_get(subsector))
+            continue;
+        uint32_t i;
+        for (i = 0; i < KEYSTORE_SUBSECTOR_SIZE && buf[off + i] == 0xff; ++i)
+            ;
+        if (i == KEYSTORE_SUBSECTOR_SIZE)
+            blank_set_range(subsector, 1, 1);
+    }
+}
+
+static HAL_StatusTypeDef read_data(uint32_t offset, uint8_t *buf, const uint32_t len, int use_rcache)
+{
+    HAL_StatusTypeDef status = chip_read(offset, buf, len, use_rcache);
+
+    if (status != HAL_OK)
+        return status;
+
+    /* Lay any pending programs over what we read from the chip. */
+    for (size_t i = 0; i < wcache_len && wcache_used > 0; ++i) {
+        struct keystore_wcache_entry *e = &wcache[i];
+        if (e->page == CACHE_FREE)
+            continue;
+        uint32_t start = e->page * KEYSTORE_PAGE_SIZE;
+        uint32_t lo = (start > offset) ? start : offset;
+        uint32_t hi = (start + KEYSTORE_PAGE_SIZE < offset + len) ? start + KEYSTORE_PAGE_SIZE : offset + len;
+        for (uint32_t a = lo; a < hi; ++a)
+            buf[a - offset] &= e->data[a - start];
+    }
+
+    blank_learn(offset, buf, len);
+    return HAL_OK;
+}
+
 HAL_StatusTypeDef keystore_read_data(uint32_t offset, uint8_t *buf, const uint32_t len)
 {
-    return n25q128_read_data(&keystore_ctx, offset, buf, len);
+    return read_data(offset, buf, len, 1);
 }
 
+/* Read without going through (or disturbing) the read cache, for
+ * background scans that would otherwise flush it.
+ */
+HAL_StatusTypeDef keystore_read_data_nocache(uint32_t offset, uint8_t *buf, const uint32_t len)
+{
+    return read_data(offset, buf, len, 0);
+}
+
+/* Find out whether a subsector is blank, and remember it if it is. */
+HAL_StatusTypeDef keystore_check_blank(uint32_t subsector_offset, int *is_blank)
+{
+    uint8_t page[KEYSTORE_PAGE_SIZE];
+    uint8_t mask = 0xff;
+
+    if (subsector_offset >= N25Q128_NUM_SUBSECTORS)
+        return HAL_ERROR;
+
+    if (blank_get(subsector_offset)) {
+        *is_blank = 1;
+        return HAL_OK;
+    }
+
+    uint32_t offset = subsector_offset * KEYSTORE_SUBSECTOR_SIZE;
+    for (size_t i = 0; i < KEYSTORE_PAGES_PER_SUBSECTOR && mask == 0xff; ++i) {
+        if (read_data(offset + i * KEYSTORE_PAGE_SIZE, page, sizeof(page), 0) != HAL_OK)
+            return HAL_ERROR;
+        for (size_t j = 0; j < sizeof(page); ++j)
+            mask &= page[j];
+    }
+
+    *is_blank = (mask == 0xff);
+    if (*is_blank)
+        blank_set_range(subsector_offset, 1, 1);
+    return HAL_OK;
+}
+
+/* Forget which subsectors are blank, so that reads and erases go to the
+ * chip again (for benchmarks, which want to time the chip, not the map).
+ */
+HAL_StatusTypeDef keystore_forget_blank(void)
+{
+#ifdef DO_KEYSTORE_SNAPSHOT
+    /* Once the bits are gone, a write wouldn't know to mark it stale. */
+    if (snapshot_write_prepare(0, KEYSTORE_NUM_SUBSECTORS - 1) != HAL_OK)
+        return HAL_ERROR;
+#endif
+    blank_set_range(0, KEYSTORE_NUM_SUBSECTORS, 0);
+    return HAL_OK;
+}
+
+#ifdef DO_KEYSTORE_SNAPSHOT
+/* Blank map snapshot.
+ *
+ * After a reboot, the blank map starts out empty, so the first erase of
+ * each subsector goes to the chip, blank or not, and an erase takes about
+ * 250 ms. A saved copy of the map lets us find out with a read instead.
+ *
+ * So the blank map is saved in one of two slots at the top of the chip:
+ * a header page (written last, so a torn save doesn't count), the map, and
+ * a "stale" page that stays blank while the snapshot is current. Only the
+ * slot with the highest generation number is loaded, and only if it's
+ * still current. The snapshot can miss subsectors that have been erased
+ * since, which just means they get read, but it mustn't claim any
+ * subsector is blank after it's been written, so the first write to a
+ * subsector it could claim is blank programs the stale page first. The
+ * HSM's keystore task saves a new snapshot in the other slot once the map
+ * has stopped changing for a while.
+ *
+ * Only firmware that knows about the snapshot marks it stale, though, and
+ * anything else (an older image, a flash programmer) can write the chip
+ * and leave it looking current. So what we load are hints, not blank
+ * bits: reads of those subsectors still go to the chip, and nothing is
+ * skipped because of a hint until the subsector has been checked. If a
+ * read finds data where the snapshot said there was none, the snapshot is
+ * marked stale.
+ *
+ * If the slots hold anything but snapshots (say, keys written before
+ * DO_KEYSTORE_SNAPSHOT was turned on), they're left alone until they're
+ * erased.
+ */
+
+#define SNAPSHOT_MAGIC          0x504e534b      /* "KSNP" */
+#define SNAPSHOT_MAP_PAGES      (sizeof(blank) / KEYSTORE_PAGE_SIZE)
+#define SNAPSHOT_STALE_PAGE     (1 + SNAPSHOT_MAP_PAGES)
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t num_subsectors;
+    uint32_t checksum;          /* of the above and the map */
+};
+
+static uint32_t snap_map[N25Q128_NUM_SUBSECTORS / 32];
+
+static inline uint32_t snapshot_page(int slot, uint32_t n)
+{
+    return (KEYSTORE_NUM_SUBSECTORS + slot) * KEYSTORE_PAGES_PER_SUBSECTOR + n;
+}
+
+/* FNV-1a */
+static uint32_t snapshot_checksum(const struct snapshot_header *h, const uint32_t *map)
+{
+    const uint8_t *p = (const uint8_t *)h;
+    uint32_t hash = 0x811c9dc5;
+
+    for (size_t i = 0; i < offsetof(struct snapshot_header, checksum); ++i)
+        hash = (hash ^ p[i]) * 0x01000193;
+    p = (const uint8_t *)map;
+    for (size_t i = 0; i < sizeof(snap_map); ++i)
+        hash = (hash ^ p[i]) * 0x01000193;
+    return hash;
+}
+
+static int snapshot_page_blank(const uint8_t *page)
+{
+    uint8_t mask = 0xff;
+    for (size_t i = 0; i < KEYSTORE_PAGE_SIZE; ++i)
+        mask &= page[i];
+    return mask == 0xff;
+}
+
+/* About to write subsectors first..last: if the snapshot could say any of
+ * them is blank, mark it stale. If even that fails, get rid of both slots.
+ */
+static HAL_StatusTypeDef snapshot_write_prepare(uint32_t first, uint32_t last)
+{
+    uint8_t zeros[KEYSTORE_PAGE_SIZE];
+    uint32_t s;
+
+    if (!snap.current)
+        return HAL_OK;
+
+    for (s = first; s <= last && s < KEYSTORE_NUM_SUBSECTORS && !blank_get(s) && !hint_get(s); ++s)
+        ;
+    if (s > last || s >= KEYSTORE_NUM_SUBSECTORS)
+        return HAL_OK;
+
+    memset(zeros, 0, sizeof(zeros));
+    HAL_StatusTypeDef status = keystore_idle();
+    if (status == HAL_OK)
+        status = n25q128_write_page(&keystore_ctx, snapshot_page(snap.slot, SNAPSHOT_STALE_PAGE), zeros);
+    snap.current = 0;
+    snap.changed = 1;
+    snap.changed_tick = HAL_GetTick();
+
+    for (int slot = 0; status != HAL_OK && slot < KEYSTORE_SNAPSHOT_SUBSECTORS; ++slot)
+        if (keystore_erase_subsector(KEYSTORE_NUM_SUBSECTORS + slot) != HAL_OK)
+            return HAL_ERROR;
+
+    return HAL_OK;
+}
+
+/* Keep track of erases that hit the snapshot slots. */
+static void snapshot_erased(uint32_t first, uint32_t num)
+{
+    if (snap.slot >= 0 && KEYSTORE_NUM_SUBSECTORS + snap.slot - first < num) {
+        snap.slot = -1;
+        snap.current = 0;
+        snap.changed = 1;
+    }
+
+    if (!snap.enabled) {
+        snap.enabled = 1;
+        for (int slot = 0; slot < KEYSTORE_SNAPSHOT_SUBSECTORS; ++slot)
+            snap.enabled &= blank_get(KEYSTORE_NUM_SUBSECTORS + slot);
+    }
+}
+
+/* Read a snapshot, returning its generation, or 0 if there isn't a valid
+ * one. Sets *ours if the slot looks like it's been used for snapshots
+ * (or not used at all), and *current if the snapshot is still current.
+ */
+static uint32_t snapshot_read(int slot, int *ours, int *current)
+{
+    uint8_t page[KEYSTORE_PAGE_SIZE];
+    struct snapshot_header h;
+
+    *ours = *current = 0;
+
+    if (read_data(snapshot_page(slot, 0) * KEYSTORE_PAGE_SIZE, page, sizeof(page), 0) != HAL_OK)
+        return 0;
+    memcpy(&h, page, sizeof(h));
+
+    if (h.magic != SNAPSHOT_MAGIC) {
+        *ours = snapshot_page_blank(page);
+        return 0;
+    }
+    *ours = 1;
+
+    if (h.num_subsectors != KEYSTORE_NUM_SUBSECTORS || h.generation == 0 ||
+        read_data(snapshot_page(slot, 1) * KEYSTORE_PAGE_SIZE,
+                  (uint8_t *)snap_map, sizeof(snap_map), 0) != HAL_OK ||
+        snapshot_checksum(&h, snap_map) != h.checksum)
+        return 0;
+
+    if (read_data(snapshot_page(slot, SNAPSHOT_STALE_PAGE) * KEYSTORE_PAGE_SIZE,
+                  page, sizeof(page), 0) == HAL_OK)
+        *current = snapshot_page_blank(page);
+
+    return h.generation;
+}
+
+/* Load the newest snapshot's blank map, as hints, before anything else
+ * touches the keystore. Returns HAL_ERROR if there's no snapshot we can
+ * use, in which case the first erase of each subsector goes to the chip.
+ */
+HAL_StatusTypeDef keystore_snapshot_load(void)
+{
+    int best = -1, ours, current;
+    uint32_t generation;
+
+    snap.enabled = 1;
+    snap.slot = -1;
+    snap.current = 0;
+    snap.changed = 1;
+    snap.generation = 0;
+
+    for (int slot = 0; slot < KEYSTORE_SNAPSHOT_SUBSECTORS; ++slot) {
+        generation = snapshot_read(slot, &ours, &current);
+        snap.enabled &= ours;
+        if (generation > snap.generation) {
+            snap.generation = generation;
+            best = current ? slot : -1;
+        }
+    }
+
+    if (!snap.enabled || best < 0 || snapshot_read(best, &ours, &current) != snap.generation)
+        return HAL_ERROR;
+
+    /* Only hints: see the top of this section. */
+    for (uint32_t s = 0; s < KEYSTORE_NUM_SUBSECTORS; ++s)
+        if (((snap_map[s / 32] >> (s % 32)) & 1) && !blank_get(s)) {
+            hint[s / 32] |= 1UL << (s % 32);
+            ++stats.snapshot_loaded;
+        }
+
+    snap.slot = best;
+    snap.current = 1;
+    snap.changed = 0;
+    return HAL_OK;
+}
+
+/* If the blank map has changed, and not in the last `quiet_ms' ms, start
+ * erasing the other slot for a new snapshot, and return 1. Call
+ * keystore_snapshot_poll() until it stops returning HAL_BUSY to finish.
+ */
+int keystore_snapshot_start(uint32_t quiet_ms)
+{
+    if (!snap.enabled || snap.pending || !snap.changed ||
+        HAL_GetTick() - snap.changed_tick < quiet_ms)
+        return 0;
+
+    snap.target = (snap.slot == 0) ? 1 : 0;
+    if (keystore_erase_subsector_start(KEYSTORE_NUM_SUBSECTORS + snap.target) != HAL_OK)
+        return 0;
+
+    snap.pending = 1;
+    return 1;
+}
+
+HAL_StatusTypeDef keystore_snapshot_poll(void)
+{
+    struct snapshot_header h;
+    uint8_t page[KEYSTORE_PAGE_SIZE];
+
+    if (!snap.pending)
+        return HAL_OK;
+
+    HAL_StatusTypeDef status = keystore_erase_poll();
+    if (status == HAL_BUSY)
+        return status;
+    snap.pending = 0;
+
+    const uint32_t subsector = KEYSTORE_NUM_SUBSECTORS + snap.target;
+    if (status != HAL_OK || !blank_get(subsector) || keystore_idle() != HAL_OK)
+        return HAL_ERROR;
+
+    /* Hints we haven't got round to checking are no worse than they were
+     * in the last snapshot, which was current until now.
+     */
+    for (size_t i = 0; i < sizeof(snap_map) / sizeof(*snap_map); ++i)
+        snap_map[i] = blank[i] | hint[i];
+    for (uint32_t s = KEYSTORE_NUM_SUBSECTORS; s < N25Q128_NUM_SUBSECTORS; ++s)
+        snap_map[s / 32] &= ~(1UL << (s % 32));
+
+    h.magic = SNAPSHOT_MAGIC;
+    h.generation = snap.generation + 1;
+    h.num_subsectors = KEYSTORE_NUM_SUBSECTORS;
+    h.checksum = snapshot_checksum(&h, snap_map);
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, &h, sizeof(h));
+
+    blank_set_range(subsector, 1, 0);
+    for (uint32_t i = 0; i < SNAPSHOT_MAP_PAGES && status == HAL_OK; ++i)
+        status = n25q128_write_page(&keystore_ctx, snapshot_page(snap.target, 1 + i),
+                                    (uint8_t *)snap_map + i * KEYSTORE_PAGE_SIZE);
+    if (status == HAL_OK)
+        status = n25q128_write_page(&keystore_ctx, snapshot_page(snap.target, 0), page);
+    if (status != HAL_OK)
+        return status;
+
+    snap.generation = h.generation;
+    snap.slot = snap.target;
+    snap.current = 1;
+    snap.changed = 0;
+    ++stats.snapshot_saves;
+    return HAL_OK;
+}
+#endif /* DO_KEYSTORE_SNAPSHOT */
+
+/* Would programming this page leave the chip as it is? We can tell without
+ * a read if the subsector is known to be blank, or is in the read cache.
+ */
+static int page_unchanged(uint32_t page, const uint8_t *data)
+{
+    const uint32_t subsector = page / KEYSTORE_PAGES_PER_SUBSECTOR;
+    struct keystore_rcache_entry *e;
+
+    if (blank_get(subsector)) {
+        for (size_t i = 0; i < KEYSTORE_PAGE_SIZE; ++i)
+            if (data[i] != 0xff)
+                return 0;
+        return 1;
+    }
+
+    if (rcache != NULL && (e = rcache_find(subsector)) != NULL) {
+        const uint8_t *p = e->data + (page % KEYSTORE_PAGES_PER_SUBSECTOR) * KEYSTORE_PAGE_SIZE;
+        for (size_t i = 0; i < KEYSTORE_PAGE_SIZE; ++i)
+            if ((p[i] & data[i]) != p[i])
+                return 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Program a run of pages that need it. */
+static HAL_StatusTypeDef write_pages(uint32_t first_page, uint32_t end_page, const uint8_t *buf)
+{
+#ifdef DO_KEYSTORE_SNAPSHOT
+    if (snapshot_write_prepare(first_page / KEYSTORE_PAGES_PER_SUBSECTOR,
+                               (end_page - 1) / KEYSTORE_PAGES_PER_SUBSECTOR) != HAL_OK)
+        return HAL_ERROR;
+#endif
+
+    blank_set_range(first_page / KEYSTORE_PAGES_PER_SUBSECTOR,
+                    (end_page - 1) / KEYSTORE_PAGES_PER_SUBSECTOR -
+                    first_page / KEYSTORE_PAGES_PER_SUBSECTOR + 1, 0);
+
+    if (wcache == NULL) {
+        if (keystore_idle() != HAL_OK)
+            return HAL_ERROR;
+        HAL_StatusTypeDef status = n25q128_write_data(&keystore_ctx, first_page * KEYSTORE_PAGE_SIZE, buf,
+                                                      (end_page - first_page) * KEYSTORE_PAGE_SIZE);
+        for (uint32_t page = first_page; page < end_page; ++page, buf += KEYSTORE_PAGE_SIZE)
+            rcache_program(page, buf, status);
+        return status;
+    }
+
+    for (uint32_t page = first_page; page < end_page; ++page, buf += KEYSTORE_PAGE_SIZE) {
+
+        struct keystore_wcache_entry *e = wcache_find(page);
+
+        /* Only merge into the newest entry; see the top of the file. */
+        if (e != NULL && e->seq != wcache_seq - 1) {
+            if (wcache_write_back_through(e->seq) != HAL_OK)
+                return HAL_ERROR;
+            e = NULL;
+        }
+
+        if (e != NULL) {
+            ++stats.write_merges;
+        }
+        else {
+            if (wcache_used == wcache_len &&
+                wcache_write_back(wcache_oldest()) != HAL_OK)
+                return HAL_ERROR;
+            e = wcache_find(CACHE_FREE);
+            e->page = page;
+            e->seq = wcache_seq++;
+            e->tick = HAL_GetTick();
+            memset(e->data, 0xff, sizeof(e->data));
+            ++wcache_used;
+        }
+
+        for (size_t i = 0; i < KEYSTORE_PAGE_SIZE; ++i)
+            e->data[i] &= buf[i];
+    }
+
+    return HAL_OK;
+}
+
+/* Compare before programming: pages that wouldn't change (blank padding
+ * written to an erased block, or a block rewritten as it was) are skipped,
+ * and the rest are programmed in runs.
+ */
 HAL_StatusTypeDef keystore_write_data(uint32_t offset, const uint8_t *buf, const uint32_t len)
 {
-    return n25q128_write_data(&keystore_ctx, offset, buf, len);
+    /* Same constraints as n25q128_write_data() */
+    if (offset % KEYSTORE_PAGE_SIZE != 0 || len % KEYSTORE_PAGE_SIZE != 0 ||
+        (offset + len) / KEYSTORE_PAGE_SIZE > N25Q128_NUM_PAGES)
+        return HAL_ERROR;
+
+    uint32_t page = offset / KEYSTORE_PAGE_SIZE;
+    const uint32_t end_page = (offset + len) / KEYSTORE_PAGE_SIZE;
+
+    stats.write_pages += end_page - page;
+
+    while (page < end_page) {
+        if (page_unchanged(page, buf)) {
+            ++stats.write_unchanged;
+            ++page;
+            buf += KEYSTORE_PAGE_SIZE;
+            continue;
+        }
+
+        uint32_t run = page + 1;
+        while (run < end_page && !page_unchanged(run, buf + (run - page) * KEYSTORE_PAGE_SIZE))
+            ++run;
+
+        if (write_pages(page, run, buf) != HAL_OK)
+            return HAL_ERROR;
+
+        buf += (run - page) * KEYSTORE_PAGE_SIZE;
+        page = run;
+    }
+
+    return HAL_OK;
+}
+
+/* Get ready to erase some subsectors. Returns HAL_BUSY if they're all
+ * blank already, so there's nothing to do.
+ */
+static HAL_StatusTypeDef erase_begin(uint32_t first, uint32_t num)
+{
+    if (first >= N25Q128_NUM_SUBSECTORS || num > N25Q128_NUM_SUBSECTORS - first)
+        return HAL_ERROR;
+
+    uint32_t s;
+    for (s = first; s < first + num; ++s) {
+        int is_blank = blank_get(s);
+#ifdef DO_KEYSTORE_SNAPSHOT
+        /* Not on the snapshot's say-so, but a read is a lot quicker than
+         * an erase.
+         */
+        if (!is_blank && hint_get(s) && keystore_check_blank(s, &is_blank) != HAL_OK)
+            is_blank = 0;
+#endif
+        if (!is_blank)
+            break;
+    }
+    if (s == first + num) {
+        ++stats.erases_skipped;
+        return HAL_BUSY;
+    }
+
+    if (cache_erase_prepare(first, num) != HAL_OK || keystore_idle() != HAL_OK)
+        return HAL_ERROR;
+
+    return HAL_OK;
+}
+
+static HAL_StatusTypeDef erase_end(uint32_t first, uint32_t num, HAL_StatusTypeDef status)
+{
+    if (status == HAL_OK)
+        blank_set_range(first, num, 1);
+    else
+        erase_failed(first, num);
+#ifdef DO_KEYSTORE_SNAPSHOT
+    snapshot_erased(first, num);
+#endif
+    return status;
+}
+
+/* An asynchronous erase has been started; the subsectors will be blank
+ * once it finishes.
+ */
+static HAL_StatusTypeDef erase_started(uint32_t first, uint32_t num, HAL_StatusTypeDef status)
+{
+    if (status == HAL_OK) {
+        erase_busy = 1;
+        erase_first = first;
+        erase_num = num;
+    }
+    return erase_end(first, num, status);
 }
 
 HAL_StatusTypeDef keystore_erase_subsector(uint32_t subsector_offset)
 {
-    return n25q128_erase_subsector(&keystore_ctx, subsector_offset);
+    HAL_StatusTypeDef status = erase_begin(subsector_offset, 1);
+    if (status != HAL_OK)
+        return (status == HAL_BUSY) ? HAL_OK : status;
+    return erase_end(subsector_offset, 1,
+                     n25q128_erase_subsector(&keystore_ctx, subsector_offset));
 }
 
 HAL_StatusTypeDef keystore_erase_sector(uint32_t sector_offset)
 {
-    return n25q128_erase_sector(&keystore_ctx, sector_offset);
+    uint32_t first = sector_offset * KEYSTORE_SUBSECTORS_PER_SECTOR;
+    HAL_StatusTypeDef status = erase_begin(first, KEYSTORE_SUBSECTORS_PER_SECTOR);
+    if (status != HAL_OK)
+        return (status == HAL_BUSY) ? HAL_OK : status;
+    return erase_end(first, KEYSTORE_SUBSECTORS_PER_SECTOR,
+                     n25q128_erase_sector(&keystore_ctx, sector_offset));
 }
 
 HAL_StatusTypeDef keystore_erase_bulk(void)
 {
-    return n25q128_erase_bulk(&keystore_ctx);
+    cache_erase_prepare(0, N25Q128_NUM_SUBSECTORS);
+    if (keystore_idle() != HAL_OK)
+        return HAL_ERROR;
+    return erase_end(0, N25Q128_NUM_SUBSECTORS, n25q128_erase_bulk(&keystore_ctx));
+}
+
+/* A sector erase takes about as long as three subsector erases (0.7 s
+ * vs. 0.25 s typical), so erase a sector with fewer dirty subsectors
+ * than this one subsector at a time.
+ */
+#define KEYSTORE_ERASE_SECTOR_MIN_DIRTY 3
+
+/* Typical erase times in milliseconds, for deciding when a bulk erase
+ * would be quicker after all.
+ */
+#define KEYSTORE_ERASE_SUBSECTOR_MS     250
+#define KEYSTORE_ERASE_SECTOR_MS        700
+#define KEYSTORE_ERASE_BULK_MS          45000
+
+/* Erase whatever isn't blank already, a sector at a time, and report
+ * progress after each sector. On a keystore that's mostly empty, this is
+ * a lot quicker than a bulk erase, which takes about 45 seconds however
+ * little there is to erase; on one that's mostly full, it falls back to
+ * a bulk erase. Each erase yields while the chip is busy.
+ */
+HAL_StatusTypeDef keystore_erase_used(keystore_erase_progress_t progress)
+{
+    static uint8_t dirty[N25Q128_NUM_SECTORS];
+    uint32_t estimate = 0, erased = 0;
+
+    /* Count dirty subsectors, up to the point where we'd erase the
+     * whole sector anyway.
+     */
+    for (uint32_t sector = 0; sector < N25Q128_NUM_SECTORS; ++sector) {
+        const uint32_t first = sector * KEYSTORE_SUBSECTORS_PER_SECTOR;
+        int is_blank;
+
+        dirty[sector] = 0;
+        for (uint32_t s = first;
+             s < first + KEYSTORE_SUBSECTORS_PER_SECTOR && dirty[sector] < KEYSTORE_ERASE_SECTOR_MIN_DIRTY;
+             ++s) {
+            if (keystore_check_blank(s, &is_blank) != HAL_OK)
+                return HAL_ERROR;
+            dirty[sector] += !is_blank;
+        }
+
+        estimate += (dirty[sector] >= KEYSTORE_ERASE_SECTOR_MIN_DIRTY)
+            ? KEYSTORE_ERASE_SECTOR_MS
+            : dirty[sector] * KEYSTORE_ERASE_SUBSECTOR_MS;
+    }
+
+    if (estimate >= KEYSTORE_ERASE_BULK_MS) {
+        if (keystore_erase_bulk() != HAL_OK)
+            return HAL_ERROR;
+        if (progress != NULL)
+            progress(N25Q128_NUM_SECTORS, N25Q128_NUM_SECTORS, N25Q128_NUM_SUBSECTORS);
+        return HAL_OK;
+    }
+
+    for (uint32_t sector = 0; sector < N25Q128_NUM_SECTORS; ++sector) {
+        const uint32_t first = sector * KEYSTORE_SUBSECTORS_PER_SECTOR;
+
+        if (dirty[sector] >= KEYSTORE_ERASE_SECTOR_MIN_DIRTY) {
+            if (keystore_erase_sector(sector) != HAL_OK)
+                return HAL_ERROR;
+            erased += KEYSTORE_SUBSECTORS_PER_SECTOR;
+        }
+        else if (dirty[sector] > 0) {
+            /* Blank subsectors are skipped. */
+            for (uint32_t s = first; s < first + KEYSTORE_SUBSECTORS_PER_SECTOR; ++s)
+                if (keystore_erase_subsector(s) != HAL_OK)
+                    return HAL_ERROR;
+            erased += dirty[sector];
+        }
+
+        if (progress != NULL)
+            progress(sector + 1, N25Q128_NUM_SECTORS, erased);
+    }
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef keystore_erase_subsector_start(uint32_t subsector_offset)
+{
+    HAL_StatusTypeDef status = erase_begin(subsector_offset, 1);
+    if (status != HAL_OK)
+        return (status == HAL_BUSY) ? HAL_OK : status;
+    return erase_started(subsector_offset, 1,
+                         n25q128_erase_subsector_start(&keystore_ctx, subsector_offset));
+}
+
+HAL_StatusTypeDef keystore_erase_sector_start(uint32_t sector_offset)
+{
+    uint32_t first = sector_offset * KEYSTORE_SUBSECTORS_PER_SECTOR;
+    HAL_StatusTypeDef status = erase_begin(first, KEYSTORE_SUBSECTORS_PER_SECTOR);
+    if (status != HAL_OK)
+        return (status == HAL_BUSY) ? HAL_OK : status;
+    return erase_started(first, KEYSTORE_SUBSECTORS_PER_SECTOR,
+                         n25q128_erase_sector_start(&keystore_ctx, sector_offset));
+}
+
+/* Returns HAL_BUSY while an erase started above is still running. */
+HAL_StatusTypeDef keystore_erase_poll(void)
+{
+    if (!erase_busy)
+        return HAL_OK;
+
+    HAL_StatusTypeDef status = n25q128_erase_poll(&keystore_ctx);
+    if (status != HAL_BUSY)
+        erase_done(status);
+    return status;
+}
+
+HAL_StatusTypeDef keystore_erase_wait(uint32_t timeout)
+{
+    if (!erase_busy)
+        return HAL_OK;
+
+    HAL_StatusTypeDef status = n25q128_erase_wait(&keystore_ctx, timeout);
+    if (status != HAL_TIMEOUT)
+        erase_done(status);
+    return status;
 }
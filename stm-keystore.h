@@ -39,11 +39,30 @@
 #include "spiflash_n25q128.h"
 
 #define KEYSTORE_PAGE_SIZE		   N25Q128_PAGE_SIZE
-#define KEYSTORE_NUM_PAGES		   N25Q128_NUM_PAGES
 #define KEYSTORE_SECTOR_SIZE		   N25Q128_SECTOR_SIZE
-#define KEYSTORE_NUM_SECTORS		   N25Q128_NUM_SECTORS
 #define KEYSTORE_SUBSECTOR_SIZE		   N25Q128_SUBSECTOR_SIZE
+
+#if defined(DO_KEYSTORE_LOG) && defined(DO_KEYSTORE_SNAPSHOT)
+#error DO_KEYSTORE_SNAPSHOT is redundant with DO_KEYSTORE_LOG, whose journal already says what is in use
+#endif
+
+#ifdef DO_KEYSTORE_LOG
+/* The log-structured layer (keystore-log.h) keeps part of the chip for
+ * itself, so its users see fewer subsectors than there are.
+ */
+#define KEYSTORE_LOG_NUM_BLOCKS		   3840
+#define KEYSTORE_NUM_SUBSECTORS		   KEYSTORE_LOG_NUM_BLOCKS
+#elif defined(DO_KEYSTORE_SNAPSHOT)
+/* The blank map snapshot (see stm-keystore.c) lives in the last
+ * subsectors of the chip.
+ */
+#define KEYSTORE_SNAPSHOT_SUBSECTORS	   2
+#define KEYSTORE_NUM_SUBSECTORS		   (N25Q128_NUM_SUBSECTORS - KEYSTORE_SNAPSHOT_SUBSECTORS)
+#else
 #define KEYSTORE_NUM_SUBSECTORS		   N25Q128_NUM_SUBSECTORS
+#endif
+#define KEYSTORE_NUM_PAGES		   (KEYSTORE_NUM_SUBSECTORS * (KEYSTORE_SUBSECTOR_SIZE / KEYSTORE_PAGE_SIZE))
+#define KEYSTORE_NUM_SECTORS		   (KEYSTORE_NUM_SUBSECTORS / (KEYSTORE_SECTOR_SIZE / KEYSTORE_SUBSECTOR_SIZE))
 
 /* Pins connected to the FPGA config memory (SPI flash) */
 #define KSM_PROM_CS_N_Pin                  GPIO_PIN_0
@@ -55,6 +74,8 @@
     gpio_output(KSM_PROM_CS_N_GPIO_Port, KSM_PROM_CS_N_Pin, GPIO_PIN_SET)
 
 
+extern struct spiflash_ctx keystore_ctx;
+
 extern void keystore_init(void);
 extern HAL_StatusTypeDef keystore_check_id(void);
 extern HAL_StatusTypeDef keystore_read_data(uint32_t offset, uint8_t *buf, const uint32_t len);
@@ -63,4 +84,56 @@ extern HAL_StatusTypeDef keystore_erase_subsector(uint32_t subsector_offset);
 extern HAL_StatusTypeDef keystore_erase_sector(uint32_t sector_offset);
 extern HAL_StatusTypeDef keystore_erase_bulk(void);
 
+/* Called by keystore_erase_used() after each of `num_sectors' sectors,
+ * with the number of subsectors erased so far.
+ */
+typedef void (*keystore_erase_progress_t)(uint32_t sectors_done, uint32_t num_sectors, uint32_t subsectors_erased);
+extern HAL_StatusTypeDef keystore_erase_used(keystore_erase_progress_t progress);
+extern HAL_StatusTypeDef keystore_erase_subsector_start(uint32_t subsector_offset);
+extern HAL_StatusTypeDef keystore_erase_sector_start(uint32_t sector_offset);
+extern HAL_StatusTypeDef keystore_erase_poll(void);
+extern HAL_StatusTypeDef keystore_erase_wait(uint32_t timeout);
+
+/* Read and write-back caches, see stm-keystore.c. Off until given a buffer. */
+#define KEYSTORE_CACHE_FLUSH_MS		1000
+
+struct keystore_cache_stats {
+    uint32_t read_entries;      /* subsectors the read cache can hold */
+    uint32_t read_hits, read_misses;
+    uint32_t write_entries;     /* pages the write-back cache can hold */
+    uint32_t write_pending;     /* pages waiting to be written back */
+    uint32_t write_pages;       /* pages written by the caller */
+    uint32_t write_merges;      /* ...that were already pending */
+    uint32_t write_unchanged;   /* ...that the chip already held */
+    uint32_t write_backs;       /* pages programmed on the chip */
+    uint32_t write_back_errors; /* ...that failed, and were lost */
+    uint32_t blank_subsectors;  /* subsectors known to be erased */
+    uint32_t blank_reads;       /* reads of those, not sent to the chip */
+    uint32_t erases_skipped;    /* erases of those, not sent to the chip */
+    uint32_t snapshot_generation; /* of the blank map snapshot, 0 if none */
+    uint32_t snapshot_current;  /* whether that's up to date */
+    uint32_t snapshot_loaded;   /* subsectors it said were blank at boot */
+    uint32_t snapshot_saves;
+};
+
+extern void keystore_read_cache_init(void *buf, size_t len);
+extern void keystore_write_cache_init(void *buf, size_t len);
+extern void keystore_get_cache_stats(struct keystore_cache_stats *stats);
+extern void keystore_reset_cache_stats(void);
+extern HAL_StatusTypeDef keystore_cache_flush_expired(uint32_t age);
+extern HAL_StatusTypeDef keystore_sync(void);
+
+extern HAL_StatusTypeDef keystore_read_data_nocache(uint32_t offset, uint8_t *buf, const uint32_t len);
+extern HAL_StatusTypeDef keystore_check_blank(uint32_t subsector_offset, int *is_blank);
+extern HAL_StatusTypeDef keystore_forget_blank(void);
+
+#ifdef DO_KEYSTORE_SNAPSHOT
+/* Wait this long after the blank map last changed before saving it. */
+#define KEYSTORE_SNAPSHOT_QUIET_MS	60000
+
+extern HAL_StatusTypeDef keystore_snapshot_load(void);
+extern int keystore_snapshot_start(uint32_t quiet_ms);
+extern HAL_StatusTypeDef keystore_snapshot_poll(void);
+#endif
+
 #endif /* __STM32_KEYSTORE_H */
@@ -0,0 +1,310 @@
+/*
+ * stm-memfunc.c
+ * -------------
+ * Cortex-M4 optimized memcpy/memset/memmove.
+ *
+ * Copyright (c) 2018, NORDUnet A/S All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the NORDUnet nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * These replace newlib's generic mem functions in the hsm and bootloader
+ * builds (see MEMFUNC_LDFLAGS in the top-level Makefile). SLIP, XDR and
+ * bignum code does a lot of copying, most of it either tiny (a few header
+ * words) or large and word-aligned (RPC buffers, key blobs).
+ *
+ * - Copies of fewer than 16 bytes use unaligned word accesses, which the
+ *   Cortex-M4 handles in hardware, and avoid all setup overhead.
+ * - Larger copies align the destination, then move 32 bytes at a time with
+ *   LDM/STM bursts of 8 registers.
+ * - If the source is still misaligned after that, we read aligned words
+ *   and shift-merge them, rather than doing unaligned or byte loads.
+ *
+ * This file has to be compiled with -fno-builtin and
+ * -fno-tree-loop-distribute-patterns, so that gcc doesn't "optimize" the
+ * tail loops into calls to the functions we're defining.
+ */
+
+#include <stdint.h>
+
+#include "stm-memfunc.h"
+
+#define is_word_aligned(x) (((size_t)(x) & 3) == 0)
+
+/* Unaligned accesses. With unaligned access support (the gcc default for
+ * Cortex-M4), these compile to plain LDR/STR/LDRH/STRH.
+ */
+typedef struct { uint32_t v; } __attribute__((packed)) unaligned_u32;
+typedef struct { uint16_t v; } __attribute__((packed)) unaligned_u16;
+
+#define get32(p)        (((const unaligned_u32 *)(p))->v)
+#define put32(p, x)     (((unaligned_u32 *)(p))->v = (x))
+#define get16(p)        (((const unaligned_u16 *)(p))->v)
+#define put16(p, x)     (((unaligned_u16 *)(p))->v = (x))
+
+/* Copy less than 16 bytes, forwards. */
+static inline void copy_small(uint8_t *d, const uint8_t *s, size_t n)
+{
+    if (n & 8) {
+        uint32_t a = get32(s), b = get32(s + 4);
+        put32(d, a);
+        put32(d + 4, b);
+        d += 8; s += 8;
+    }
+    if (n & 4) {
+        put32(d, get32(s));
+        d += 4; s += 4;
+    }
+    if (n & 2) {
+        put16(d, get16(s));
+        d += 2; s += 2;
+    }
+    if (n & 1)
+        *d = *s;
+}
+
+/* Copy nbursts * 32 bytes, forwards, word-aligned. nbursts must be > 0. */
+static inline void copy_bursts(uint32_t **dp, const uint32_t **sp, size_t nbursts)
+{
+    uint32_t *d = *dp;
+    const uint32_t *s = *sp;
+
+#if defined(__ARM_ARCH_7EM__)
+    __asm__ volatile (
+        "1:\n\t"
+        "ldmia %[s]!, {r3, r4, r5, r6, r8, r9, r10, r12}\n\t"
+        "subs  %[n], %[n], #1\n\t"
+        "stmia %[d]!, {r3, r4, r5, r6, r8, r9, r10, r12}\n\t"
+        "bne   1b\n\t"
+        : [d] "+r" (d), [s] "+r" (s), [n] "+r" (nbursts)
+        :
+        : "r3", "r4", "r5", "r6", "r8", "r9", "r10", "r12", "cc", "memory");
+#else
+    do {
+        d[0] = s[0]; d[1] = s[1]; d[2] = s[2]; d[3] = s[3];
+        d[4] = s[4]; d[5] = s[5]; d[6] = s[6]; d[7] = s[7];
+        d += 8; s += 8;
+    } while (--nbursts);
+#endif
+
+    *dp = d;
+    *sp = s;
+}
+
+/* Copy nwords words from a misaligned source to an aligned destination,
+ * forwards. We only read aligned words that contain bytes we need.
+ */
+static inline uint32_t *copy_shifted(uint32_t *d, const uint8_t *s, size_t nwords)
+{
+    const unsigned rs = 8 * ((size_t)s & 3), ls = 32 - rs;
+    const uint32_t *s32 = (const uint32_t *)(s - ((size_t)s & 3));
+    uint32_t w0 = *s32++, w1, w2, w3, w4;
+
+    for (; nwords >= 4; nwords -= 4) {
+        w1 = s32[0]; w2 = s32[1]; w3 = s32[2]; w4 = s32[3];
+        d[0] = (w0 >> rs) | (w1 << ls);
+        d[1] = (w1 >> rs) | (w2 << ls);
+        d[2] = (w2 >> rs) | (w3 << ls);
+        d[3] = (w3 >> rs) | (w4 << ls);
+        w0 = w4;
+        s32 += 4; d += 4;
+    }
+
+    for (; nwords > 0; --nwords) {
+        w1 = *s32++;
+        *d++ = (w0 >> rs) | (w1 << ls);
+        w0 = w1;
+    }
+
+    return d;
+}
+
+void *stm_memcpy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d8 = (uint8_t *)dst;
+    const uint8_t *s8 = (const uint8_t *)src;
+
+    if (n < 16) {
+        copy_small(d8, s8, n);
+        return dst;
+    }
+
+    while (!is_word_aligned(d8)) {
+        *d8++ = *s8++;
+        --n;
+    }
+
+    uint32_t *d32 = (uint32_t *)d8;
+
+    if (is_word_aligned(s8)) {
+        const uint32_t *s32 = (const uint32_t *)s8;
+        if (n >= 32)
+            copy_bursts(&d32, &s32, n / 32);
+        for (n &= 31; n >= 4; n -= 4)
+            *d32++ = *s32++;
+        s8 = (const uint8_t *)s32;
+    }
+    else {
+        d32 = copy_shifted(d32, s8, n / 4);
+        s8 += n & ~3;
+        n &= 3;
+    }
+
+    d8 = (uint8_t *)d32;
+    while (n-- > 0)
+        *d8++ = *s8++;
+
+    return dst;
+}
+
+void *stm_memset(void *dst, int c, size_t n)
+{
+    uint8_t *d8 = (uint8_t *)dst;
+    const uint32_t c32 = 0x01010101U * (uint8_t)c;
+
+    if (n < 16) {
+        if (n & 8) {
+            put32(d8, c32);
+            put32(d8 + 4, c32);
+            d8 += 8;
+        }
+        if (n & 4) {
+            put32(d8, c32);
+            d8 += 4;
+        }
+        if (n & 2) {
+            put16(d8, (uint16_t)c32);
+            d8 += 2;
+        }
+        if (n & 1)
+            *d8 = (uint8_t)c32;
+        return dst;
+    }
+
+    while (!is_word_aligned(d8)) {
+        *d8++ = (uint8_t)c32;
+        --n;
+    }
+
+    uint32_t *d32 = (uint32_t *)d8;
+    size_t nbursts = n / 32;
+
+    if (nbursts > 0) {
+#if defined(__ARM_ARCH_7EM__)
+        __asm__ volatile (
+            "mov   r3,  %[c]\n\t"
+            "mov   r4,  %[c]\n\t"
+            "mov   r5,  %[c]\n\t"
+            "mov   r6,  %[c]\n\t"
+            "mov   r8,  %[c]\n\t"
+            "mov   r9,  %[c]\n\t"
+            "mov   r10, %[c]\n\t"
+            "mov   r12, %[c]\n\t"
+            "1:\n\t"
+            "subs  %[n], %[n], #1\n\t"
+            "stmia %[d]!, {r3, r4, r5, r6, r8, r9, r10, r12}\n\t"
+            "bne   1b\n\t"
+            : [d] "+r" (d32), [n] "+r" (nbursts)
+            : [c] "r" (c32)
+            : "r3", "r4", "r5", "r6", "r8", "r9", "r10", "r12", "cc", "memory");
+#else
+        do {
+            d32[0] = c32; d32[1] = c32; d32[2] = c32; d32[3] = c32;
+            d32[4] = c32; d32[5] = c32; d32[6] = c32; d32[7] = c32;
+            d32 += 8;
+        } while (--nbursts);
+#endif
+    }
+
+    for (n &= 31; n >= 4; n -= 4)
+        *d32++ = c32;
+
+    d8 = (uint8_t *)d32;
+    while (n-- > 0)
+        *d8++ = (uint8_t)c32;
+
+    return dst;
+}
+
+void *stm_memmove(void *dst, const void *src, size_t n)
+{
+    uint8_t *d8 = (uint8_t *)dst;
+    const uint8_t *s8 = (const uint8_t *)src;
+
+    /* stm_memcpy() only ever reads ahead of where it writes, so it's safe
+     * unless the destination overlaps the end of the source.
+     */
+    if (d8 <= s8 || d8 >= s8 + n)
+        return stm_memcpy(dst, src, n);
+
+    /* Destructive overlap...have to copy backwards */
+    d8 += n;
+    s8 += n;
+
+    if (n >= 16 && ((size_t)d8 & 3) == ((size_t)s8 & 3)) {
+        while (!is_word_aligned(d8)) {
+            *--d8 = *--s8;
+            --n;
+        }
+
+        uint32_t *d32 = (uint32_t *)d8;
+        const uint32_t *s32 = (const uint32_t *)s8;
+        size_t nbursts = n / 32;
+
+        if (nbursts > 0) {
+#if defined(__ARM_ARCH_7EM__)
+            __asm__ volatile (
+                "1:\n\t"
+                "ldmdb %[s]!, {r3, r4, r5, r6, r8, r9, r10, r12}\n\t"
+                "subs  %[n], %[n], #1\n\t"
+                "stmdb %[d]!, {r3, r4, r5, r6, r8, r9, r10, r12}\n\t"
+                "bne   1b\n\t"
+                : [d] "+r" (d32), [s] "+r" (s32), [n] "+r" (nbursts)
+                :
+                : "r3", "r4", "r5", "r6", "r8", "r9", "r10", "r12", "cc", "memory");
+#else
+            do {
+                d32 -= 8; s32 -= 8;
+                d32[7] = s32[7]; d32[6] = s32[6]; d32[5] = s32[5]; d32[4] = s32[4];
+                d32[3] = s32[3]; d32[2] = s32[2]; d32[1] = s32[1]; d32[0] = s32[0];
+            } while (--nbursts);
+#endif
+        }
+
+        for (n &= 31; n >= 4; n -= 4)
+            *--d32 = *--s32;
+
+        d8 = (uint8_t *)d32;
+        s8 = (const uint8_t *)s32;
+    }
+
+    while (n-- > 0)
+        *--d8 = *--s8;
+
+    return dst;
+}
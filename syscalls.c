@@ -114,20 +114,40 @@ int _close_r (struct _reent *r, int file)
 /* Register name faking - works in collusion with the linker.  */
 register char * stack_ptr __asm ("sp");
 
+/* If the linker script sets aside an SDRAM region for the heap, malloc
+ * uses that, which leaves internal SRAM for the main stack and static data,
+ * and means running out of heap can't silently run into the stack. SDRAM
+ * has to be initialized (by stm_init) before the first call to malloc.
+ *
+ * Otherwise (every project but the HSM firmware), the linker script sets
+ * the symbols to 0, and the heap grows up from the end of static data
+ * toward the stack in internal SRAM.
+ */
+extern char __sdram_heap_start __asm ("__sdram_heap_start") __attribute__((weak));
+extern char __sdram_heap_end __asm ("__sdram_heap_end") __attribute__((weak));
+
 caddr_t _sbrk_r (struct _reent *r, int incr)
 {
   extern char   end __asm ("end"); /* Defined by the linker.  */
   static char * heap_end;
+  static char * heap_limit;
   char *        prev_heap_end;
 
   r = r;
 
-  if (heap_end == NULL)
-    heap_end = & end;
+  if (heap_end == NULL) {
+    if (&__sdram_heap_start != NULL) {
+      heap_end = &__sdram_heap_start;
+      heap_limit = &__sdram_heap_end;
+    }
+    else {
+      heap_end = & end;
+    }
+  }
   
   prev_heap_end = heap_end;
   
-  if (heap_end + incr > stack_ptr)
+  if (heap_end + incr > (heap_limit != NULL ? heap_limit : stack_ptr))
   {
       /* Some of the libstdc++-v3 tests rely upon detecting
         out of memory errors, so do not abort here.  */
@@ -41,6 +41,9 @@
 
 #include "stm-init.h"
 #include "task.h"
+#ifdef DO_MPU_STACK_GUARD
+#include "stm-uart.h"
+#endif
 
 /* Task Control Block. The structure is private, in case we want to change
  * it later without having to change the API. In any case, external code
@@ -57,14 +60,19 @@ struct task_cb {
     void *stack_base;
     size_t stack_len;
     void *stack_ptr;
+
+    /* Set if the task was woken while it was still running. */
+    volatile unsigned wake_pending;
 };
 
-/* Number of tasks. Default is number of RPC dispatch tasks, plus CLI task. */
+/* Number of tasks. Default is number of RPC dispatch tasks, plus busy,
+ * keystore, FPGA upload and CLI tasks.
+ */
 #ifndef MAX_TASK
 #ifdef NUM_RPC_TASK
-#define MAX_TASK (NUM_RPC_TASK + 2)
+#define MAX_TASK (NUM_RPC_TASK + 4)
 #else
-#define MAX_TASK 6
+#define MAX_TASK 7
 #endif
 #endif
 
@@ -81,6 +89,47 @@ static tcb_t *cur_task = NULL;
 
 #define STACK_GUARD_WORD 0x55AA5A5A
 
+#ifdef DO_MPU_STACK_GUARD
+/* Instead of checking the guard word on every context switch, put an MPU
+ * no-access region at the bottom of the running task's stack, so an
+ * overflow faults on the spot. The region has to be aligned to its size,
+ * so we lose up to 2 * MPU_GUARD_SIZE bytes at the bottom of each stack.
+ *
+ * We use the highest-priority region, with the default memory map
+ * (PRIVDEFENA) for everything else.
+ */
+#define MPU_GUARD_REGION        7
+#define MPU_GUARD_SIZE          32
+#define MPU_GUARD_RASR_SIZE     (4 << MPU_RASR_SIZE_Pos)        /* 2^(4+1) = 32 */
+
+/* Lowest usable address of the stack, i.e. the top of the guard region. */
+static inline uint32_t *stack_bottom(tcb_t *t)
+{
+    uint32_t guard = ((uint32_t)t->stack_base + MPU_GUARD_SIZE - 1) & ~(MPU_GUARD_SIZE - 1);
+    return (uint32_t *)(guard + MPU_GUARD_SIZE);
+}
+
+/* Move the guard region to the bottom of this task's stack. */
+static inline void stack_guard_set(tcb_t *t)
+{
+    static int mpu_enabled = 0;
+
+    MPU->RBAR = ((uint32_t)stack_bottom(t) - MPU_GUARD_SIZE) | MPU_RBAR_VALID_Msk | MPU_GUARD_REGION;
+
+    if (!mpu_enabled) {
+        MPU->RASR = MPU_RASR_XN_Msk | MPU_GUARD_RASR_SIZE | MPU_RASR_ENABLE_Msk;
+        MPU->CTRL = MPU_CTRL_PRIVDEFENA_Msk | MPU_CTRL_ENABLE_Msk;
+        SCB->SHCSR |= SCB_SHCSR_MEMFAULTENA_Msk;
+        mpu_enabled = 1;
+    }
+
+    __DSB();
+    __ISB();
+}
+#else
+#define stack_bottom(t) ((uint32_t *)(t)->stack_base)
+#endif
+
 #ifdef DO_TASK_METRICS
 static uint32_t tick_start = 0;
 static uint32_t tick_idle  = 0;
@@ -105,6 +154,7 @@ tcb_t *task_add(char *name, funcp_t func, void *cookie, void *stack, size_t stac
 
     tcb_t *t = &tcbs[num_task++];
     t->state = TASK_INIT;
+    t->wake_pending = 0;
 
     t->name = name;
     t->func = func;
@@ -114,7 +164,7 @@ tcb_t *task_add(char *name, funcp_t func, void *cookie, void *stack, size_t stac
     t->stack_len = stack_len;
     t->stack_ptr = stack + stack_len;
 
-    for (uint32_t *p = (uint32_t *)t->stack_base; p < (uint32_t *)t->stack_ptr; ++p)
+    for (uint32_t *p = stack_bottom(t); p < (uint32_t *)t->stack_ptr; ++p)
         *p = STACK_GUARD_WORD;
 
     if (tail == NULL) {
@@ -142,8 +192,9 @@ void task_mod(char *name, funcp_t func, void *cookie)
     t->func = func;
     t->cookie = cookie;
     t->state = TASK_INIT;
+    t->wake_pending = 0;
     t->stack_ptr = t->stack_base + t->stack_len;
-    for (uint32_t *p = (uint32_t *)t->stack_base; p < (uint32_t *)t->stack_ptr; ++p)
+    for (uint32_t *p = stack_bottom(t); p < (uint32_t *)t->stack_ptr; ++p)
         *p = STACK_GUARD_WORD;
     __set_MSP((uint32_t)cur_task->stack_ptr);
     task_yield();
@@ -188,6 +239,7 @@ static tcb_t *next_task(void)
     return (cur_task->state == TASK_WAITING) ? NULL : cur_task;
 }
 
+#ifndef DO_MPU_STACK_GUARD
 /* Check for stack overruns.
  */
 static void check_stack(tcb_t *t)
@@ -197,6 +249,7 @@ static void check_stack(tcb_t *t)
         *(uint32_t *)t->stack_base != STACK_GUARD_WORD)
         Error_Handler();
 }
+#endif
 
 /* Yield control to the next runnable task.
  */
@@ -258,12 +311,18 @@ void task_yield(void)
         __asm("push {r0-r12, lr}");
         cur_task->stack_ptr = (void *)__get_MSP();
 
+#ifndef DO_MPU_STACK_GUARD
         /* Check for stack overruns. */
         check_stack(cur_task);
+#endif
     }
 
     cur_task = next;
 
+#ifdef DO_MPU_STACK_GUARD
+    stack_guard_set(cur_task);
+#endif
+
     /* If task is in init state, call its entry point. */
     if (cur_task->state == TASK_INIT) {
         __set_MSP((uint32_t)cur_task->stack_ptr);
@@ -288,12 +347,33 @@ void task_yield_maybe(void)
         task_yield();
 }
 
+/* Get ready to sleep: call this before checking whatever the task is
+ * about to wait for, then task_sleep() if it still has to. Wakeups from
+ * before this are forgotten, so they don't cut a later sleep short.
+ */
+void task_sleep_prepare(void)
+{
+    if (cur_task != NULL)
+        cur_task->wake_pending = 0;
+}
+
 /* Put the current task to sleep (make it non-runnable).
+ *
+ * If the task was woken (e.g. by an interrupt handler) after it decided to
+ * sleep (see task_sleep_prepare) but before it got here, don't go to sleep,
+ * or we'll miss the wakeup.
  */
 void task_sleep(void)
 {
-    if (cur_task != NULL)
-        cur_task->state = TASK_WAITING;
+    if (cur_task != NULL) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        if (cur_task->wake_pending)
+            cur_task->wake_pending = 0;
+        else
+            cur_task->state = TASK_WAITING;
+        __set_PRIMASK(primask);
+    }
 
     task_yield();
 }
@@ -302,8 +382,11 @@ void task_sleep(void)
  */
 void task_wake(tcb_t *t)
 {
-    if (t != NULL)
+    if (t != NULL) {
+        if (t == cur_task && t->state == TASK_READY)
+            t->wake_pending = 1;
         t->state = TASK_READY;
+    }
 }
 
 /* Accessor functions */
@@ -359,11 +442,12 @@ size_t task_get_stack_highwater(tcb_t *t)
     if (t == NULL)
         t = cur_task;
 
-    const uint32_t * const b = (uint32_t *)t->stack_base;
+    const uint32_t *b = stack_bottom(t);
+    const uint32_t * const top = (uint32_t *)(t->stack_base + t->stack_len);
 
-    for (size_t i = 0; i < t->stack_len/4; ++i) {
-        if (b[i] != STACK_GUARD_WORD) {
-            return (t->stack_len - (i * 4));
+    for (; b < top; ++b) {
+        if (*b != STACK_GUARD_WORD) {
+            return ((void *)top - (void *)b);
         }
     }
 
@@ -413,6 +497,77 @@ void task_mutex_unlock(task_mutex_t *mutex)
 	mutex->locked = 0;
 }
 
+/* Locking for newlib's malloc. malloc doesn't yield, but libcli and libhal
+ * callbacks run malloc/free from several tasks, and anything that does
+ * yield while holding the lock mustn't let another task into the heap.
+ * newlib takes the lock recursively (e.g. realloc calling malloc), so we
+ * keep track of the owner and nesting depth. This must not be called from
+ * interrupt context.
+ */
+static task_mutex_t malloc_mutex = { 0 };
+static tcb_t *malloc_owner = NULL;
+static unsigned malloc_depth = 0;
+
+struct _reent;
+
+void __malloc_lock(struct _reent *r)
+{
+    r = r;
+
+    if (malloc_depth > 0 && malloc_owner == cur_task) {
+        ++malloc_depth;
+        return;
+    }
+
+    task_mutex_lock(&malloc_mutex);
+    malloc_owner = cur_task;
+    malloc_depth = 1;
+}
+
+void __malloc_unlock(struct _reent *r)
+{
+    r = r;
+
+    if (malloc_depth > 0 && --malloc_depth == 0) {
+        malloc_owner = NULL;
+        task_mutex_unlock(&malloc_mutex);
+    }
+}
+
+#ifdef DO_MPU_STACK_GUARD
+/* The MemManage fault is taken on the overflowed stack, so switch to a
+ * stack of our own before doing anything else.
+ */
+static uint32_t fault_stack[128] __attribute__((used));
+
+/* MemManage fault status: MMFAR holds a valid fault address */
+#define MMFSR_MMARVALID (1UL << 7)
+
+static void __attribute__((used, noreturn)) stack_overflow_report(void)
+{
+    uart_send_string("\r\nStack overflow in task ");
+    uart_send_string((cur_task == NULL) ? "(none)" : cur_task->name);
+    if (SCB->CFSR & MMFSR_MMARVALID) {
+        uart_send_string(" at 0x");
+        uart_send_hex(SCB->MMFAR, 8);
+    }
+    uart_send_string("\r\n");
+
+    Error_Handler();
+    while (1) { ; }
+}
+
+void __attribute__((naked)) MemManage_Handler(void)
+{
+    __asm volatile (
+        "movw r0, #:lower16:fault_stack + 512\n\t"
+        "movt r0, #:upper16:fault_stack + 512\n\t"
+        "msr  msp, r0\n\t"
+        "b    stack_overflow_report\n\t"
+        );
+}
+#endif
+
 #ifdef DO_TASK_METRICS
 void task_get_metrics(struct task_metrics *tm)
 {
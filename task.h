@@ -57,6 +57,7 @@ extern void task_set_idle_hook(funcp_t func);
 
 extern void task_yield(void);
 extern void task_yield_maybe(void);
+extern void task_sleep_prepare(void);
 extern void task_sleep(void);
 extern void task_wake(tcb_t *t);
 